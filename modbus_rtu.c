@@ -46,6 +46,7 @@
 #endif
 
 #include "modbus_rtu.h"
+#include "trace.h"
 
 #ifndef MODBUS_BAUDRATE
 #define MODBUS_BAUDRATE 3 // 19200
@@ -60,15 +61,123 @@
 #ifndef MODBUS_DIR_AUX
 #define MODBUS_DIR_AUX    -1
 #endif
+#ifndef MODBUS_RTU_STREAM1
+#define MODBUS_RTU_STREAM1 -1       // stream instance for the second bus, -1 for the next free ModBus capable stream
+#endif
+#ifndef MODBUS_DIR_AUX1
+#define MODBUS_DIR_AUX1   -1        // direction port for the second bus, -1 for the port below the one for the first bus
+#endif
+#ifndef MODBUS_CRC_TABLE
+#define MODBUS_CRC_TABLE  1 // 0 - bitwise, 1 - 16 entry nibble table, 2 - 256 entry byte table
+#endif
+#ifndef MODBUS_CRC_BENCHMARK
+#define MODBUS_CRC_BENCHMARK 0
+#endif
+#ifndef MODBUS_RTU_SLAVES
+#define MODBUS_RTU_SLAVES 4         // number of slaves scheduled separately, any more share the last entry
+#endif
+#ifndef MODBUS_SLAVE_BACKOFF
+#define MODBUS_SLAVE_BACKOFF 50     // ms, initial backoff after a slave timed out, doubled on each consecutive timeout
+#endif
+#ifndef MODBUS_SLAVE_BACKOFF_MAX
+#define MODBUS_SLAVE_BACKOFF_MAX 2000
+#endif
+#ifndef MODBUS_PRIORITY_AGING
+#define MODBUS_PRIORITY_AGING 100   // ms, telemetry queued for longer is sent ahead of commands
+#endif
+#ifndef MODBUS_SLAVE_BACKOFF_HOLD
+#define MODBUS_SLAVE_BACKOFF_HOLD 2 // max commands held for a slave backing off, the oldest are dropped
+#endif
 
-typedef struct queue_entry {
+#ifndef MODBUS_RTU_BINDINGS
+#define MODBUS_RTU_BINDINGS 8       // max slave addresses bound to a bus other than the first
+#endif
+#if MODBUS_RTU_BUSES > 2
+#error "Max two ModBus RTU buses are supported!"
+#endif
+
+#define SLOT_NONE 0xFF
+#define RING_SIZE (MODBUS_QUEUE_LENGTH + 1)
+#define FLUSH_REQUESTS 4            // pending flush requests by slave address, on overflow the queue is flushed
+
+typedef struct {
     bool async;
     bool sent;
+    uint8_t next;                   // next slot in the pending list of the slave
+    modbus_msg_flags_t flags;
+    uint32_t queued;                // ms
     modbus_message_t msg;
     modbus_callbacks_t callbacks;
-    struct queue_entry *next;
 } queue_entry_t;
 
+typedef struct {
+    uint8_t head;
+    uint8_t tail;
+    uint8_t count;
+} slot_list_t;
+
+typedef struct {
+    uint8_t address;
+    uint8_t failures;               // consecutive timeouts
+    uint32_t backoff_until;         // ms
+    slot_list_t pending[ModBus_Priorities];
+} modbus_slave_t;
+
+typedef struct {
+    uint32_t poll_skipped;      // systick polls skipped since another poller context was active
+    uint32_t event_deferred;    // stream events left to the next poll since another poller context was active
+    uint32_t kick_deferred;     // async sends not started by the producer since a poller context was active
+    uint32_t send_nested;       // async sends dropped since issued while another send was being queued
+    uint32_t queue_full;        // async sends dropped since the queue was full
+    uint32_t backoff_dropped;   // telemetry dropped since the slave was backing off after a timeout
+    uint32_t stale_dropped;     // telemetry dropped since an identical request was already pending
+    uint32_t aged;              // telemetry sent ahead of commands since it had waited for too long
+    uint32_t coalesced;         // pending writes replaced by a newer write to the same register
+    uint32_t slave_flushed;     // messages dropped by a flush of the messages for a slave
+} modbus_stats_t;
+
+// Request to drop the messages queued for a slave before the request, ready_count is the number of messages queued then.
+typedef struct {
+    uint8_t address;
+    uint32_t ready_count;
+} flush_request_t;
+
+#define N_LATENCY_BUCKETS MODBUS_LATENCY_BUCKETS
+
+static const uint16_t latency_limit[N_LATENCY_BUCKETS - 1] = { 2, 5, 10, 20, 50, 100, 200 }; // ms, upper bounds of the latency histogram buckets, the last bucket holds the rest
+
+// Messages are built in slots from a fixed pool, slots are handed between the producer (foreground) and
+// the consumer (the poller running from the systick, the stream interrupts or the foreground loop) by two
+// single producer, single consumer rings of slot indices: ready_slots from producer to consumer and free_slots back.
+// Ready messages are sorted into per slave, per priority pending lists owned by the consumer.
+typedef struct {
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    uint8_t slot[RING_SIZE];
+} slot_ring_t;
+
+#ifdef __GNUC__
+#define ring_load(idx) __atomic_load_n(&(idx), __ATOMIC_ACQUIRE)
+#define ring_store(idx, val) __atomic_store_n(&(idx), (val), __ATOMIC_RELEASE)
+#define flag_test_and_set(flag) __atomic_test_and_set((void *)&(flag), __ATOMIC_ACQUIRE)
+#define flag_clear(flag) __atomic_clear((void *)&(flag), __ATOMIC_RELEASE)
+#else
+#define ring_load(idx) (idx)
+#define ring_store(idx, val) (idx) = (val)
+#define flag_test_and_set(flag) flag_test_and_set_plain(&(flag))
+#define flag_clear(flag) (flag) = false
+
+static inline bool flag_test_and_set_plain (volatile bool *flag)
+{
+    bool set = *flag;
+
+    *flag = true;
+
+    return set;
+}
+#endif
+#define ring_next(idx) (((idx) + 1) % RING_SIZE)
+
 static const uint32_t baud[] = { 2400, 4800, 9600, 19200, 38400, 115200 };
 static const modbus_silence_timeout_t dflt_timeout =
 {
@@ -80,20 +189,63 @@ static const modbus_silence_timeout_t dflt_timeout =
     .b115200 = 2
 };
 
-static modbus_stream_t stream;
-static uint32_t rx_timeout = 0, silence_until = 0, silence_timeout;
-static int16_t exception_code = 0;
-static modbus_silence_timeout_t silence;
-static queue_entry_t queue[MODBUS_QUEUE_LENGTH];
-static modbus_settings_t modbus;
-static volatile bool spin_lock = false, is_up = false;
-static volatile queue_entry_t *tail, *head, *packet = NULL;
-static volatile modbus_state_t state = ModBus_Idle;
+// State of a bus: a claimed serial stream with its own queue, state machine, timing and statistics.
+typedef struct {
+    uint8_t id;
+    uint8_t instance;                       // instance of the claimed serial stream
 #if MODBUS_ENABLE & MODBUS_RTU_DIR_ENABLED
-static uint8_t dir_port;
+    uint8_t dir_port;
 #endif
+    modbus_stream_t stream;
+    uint32_t rx_timeout, silence_until, silence_timeout, rx_time, rx_gap, t3_5;
+    uint_fast16_t rx_count;
+    volatile bool rx_idle;                  // RX idle event latched by the stream interrupt
+    bool silence_custom;
+    int16_t exception_code;
+    modbus_silence_timeout_t silence;
+    queue_entry_t queue[MODBUS_QUEUE_LENGTH];
+    queue_entry_t sync_msg;
+    volatile bool busy, send_busy;
+    volatile uint_fast8_t flush_seq, flush_head;
+    uint_fast8_t flush_ack, reserved, rr_slave;
+    slot_ring_t free_slots, ready_slots;
+    volatile uint32_t ready_count;          // messages made ready by the producer
+    uint32_t collected;                     // messages taken from the ready ring by the consumer
+    flush_request_t flush_request[FLUSH_REQUESTS];
+    volatile uint_fast8_t flush_request_head, flush_request_tail;
+    modbus_slave_t slaves[MODBUS_RTU_SLAVES];
+    modbus_slave_t *slave;                  // slave of the async packet in flight
+    volatile queue_entry_t *packet;
+    modbus_stats_t stats;
+    modbus_link_stats_t link_stats[MODBUS_RTU_SLAVES];
+    modbus_link_stats_t *tx_stats;          // link statistics of the packet in flight
+    volatile uint_fast8_t n_link_stats;
+    uint32_t tx_time;
+    volatile modbus_state_t state;
+} modbus_bus_t;
+
+// Slave address to bus binding, unbound addresses are on the first bus.
+typedef struct {
+    uint8_t address;
+    uint8_t bus;
+} modbus_binding_t;
+
+static modbus_settings_t modbus;
+static volatile bool is_up = false;
+static uint_fast8_t n_buses = 0;
+static modbus_bus_t buses[MODBUS_RTU_BUSES] = {0};
+#if MODBUS_RTU_BUSES > 1
+static uint_fast8_t n_bindings = 0;
+static modbus_binding_t bindings[MODBUS_RTU_BINDINGS];
+#endif
+
+static struct {
+    uint8_t instance;
+    stream_set_event_handler_ptr set_event_handler;
+} stream_events[MODBUS_RTU_BUSES] = {0};
 
 static driver_reset_ptr driver_reset;
+static on_execute_realtime_ptr on_execute_realtime;
 static on_report_options_ptr on_report_options;
 static nvs_address_t nvs_address;
 
@@ -101,15 +253,20 @@ static status_code_t modbus_set_baud (setting_id_t id, uint_fast16_t value);
 static uint32_t modbus_get_baud (setting_id_t setting);
 static void modbus_settings_restore (void);
 static void modbus_settings_load (void);
+static void modbus_rtu_flush_queue (void);
+static void bus_flush_queue (modbus_bus_t *bus);
 
 // Compute the MODBUS RTU CRC
+
+#if MODBUS_CRC_TABLE == 0 || MODBUS_CRC_BENCHMARK
+
 static uint16_t modbus_CRC16x (const char *buf, uint_fast16_t len)
 {
     uint16_t crc = 0xFFFF;
     uint_fast8_t pos, i;
 
     for (pos = 0; pos < len; pos++) {
-        crc ^= (uint16_t)buf[pos];          // XOR byte into least sig. byte of crc
+        crc ^= (uint8_t)buf[pos];           // XOR byte into least sig. byte of crc
         for (i = 8; i != 0; i--) {          // Loop over each bit
             if ((crc & 0x0001) != 0) {      // If the LSB is set
                 crc >>= 1;                  // Shift right and XOR 0xA001
@@ -122,145 +279,885 @@ static uint16_t modbus_CRC16x (const char *buf, uint_fast16_t len)
     // Note, this number has low and high bytes swapped, so use it accordingly (or swap bytes)
     return crc;
 }
+
+#endif
+
+#if MODBUS_CRC_TABLE == 1 || MODBUS_CRC_BENCHMARK
+
+// Nibble table for the reflected polynomial 0xA001, 32 bytes of flash.
+static const uint16_t crc_nibble[16] = {
+    0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+    0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+
+static uint16_t modbus_CRC16n (const char *buf, uint_fast16_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    while(len--) {
+        crc ^= (uint8_t)*buf++;
+        crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+        crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+    }
+
+    return crc;
+}
+
+#endif
+
+#if MODBUS_CRC_TABLE == 2 || MODBUS_CRC_BENCHMARK
+
+// Byte table for the reflected polynomial 0xA001, 512 bytes of flash.
+static const uint16_t crc_byte[256] = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+static uint16_t modbus_CRC16t (const char *buf, uint_fast16_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    while(len--)
+        crc = (crc >> 8) ^ crc_byte[(crc ^ (uint8_t)*buf++) & 0xFF];
+
+    return crc;
+}
+
+#endif
+
+#if MODBUS_CRC_TABLE == 2
+static modbus_crc16_ptr modbus_CRC16 = modbus_CRC16t;
+#elif MODBUS_CRC_TABLE == 1
+static modbus_crc16_ptr modbus_CRC16 = modbus_CRC16n;
+#else
+static modbus_crc16_ptr modbus_CRC16 = modbus_CRC16x;
+#endif
+
 /*
 static bool valid_crc (const char *buf, uint_fast16_t len)
 {
-    uint16_t crc = modbus_CRC16x(buf, len - 2);
+    uint16_t crc = modbus_CRC16(buf, len - 2);
 
     return buf[len - 1] == (crc >> 8) && buf[len - 2] == (crc & 0xFF);
 }
 */
+static inline void set_callbacks (queue_entry_t *entry, const modbus_callbacks_t *callbacks)
+{
+    if(callbacks) {
+        entry->callbacks.on_rx_packet = callbacks->on_rx_packet;
+        entry->callbacks.on_rx_exception = callbacks->on_rx_exception;
+    } else {
+        entry->callbacks.on_rx_packet = NULL;
+        entry->callbacks.on_rx_exception = NULL;
+    }
+}
+
+static inline void add_message (queue_entry_t *entry, modbus_message_t *msg, const modbus_callbacks_t *callbacks)
+{
+    entry->sent = false;
+    memcpy(&entry->msg, msg, sizeof(modbus_message_t));
+    set_callbacks(entry, callbacks);
+}
+
+static inline void set_direction (modbus_bus_t *bus, bool tx)
+{
+#if MODBUS_ENABLE & MODBUS_RTU_DIR_ENABLED
+    hal.port.digital_out(bus->dir_port, tx);
+#endif
+}
+
+// Time base for silence and inter character timing, microseconds if the driver provides
+// hal.get_micros, milliseconds otherwise.
+static inline uint32_t get_time (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks();
+}
+
+// Derive the inter frame (t3.5) timing from the baud rate, 11 bits per character. t3.5 is also used as the end of frame gap
+// for replies rather than t1.5 since UARTs with a FIFO or DMA may hand over received characters in bursts.
+// Without a microsecond time base the millisecond silence periods from the timeout table are used.
+static void set_timing (modbus_bus_t *bus, uint32_t baud_idx)
+{
+    uint32_t char_us = (11000000UL + baud[baud_idx] - 1) / baud[baud_idx];
+
+    bus->t3_5 = (char_us * 7 + 1) / 2;
+
+    if(hal.get_micros) {
+        bus->rx_gap = bus->t3_5;
+        bus->silence_timeout = bus->silence_custom ? max(bus->silence.timeout[baud_idx] * 1000, bus->t3_5) : bus->t3_5;
+    } else {
+        bus->rx_gap = bus->t3_5 / 1000 + 2;
+        bus->silence_timeout = bus->silence.timeout[baud_idx];
+    }
+}
+
+// Poller contexts nest on a single core and a nested context always runs to completion,
+// a plain flag is thus sufficient to keep them from running the consumer side concurrently.
+static inline bool consumer_enter (modbus_bus_t *bus)
+{
+    if(bus->busy)
+        return false;
+
+    bus->busy = true;
+
+    return true;
+}
+
+static inline void consumer_exit (modbus_bus_t *bus)
+{
+    bus->busy = false;
+}
+
+static inline bool ring_push (slot_ring_t *ring, uint8_t slot)
+{
+    uint_fast8_t head = ring->head;
+
+    if(ring_next(head) == ring_load(ring->tail))
+        return false;
+
+    ring->slot[head] = slot;
+    ring_store(ring->head, ring_next(head));
+
+    return true;
+}
+
+static inline uint8_t ring_pop (slot_ring_t *ring)
+{
+    uint8_t slot;
+    uint_fast8_t tail = ring->tail;
+
+    if(tail == ring_load(ring->head))
+        return SLOT_NONE;
+
+    slot = ring->slot[tail];
+    ring_store(ring->tail, ring_next(tail));
+
+    return slot;
+}
+
+static inline void list_append (modbus_bus_t *bus, slot_list_t *list, uint8_t slot)
+{
+    bus->queue[slot].next = SLOT_NONE;
+
+    if(list->tail == SLOT_NONE)
+        list->head = slot;
+    else
+        bus->queue[list->tail].next = slot;
+
+    list->tail = slot;
+    list->count++;
+}
+
+static inline uint8_t list_pop (modbus_bus_t *bus, slot_list_t *list)
+{
+    uint8_t slot;
+
+    if((slot = list->head) != SLOT_NONE) {
+        list->count--;
+        if((list->head = bus->queue[slot].next) == SLOT_NONE)
+            list->tail = SLOT_NONE;
+    }
+
+    return slot;
+}
+
+// Consumer side, returns a slot to the pool.
+static inline void slot_release (modbus_bus_t *bus, uint8_t slot)
+{
+    ring_push(&bus->free_slots, slot);
+}
+
+// Consumer side, returns a message dropped while its slave backs off to the pool.
+// The sender is told if it asked to be notified of failures, the slot is released first so that it can requeue.
+static void slot_drop (modbus_bus_t *bus, uint8_t slot)
+{
+    void *context = bus->queue[slot].msg.context;
+    void (*on_rx_exception)(uint8_t code, void *context) = bus->queue[slot].flags.notify ? bus->queue[slot].callbacks.on_rx_exception : NULL;
+
+    bus->stats.backoff_dropped++;
+    slot_release(bus, slot);
+
+    if(on_rx_exception)
+        on_rx_exception(MODBUS_RTU_DROPPED, context);
+}
+
+static void list_release (modbus_bus_t *bus, slot_list_t *list)
+{
+    uint8_t slot;
+
+    while((slot = list_pop(bus, list)) != SLOT_NONE)
+        slot_release(bus, slot);
+}
+
+static inline bool slave_backoff (modbus_slave_t *target, uint32_t ms)
+{
+    return target->failures && (int32_t)(ms - target->backoff_until) < 0;
+}
 
-static inline void add_message (queue_entry_t *packet, modbus_message_t *msg, const modbus_callbacks_t *callbacks)
+static modbus_slave_t *slave_get (modbus_bus_t *bus, uint8_t address)
 {
-    packet->sent = false;
-    memcpy(&packet->msg, msg, sizeof(modbus_message_t));
-    if(callbacks)
-        memcpy(&packet->callbacks, callbacks, sizeof(modbus_callbacks_t));
+    uint_fast8_t idx = MODBUS_RTU_SLAVES;
+    modbus_slave_t *unused = NULL;
+
+    do {
+        if(bus->slaves[--idx].address == address)
+            return &bus->slaves[idx];
+        if(bus->slaves[idx].failures == 0 && bus->slaves[idx].pending[ModBus_PriorityHigh].head == SLOT_NONE &&
+                                         bus->slaves[idx].pending[ModBus_PriorityLow].head == SLOT_NONE && &bus->slaves[idx] != bus->slave)
+            unused = &bus->slaves[idx];
+    } while(idx);
+
+    if(unused)
+        unused->address = address;
+
+    return unused ? unused : &bus->slaves[MODBUS_RTU_SLAVES - 1];
+}
+
+// Consumer side, assigns a free entry to a new address.
+static modbus_link_stats_t *link_stats_get (modbus_bus_t *bus, uint8_t address)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < bus->n_link_stats; idx++) {
+        if(bus->link_stats[idx].address == address)
+            return &bus->link_stats[idx];
+    }
+
+    if(bus->n_link_stats == MODBUS_RTU_SLAVES)
+        return &bus->link_stats[MODBUS_RTU_SLAVES - 1];
+
+    bus->link_stats[bus->n_link_stats].address = address;
+
+    return &bus->link_stats[bus->n_link_stats++];
+}
+
+// Producer side, does not assign entries.
+static modbus_link_stats_t *link_stats_find (modbus_bus_t *bus, uint8_t address)
+{
+    uint_fast8_t idx = bus->n_link_stats;
+
+    while(idx) {
+        if(bus->link_stats[--idx].address == address)
+            return &bus->link_stats[idx];
+    }
+
+    return NULL;
+}
+
+static void link_stats_tx (modbus_bus_t *bus, modbus_message_t *msg)
+{
+    bus->tx_stats = link_stats_get(bus, msg->adu[0]);
+    bus->tx_stats->sent++;
+    bus->tx_time = get_time();
+
+    spindle_trace(SpindleTrace_ModBusTX, msg->adu[0], msg->adu[1], 0.0f);
+}
+
+static void link_stats_reply (modbus_bus_t *bus)
+{
+    uint_fast8_t idx = 0;
+    uint32_t latency = get_time() - bus->tx_time;
+
+    if(!hal.get_micros)
+        latency *= 1000;
+
+    bus->tx_stats->replies++;
+    if(latency > bus->tx_stats->latency_max)
+        bus->tx_stats->latency_max = latency;
+
+    while(idx < N_LATENCY_BUCKETS - 1 && latency >= latency_limit[idx] * 1000UL)
+        idx++;
+
+    bus->tx_stats->latency[idx]++;
+
+    spindle_trace(SpindleTrace_ModBusRX, bus->packet->msg.adu[0], bus->packet->msg.adu[1], (float)latency);
+}
+
+// Update slave health after a transaction, consecutive timeouts make the slave back off exponentially
+// and drop its pending telemetry and all but the latest commands so a dead slave does not hold up the bus or the slot pool.
+static void slave_update (modbus_bus_t *bus, modbus_slave_t *target, bool timeout)
+{
+    if(!timeout)
+        target->failures = 0;
     else {
-        packet->callbacks.on_rx_packet = NULL;
-        packet->callbacks.on_rx_exception = NULL;
+        if(target->failures < 8)
+            target->failures++;
+        target->backoff_until = hal.get_elapsed_ticks() + min(MODBUS_SLAVE_BACKOFF << (target->failures - 1), MODBUS_SLAVE_BACKOFF_MAX);
+        while(target->pending[ModBus_PriorityLow].head != SLOT_NONE)
+            slot_drop(bus, list_pop(bus, &target->pending[ModBus_PriorityLow]));
+        while(target->pending[ModBus_PriorityHigh].count > MODBUS_SLAVE_BACKOFF_HOLD)
+            slot_drop(bus, list_pop(bus, &target->pending[ModBus_PriorityHigh]));
     }
 }
 
+// Returns true if an identical request is already pending in the list.
+static bool list_has_duplicate (modbus_bus_t *bus, slot_list_t *list, uint8_t slot)
+{
+    uint8_t idx = list->head;
+    queue_entry_t *entry = &bus->queue[slot];
+
+    while(idx != SLOT_NONE) {
+        if(bus->queue[idx].msg.tx_length == entry->msg.tx_length &&
+            bus->queue[idx].msg.context == entry->msg.context &&
+             bus->queue[idx].callbacks.on_rx_packet == entry->callbacks.on_rx_packet &&
+              !memcmp(bus->queue[idx].msg.adu, entry->msg.adu, entry->msg.tx_length))
+            return true;
+        idx = bus->queue[idx].next;
+    }
+
+    return false;
+}
+
+// Replaces a pending write superseded by the message in slot, keeping the queue position of the pending write.
+// A pending write is superseded if its ADU only differs in the last data word, e.g. same register for a WriteRegister.
+static bool list_coalesce (modbus_bus_t *bus, slot_list_t *list, uint8_t slot)
+{
+    uint8_t idx = list->head, prev = SLOT_NONE;
+    queue_entry_t *entry = &bus->queue[slot];
+
+    while(idx != SLOT_NONE) {
+        if(bus->queue[idx].flags.coalesce &&
+            bus->queue[idx].msg.tx_length == entry->msg.tx_length &&
+             bus->queue[idx].msg.context == entry->msg.context &&
+              !memcmp(bus->queue[idx].msg.adu, entry->msg.adu, entry->msg.tx_length - 4)) {
+            entry->next = bus->queue[idx].next;
+            if(prev == SLOT_NONE)
+                list->head = slot;
+            else
+                bus->queue[prev].next = slot;
+            if(list->tail == idx)
+                list->tail = slot;
+            slot_release(bus, idx);
+            return true;
+        }
+        prev = idx;
+        idx = bus->queue[idx].next;
+    }
+
+    return false;
+}
+
+// Consumer side, drops the messages for the address from the list.
+static void list_release_address (modbus_bus_t *bus, slot_list_t *list, uint8_t address)
+{
+    uint8_t idx = list->head, prev = SLOT_NONE, next;
+
+    while(idx != SLOT_NONE) {
+        next = bus->queue[idx].next;
+        if(bus->queue[idx].msg.adu[0] == address) {
+            if(prev == SLOT_NONE)
+                list->head = next;
+            else
+                bus->queue[prev].next = next;
+            if(list->tail == idx)
+                list->tail = prev;
+            list->count--;
+            slot_release(bus, idx);
+            bus->stats.slave_flushed++;
+        } else
+            prev = idx;
+        idx = next;
+    }
+}
+
+// Consumer side, sorts the next message in the ready ring into the pending lists of its slave.
+static void queue_collect_next (modbus_bus_t *bus)
+{
+    uint8_t slot;
+    modbus_slave_t *target;
+
+    slot = bus->ready_slots.slot[bus->ready_slots.tail];
+    ring_store(bus->ready_slots.tail, ring_next(bus->ready_slots.tail));
+    bus->collected++;
+
+    target = slave_get(bus, bus->queue[slot].msg.adu[0]);
+
+    if(bus->queue[slot].flags.coalesce && list_coalesce(bus, &target->pending[bus->queue[slot].flags.priority], slot)) {
+        bus->stats.coalesced++;
+        return;
+    }
+
+    if(slave_backoff(target, hal.get_elapsed_ticks())) {
+        if(bus->queue[slot].flags.priority == ModBus_PriorityLow) {
+            slot_drop(bus, slot);
+            return;
+        }
+        // Keep a slave that is not responding from exhausting the slot pool
+        if(target->pending[ModBus_PriorityHigh].count >= MODBUS_SLAVE_BACKOFF_HOLD)
+            slot_drop(bus, list_pop(bus, &target->pending[ModBus_PriorityHigh]));
+    }
+
+    // A status poll that is still waiting behind commands is as fresh as a new one
+    if(bus->queue[slot].flags.priority == ModBus_PriorityLow && list_has_duplicate(bus, &target->pending[ModBus_PriorityLow], slot)) {
+        bus->stats.stale_dropped++;
+        slot_release(bus, slot);
+        return;
+    }
+
+    list_append(bus, &target->pending[bus->queue[slot].flags.priority], slot);
+
+    modbus_link_stats_t *link = link_stats_get(bus, bus->queue[slot].msg.adu[0]);
+    uint_fast8_t depth = target->pending[ModBus_PriorityHigh].count + target->pending[ModBus_PriorityLow].count;
+
+    if(depth > link->max_depth)
+        link->max_depth = depth;
+}
+
+// Consumer side: applies pending flush requests and sorts newly queued messages into the slave pending lists.
+// Messages queued before a flush request for a slave are collected before the messages for the slave are dropped,
+// later messages are kept.
+static void queue_collect (modbus_bus_t *bus)
+{
+    uint_fast8_t request_head = ring_load(bus->flush_request_head), last = ring_load(bus->ready_slots.head), seq = ring_load(bus->flush_seq), idx;
+
+    if(seq != bus->flush_ack) {
+
+        bus->flush_ack = seq;
+
+        while(bus->ready_slots.tail != bus->flush_head) {
+            slot_release(bus, bus->ready_slots.slot[bus->ready_slots.tail]);
+            ring_store(bus->ready_slots.tail, ring_next(bus->ready_slots.tail));
+            bus->collected++;
+        }
+
+        for(idx = 0; idx < MODBUS_RTU_SLAVES; idx++) {
+            list_release(bus, &bus->slaves[idx].pending[ModBus_PriorityHigh]);
+            list_release(bus, &bus->slaves[idx].pending[ModBus_PriorityLow]);
+        }
+    }
+
+    while(bus->flush_request_tail != request_head) {
+
+        flush_request_t *request = &bus->flush_request[bus->flush_request_tail];
+
+        while(bus->ready_slots.tail != last && (int32_t)(request->ready_count - bus->collected) > 0)
+            queue_collect_next(bus);
+
+        for(idx = 0; idx < MODBUS_RTU_SLAVES; idx++) {
+            list_release_address(bus, &bus->slaves[idx].pending[ModBus_PriorityHigh], request->address);
+            list_release_address(bus, &bus->slaves[idx].pending[ModBus_PriorityLow], request->address);
+        }
+
+        ring_store(bus->flush_request_tail, (bus->flush_request_tail + 1) % FLUSH_REQUESTS);
+    }
+
+    while(bus->ready_slots.tail != last)
+        queue_collect_next(bus);
+}
+
+// Round robin across slaves not backing off, if aged is set only messages queued for longer than MODBUS_PRIORITY_AGING are picked.
+static uint8_t slave_pick (modbus_bus_t *bus, modbus_priority_t priority, uint32_t ms, bool aged)
+{
+    uint8_t slot;
+    uint_fast8_t idx, n;
+
+    for(n = 1; n <= MODBUS_RTU_SLAVES; n++) {
+        idx = (bus->rr_slave + n) % MODBUS_RTU_SLAVES;
+        if((slot = bus->slaves[idx].pending[priority].head) != SLOT_NONE && !slave_backoff(&bus->slaves[idx], ms) &&
+             (!aged || ms - bus->queue[slot].queued >= MODBUS_PRIORITY_AGING)) {
+            bus->rr_slave = idx;
+            bus->slave = &bus->slaves[idx];
+            return list_pop(bus, &bus->slaves[idx].pending[priority]);
+        }
+    }
+
+    return SLOT_NONE;
+}
+
+// Consumer side, only to be called when no packet is in flight.
+// Picks the next message: realtime commands before telemetry unless the telemetry has aged, round robin across slaves.
+static uint8_t queue_next (modbus_bus_t *bus)
+{
+    uint8_t slot;
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    queue_collect(bus);
+
+    if((slot = slave_pick(bus, ModBus_PriorityLow, ms, true)) != SLOT_NONE)
+        bus->stats.aged++;
+    else if((slot = slave_pick(bus, ModBus_PriorityHigh, ms, false)) == SLOT_NONE)
+        slot = slave_pick(bus, ModBus_PriorityLow, ms, false);
+
+    return slot;
+}
+
+// Ends the current async transaction and returns its slot to the pool.
+static void packet_done (modbus_bus_t *bus, bool timeout)
+{
+    if(bus->packet && bus->packet != &bus->sync_msg) {
+        if(bus->slave)
+            slave_update(bus, bus->slave, timeout);
+        slot_release(bus, (uint8_t)(bus->packet - bus->queue));
+    }
+
+    bus->slave = NULL;
+    bus->packet = NULL;
+}
+
+static inline bool tx_start (modbus_bus_t *bus)
+{
+    uint8_t slot;
+
+    if((slot = queue_next(bus)) == SLOT_NONE)
+        return false;
+
+    bus->packet = &bus->queue[slot];
+    bus->state = ModBus_TX;
+    bus->rx_timeout = modbus.rx_timeout;
+
+    set_direction(bus, true);
+
+    bus->packet->sent = true;
+    link_stats_tx(bus, &((queue_entry_t *)bus->packet)->msg);
+    bus->stream.flush_rx_buffer();
+    bus->stream.write(((queue_entry_t *)bus->packet)->msg.adu, ((queue_entry_t *)bus->packet)->msg.tx_length);
+
+    return true;
+}
+
+static inline void tx_complete (modbus_bus_t *bus)
+{
+    // When an auto-direction sense circuit supports higher baudrates is used at slower rates, it can switch during the off time (TXD is high) of some bit sequences.
+    // In some cases (teensy4.1) this can result in garbage characters in the RX buffer after a message is transmitted.
+    // Flushing the buffer prevents these characters from appearing as an RX message.
+    // Since Modbus is half-duplex, there should never be valid data recived during a message transmit.
+    bus->stream.flush_rx_buffer();
+
+    bus->rx_count = 0;
+    bus->rx_idle = false;
+    bus->state = ModBus_AwaitReply;
+
+    set_direction(bus, false);
+}
+
+// timeout is false if a (short) frame was received
+static void rx_failed (modbus_bus_t *bus, bool timeout)
+{
+    bool exception = bus->stream.read() == bus->packet->msg.adu[0] && (bus->stream.read() & 0x80);
+
+    if(exception)
+        bus->tx_stats->exceptions++;
+    else if(timeout)
+        bus->tx_stats->timeouts++;
+    else
+        bus->tx_stats->crc_errors++;
+
+    spindle_trace(exception ? SpindleTrace_ModBusException : (timeout ? SpindleTrace_ModBusTimeout : SpindleTrace_ModBusCRCError), bus->packet->msg.adu[0], bus->packet->msg.adu[1], 0.0f);
+
+    if(bus->packet->async) {
+        bus->state = ModBus_Silent;
+        if(bus->packet->flags.notify && bus->packet->callbacks.on_rx_exception)
+            bus->packet->callbacks.on_rx_exception(0, bus->packet->msg.context);
+        packet_done(bus, timeout);
+    } else if(exception) {
+        bus->exception_code = bus->stream.read();
+        bus->state = ModBus_Exception;
+    } else
+        bus->state = ModBus_Timeout;
+
+    bus->silence_until = get_time() + bus->silence_timeout;
+}
+
+static void rx_complete (modbus_bus_t *bus)
+{
+    char *buf = ((queue_entry_t *)bus->packet)->msg.adu;
+    uint16_t rx_len = bus->packet->msg.rx_length; // store original length for CRC check
+
+    do {
+        *buf++ = bus->stream.read();
+    } while(--bus->packet->msg.rx_length);
+
+    bus->silence_until = get_time() + bus->silence_timeout;
+
+    if(bus->packet->msg.crc_check) {
+        uint_fast16_t crc = modbus_CRC16(((queue_entry_t *)bus->packet)->msg.adu, rx_len - 2);
+
+        if(bus->packet->msg.adu[rx_len - 2] != (crc & 0xFF) || bus->packet->msg.adu[rx_len - 1] != (crc >> 8)) {
+            // CRC check error
+            bus->tx_stats->crc_errors++;
+            spindle_trace(SpindleTrace_ModBusCRCError, bus->tx_stats->address, bus->packet->msg.adu[1], 0.0f);
+            if((bus->state = bus->packet->async ? ModBus_Silent : ModBus_Exception) == ModBus_Silent) {
+                if(bus->packet->callbacks.on_rx_exception)
+                    bus->packet->callbacks.on_rx_exception(0, bus->packet->msg.context);
+                packet_done(bus, false);
+            }
+            return;
+        }
+    }
+
+    link_stats_reply(bus);
+
+    if((bus->state = bus->packet->async ? ModBus_Silent : ModBus_GotReply) == ModBus_Silent) {
+        if(bus->packet->callbacks.on_rx_packet) {
+            bus->packet->msg.rx_length = rx_len;
+            bus->packet->callbacks.on_rx_packet(&((queue_entry_t *)bus->packet)->msg);
+        }
+        packet_done(bus, false);
+    }
+}
+
+// Consumer side, completes the reply when all characters have arrived or ends it when the frame has ended,
+// either on the RX idle event latched by the stream interrupt or on a gap in the received characters.
+static void rx_check (modbus_bus_t *bus)
+{
+    uint_fast16_t count;
+
+    if((count = bus->stream.get_rx_buffer_count()) >= bus->packet->msg.rx_length)
+        rx_complete(bus);
+    else if(count && bus->rx_idle)
+        rx_failed(bus, false); // short frame, exception response or garbage: no need to wait for the RX timeout
+    else if(count != bus->rx_count) {
+        bus->rx_count = count;
+        bus->rx_time = get_time();
+    } else if(count && get_time() - bus->rx_time > bus->rx_gap)
+        rx_failed(bus, false); // gap > t3.5 ends the frame: short exception response or garbage
+}
+
 // called once every ms
 static void modbus_poll (void *data)
 {
-    if(spin_lock)
+    modbus_bus_t *bus = (modbus_bus_t *)data;
+
+    if(!consumer_enter(bus)) {
+        bus->stats.poll_skipped++;
         return;
+    }
 
-    spin_lock = true;
+    queue_collect(bus); // sort and coalesce messages queued while a transaction is in progress
 
-    switch(state) {
+    switch(bus->state) {
 
         case ModBus_Idle:
-            if(tail != head && !packet) {
+            if(!bus->packet)
+                tx_start(bus);
+            break;
 
-                packet = tail;
-                tail = tail->next;
-                state = ModBus_TX;
-                rx_timeout = modbus.rx_timeout;
+        case ModBus_Silent:
+            if((int32_t)(get_time() - bus->silence_until) >= 0) {
+                bus->silence_until = 0;
+                bus->state = ModBus_Idle;
+            }
+            break;
 
-                if(stream.set_direction)
-                    stream.set_direction(true);
+        case ModBus_TX:
+            if(!bus->stream.get_tx_buffer_count())
+                tx_complete(bus);
+            break;
 
-                packet->sent = true;
-                stream.flush_rx_buffer();
-                stream.write(((queue_entry_t *)packet)->msg.adu, ((queue_entry_t *)packet)->msg.tx_length);
-            }
+        case ModBus_AwaitReply:
+            if(bus->rx_timeout && --bus->rx_timeout == 0)
+                rx_failed(bus, true);
+            else
+                rx_check(bus);
             break;
 
-        case ModBus_Silent:
-            if(hal.get_elapsed_ticks() >= silence_until) {
-                silence_until = 0;
-                state = ModBus_Idle;
+        case ModBus_Timeout:
+            if(bus->packet->async)
+                bus->state = ModBus_Silent;
+            bus->silence_until = get_time() + bus->silence_timeout;
+            break;
+
+        default:
+            break;
+    }
+
+    consumer_exit(bus);
+}
+
+// Ends sub millisecond silence periods and replies flagged by the RX idle event from the foreground loop instead of on the next systick.
+static void onExecuteRealtime (uint_fast16_t grbl_state)
+{
+    uint_fast8_t idx;
+    modbus_bus_t *bus;
+
+    on_execute_realtime(grbl_state);
+
+    for(idx = 0; idx < n_buses; idx++) {
+        bus = &buses[idx];
+        if(bus->rx_idle && bus->state == ModBus_AwaitReply && consumer_enter(bus)) {
+            if(bus->state == ModBus_AwaitReply)
+                rx_check(bus);
+            consumer_exit(bus);
+        }
+        if(bus->state == ModBus_Silent && (int32_t)(get_time() - bus->silence_until) >= 0 && consumer_enter(bus)) {
+            if(bus->state == ModBus_Silent) {
+                bus->silence_until = 0;
+                bus->state = ModBus_Idle;
+                if(!bus->packet)
+                    tx_start(bus);
+            }
+            consumer_exit(bus);
+        }
+    }
+}
+
+// Called from the stream interrupt handlers when the last character has been shifted out
+// and when the RX line has been idle for t3.5 respectively.
+// TX complete switches the bus to receive without waiting for the next systick, if the poll is running
+// the event is ignored and picked up by the next poll instead.
+// RX idle is only latched, the reply is completed and the callbacks are called from the foreground loop
+// or the next poll since callbacks may queue new messages and are not required to be interrupt safe.
+static void modbus_stream_event (modbus_bus_t *bus, modbus_stream_event_t event)
+{
+    switch(event) {
+
+        case ModBus_StreamEvent_TXComplete:
+            if(!consumer_enter(bus)) {
+                bus->stats.event_deferred++;
+                return;
             }
+            if(bus->state == ModBus_TX)
+                tx_complete(bus);
+            consumer_exit(bus);
             break;
 
-        case ModBus_TX:
-            if(!stream.get_tx_buffer_count()) {
-
-                // When an auto-direction sense circuit supports higher baudrates is used at slower rates, it can switch during the off time (TXD is high) of some bit sequences.
-                // In some cases (teensy4.1) this can result in garbage characters in the RX buffer after a message is transmitted.
-                // Flushing the buffer prevents these characters from appearing as an RX message.
-                // Since Modbus is half-duplex, there should never be valid data recived during a message transmit.
-                stream.flush_rx_buffer();
-                
-                state = ModBus_AwaitReply;
-
-                if(stream.set_direction)
-                    stream.set_direction(false);
-            }
-            break;
+        case ModBus_StreamEvent_RXIdle:
+            if(bus->state == ModBus_AwaitReply)
+                bus->rx_idle = true;
+            break;
+    }
+}
+
+// Producer side: returns a free slot or NULL if the pool is exhausted or a send is already in progress.
+// A slot not committed is kept for the next send.
+// send_busy is claimed before the reserved slot and the free ring are touched so that a nested sender,
+// e.g. from an interrupt while the foreground is popping a slot, is refused and the free ring keeps a single consumer.
+static queue_entry_t *queue_reserve (modbus_bus_t *bus)
+{
+    if(flag_test_and_set(bus->send_busy)) {
+        bus->stats.send_nested++;
+        return NULL;
+    }
+
+    if(bus->reserved == SLOT_NONE && (bus->reserved = ring_pop(&bus->free_slots)) == SLOT_NONE) {
+        bus->stats.queue_full++;
+        flag_clear(bus->send_busy);
+        return NULL;
+    }
+
+    return &bus->queue[bus->reserved];
+}
+
+// Make the reserved entry available to the scheduler, the message must be complete with CRC.
+static void queue_commit (modbus_bus_t *bus, modbus_msg_flags_t flags)
+{
+    bus->queue[bus->reserved].async = true;
+    bus->queue[bus->reserved].flags = flags;
+    bus->queue[bus->reserved].queued = hal.get_elapsed_ticks();
+    ring_push(&bus->ready_slots, bus->reserved); // cannot fail, the ring can hold all slots
+    ring_store(bus->ready_count, bus->ready_count + 1);
+    bus->reserved = SLOT_NONE;
+    flag_clear(bus->send_busy);
+
+    if(bus->stream.set_event_handler && bus->state == ModBus_Idle) {
+        if(consumer_enter(bus)) {
+            if(bus->state == ModBus_Idle && !bus->packet)
+                tx_start(bus);
+            consumer_exit(bus);
+        } else
+            bus->stats.kick_deferred++;
+    }
+}
+
+// Copies a message with CRC to the queue.
+static bool queue_send (modbus_bus_t *bus, modbus_message_t *msg, const modbus_callbacks_t *callbacks, modbus_msg_flags_t flags)
+{
+    queue_entry_t *entry;
+
+    if(bus->packet == &bus->sync_msg)
+        return false;
+
+    if(!(entry = queue_reserve(bus))) {
+        modbus_link_stats_t *link;
+        if((link = link_stats_find(bus, msg->adu[0])))
+            link->queue_full++;
+        return false;
+    }
+
+    add_message(entry, msg, callbacks);
+    queue_commit(bus, flags);
+
+    return true;
+}
+
+// Priority for messages sent via the core API: writes are commands, anything else is telemetry.
+static inline modbus_priority_t default_priority (modbus_message_t *msg)
+{
+    switch(msg->adu[1]) {
+
+        case ModBus_WriteCoil:
+        case ModBus_WriteRegister:
+        case ModBus_WriteCoils:
+        case ModBus_WriteRegisters:
+            return ModBus_PriorityHigh;
+
+        default:
+            return ModBus_PriorityLow;
+    }
+}
+
+// Returns the bus the slave address is bound to.
+static modbus_bus_t *bus_get (uint8_t address)
+{
+#if MODBUS_RTU_BUSES > 1
+    uint_fast8_t idx = n_bindings;
 
-        case ModBus_AwaitReply:
-            if(rx_timeout && --rx_timeout == 0) {
-                if(packet->async) {
-                    state = ModBus_Silent;
-                    packet = NULL;
-                } else if(stream.read() == packet->msg.adu[0] && (stream.read() & 0x80)) {
-                    exception_code = stream.read();
-                    state = ModBus_Exception;
-                } else
-                    state = ModBus_Timeout;
-                spin_lock = false;
-                if(state != ModBus_AwaitReply)
-                    silence_until = hal.get_elapsed_ticks() + silence_timeout;
-                return;
-            }
+    while(idx) {
+        if(bindings[--idx].address == address)
+            return &buses[bindings[idx].bus];
+    }
+#endif
 
-            if(stream.get_rx_buffer_count() >= packet->msg.rx_length) {
-
-                char *buf = ((queue_entry_t *)packet)->msg.adu;
-                uint16_t rx_len = packet->msg.rx_length; // store original length for CRC check
-
-                do {
-                    *buf++ = stream.read();
-                } while(--packet->msg.rx_length);
-
-                if(packet->msg.crc_check) {
-                    uint_fast16_t crc = modbus_CRC16x(((queue_entry_t *)packet)->msg.adu, rx_len - 2);
-
-                    if(packet->msg.adu[rx_len - 2] != (crc & 0xFF) || packet->msg.adu[rx_len - 1] != (crc >> 8)) {
-                        // CRC check error
-                        if((state = packet->async ? ModBus_Silent : ModBus_Exception) == ModBus_Silent) {
-                            if(packet->callbacks.on_rx_exception)
-                                packet->callbacks.on_rx_exception(0, packet->msg.context);
-                            packet = NULL;
-                        }
-                        silence_until = hal.get_elapsed_ticks() + silence_timeout;
-                        break;
-                    }
-                }
-
-                if((state = packet->async ? ModBus_Silent : ModBus_GotReply) == ModBus_Silent) {
-                    if(packet->callbacks.on_rx_packet) {
-                        packet->msg.rx_length = rx_len;
-                        packet->callbacks.on_rx_packet(&((queue_entry_t *)packet)->msg);
-                    }
-                    packet = NULL;
-                }
-
-                silence_until = hal.get_elapsed_ticks() + silence_timeout;
-            }
-            break;
+    return &buses[0];
+}
 
-        case ModBus_Timeout:
-            if(packet->async)
-                state = ModBus_Silent;
-            silence_until = hal.get_elapsed_ticks() + silence_timeout;
-            break;
+// Returns the bus with the message reserved by modbus_rtu_reserve(), NULL if not reserved.
+static modbus_bus_t *bus_reserved (modbus_message_t *msg)
+{
+    uint_fast8_t idx = n_buses;
 
-        default:
-            break;
+    while(idx) {
+        modbus_bus_t *bus = &buses[--idx];
+        if(bus->reserved != SLOT_NONE && msg == &bus->queue[bus->reserved].msg)
+            return bus;
     }
 
-    spin_lock = false;
+    return NULL;
 }
 
 bool modbus_send_rtu (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block)
 {
-    static queue_entry_t sync_msg = {0};
+    modbus_bus_t *bus = bus_get(msg->adu[0]);
 
     if(msg->tx_length > MODBUS_MAX_ADU_SIZE || msg->rx_length > MODBUS_MAX_ADU_SIZE) {
         if(callbacks->on_rx_exception)
@@ -268,56 +1165,62 @@ bool modbus_send_rtu (modbus_message_t *msg, const modbus_callbacks_t *callbacks
         return false;
     }
 
-    uint_fast16_t crc = modbus_CRC16x(msg->adu, msg->tx_length - 2);
+    uint_fast16_t crc = modbus_CRC16(msg->adu, msg->tx_length - 2);
 
     msg->adu[msg->tx_length - 1] = crc >> 8;
     msg->adu[msg->tx_length - 2] = crc & 0xFF;
 
-    while(spin_lock);
-
     if(block) {
 
         bool poll = true;
 
-        do {
+        // Wait for the bus to become idle and keep the poller from starting a queued message meanwhile.
+        while(true) {
             grbl.on_execute_realtime(state_get());
-        } while(state != ModBus_Idle);
+            if(bus->state == ModBus_Idle && !bus->packet && consumer_enter(bus)) {
+                if(bus->state == ModBus_Idle && !bus->packet)
+                    break;
+                consumer_exit(bus);
+            }
+        }
 
-        if(stream.set_direction)
-            stream.set_direction(true);
+        set_direction(bus, true);
 
-        state = ModBus_TX;
-        rx_timeout = modbus.rx_timeout;
+        bus->rx_timeout = modbus.rx_timeout;
 
-        add_message(&sync_msg, msg, callbacks);
+        add_message(&bus->sync_msg, msg, callbacks);
 
-        sync_msg.async = false;
-        stream.flush_rx_buffer();
-        stream.write(sync_msg.msg.adu, sync_msg.msg.tx_length);
+        bus->sync_msg.async = false;
+        link_stats_tx(bus, &bus->sync_msg.msg);
+        bus->stream.flush_rx_buffer();
+        bus->stream.write(bus->sync_msg.msg.adu, bus->sync_msg.msg.tx_length);
 
-        packet = &sync_msg;
+        bus->packet = &bus->sync_msg;
+        bus->state = ModBus_TX;
+
+        consumer_exit(bus);
 
         while(poll) {
 
             grbl.on_execute_realtime(state_get());
 
-            switch(state) {
+            switch(bus->state) {
 
                 case ModBus_Timeout:
-                    if(packet->callbacks.on_rx_exception)
-                        packet->callbacks.on_rx_exception(0, packet->msg.context);
+                    if(bus->packet->callbacks.on_rx_exception)
+                        bus->packet->callbacks.on_rx_exception(0, bus->packet->msg.context);
                     poll = false;
                     break;
 
                 case ModBus_Exception:
-                    if(packet->callbacks.on_rx_exception)
-                        packet->callbacks.on_rx_exception(exception_code == -1 ? 0 : (uint8_t)(exception_code & 0xFF), packet->msg.context);
+                    if(bus->packet->callbacks.on_rx_exception)
+                        bus->packet->callbacks.on_rx_exception(bus->exception_code == -1 ? 0 : (uint8_t)(bus->exception_code & 0xFF), bus->packet->msg.context);
                     poll = false;
                     break;
 
                 case ModBus_GotReply:
-                    if(packet->callbacks.on_rx_packet)
-                        packet->callbacks.on_rx_packet(&((queue_entry_t *)packet)->msg);
+                    if(bus->packet->callbacks.on_rx_packet)
+                        bus->packet->callbacks.on_rx_packet(&((queue_entry_t *)bus->packet)->msg);
                     poll = block = false;
                     break;
 
@@ -326,39 +1229,120 @@ bool modbus_send_rtu (modbus_message_t *msg, const modbus_callbacks_t *callbacks
             }
         }
     
-        packet = NULL;
-        state = silence_until > 0 ? ModBus_Silent : ModBus_Idle;
-
-    } else if(packet != &sync_msg) {
-        if(head->next != tail) {
-            add_message((queue_entry_t *)head, msg, callbacks);
-            head->async = true;
-            head = head->next;
-        }
-    }
+        consumer_enter(bus); // always succeeds from the foreground
+        bus->packet = NULL;
+        bus->state = bus->silence_until > 0 ? ModBus_Silent : ModBus_Idle;
+        consumer_exit(bus);
+
+    } else
+        queue_send(bus, msg, callbacks, (modbus_msg_flags_t){ .priority = default_priority(msg) });
 
     return !block;
 }
 
-static void modbus_reset (void)
+// Async send of a message built by the caller with an explicit priority, the message is copied to the queue.
+bool modbus_rtu_send_async (modbus_message_t *msg, const modbus_callbacks_t *callbacks, modbus_msg_flags_t flags)
+{
+    modbus_bus_t *bus = bus_get(msg->adu[0]);
+
+    if(msg->tx_length < 4 || msg->tx_length > MODBUS_MAX_ADU_SIZE || msg->rx_length > MODBUS_MAX_ADU_SIZE) {
+        if(callbacks && callbacks->on_rx_exception)
+            callbacks->on_rx_exception(0, msg->context);
+        return false;
+    }
+
+    uint_fast16_t crc = modbus_CRC16(msg->adu, msg->tx_length - 2);
+
+    msg->adu[msg->tx_length - 1] = crc >> 8;
+    msg->adu[msg->tx_length - 2] = crc & 0xFF;
+
+    return queue_send(bus, msg, callbacks, flags);
+}
+
+// Zero-copy async send: returns a free queue slot of the bus the slave is bound to for the caller to build the ADU in place,
+// NULL if the queue is full or a blocking transaction is in progress.
+// The slot is cleared and owned by the caller until modbus_rtu_commit() is called.
+modbus_message_t *modbus_rtu_reserve (uint8_t address)
+{
+    queue_entry_t *entry;
+    modbus_bus_t *bus = bus_get(address);
+
+    if(!is_up || bus->packet == &bus->sync_msg || !(entry = queue_reserve(bus)))
+        return NULL;
+
+    memset(&entry->msg, 0, sizeof(modbus_message_t));
+
+    return &entry->msg;
+}
+
+// The slot is kept reserved for the next call to modbus_rtu_reserve().
+void modbus_rtu_cancel (modbus_message_t *msg)
 {
-    while(spin_lock);
+    modbus_bus_t *bus;
 
-    if(sys.abort) {
+    if((bus = bus_reserved(msg)) && bus->send_busy)
+        flag_clear(bus->send_busy);
+}
 
-        packet = NULL;
-        tail = head;
+bool modbus_rtu_commit (modbus_message_t *msg, const modbus_callbacks_t *callbacks, modbus_msg_flags_t flags)
+{
+    queue_entry_t *entry;
+    modbus_bus_t *bus;
 
-        silence_until = 0;
-        state = ModBus_Idle;
+    if(!(bus = bus_reserved(msg)) || !bus->send_busy)
+        return false;
 
-        stream.flush_tx_buffer();
-        stream.flush_rx_buffer();
+    entry = &bus->queue[bus->reserved];
 
+    if(msg->tx_length < 4 || msg->tx_length > MODBUS_MAX_ADU_SIZE || msg->rx_length > MODBUS_MAX_ADU_SIZE) {
+        flag_clear(bus->send_busy);
+        if(callbacks && callbacks->on_rx_exception)
+            callbacks->on_rx_exception(0, msg->context);
+        return false;
     }
 
-    while(state != ModBus_Idle)
-        modbus_poll(NULL);
+    uint_fast16_t crc = modbus_CRC16(msg->adu, msg->tx_length - 2);
+
+    msg->adu[msg->tx_length - 1] = crc >> 8;
+    msg->adu[msg->tx_length - 2] = crc & 0xFF;
+
+    entry->sent = false;
+    set_callbacks(entry, callbacks);
+    queue_commit(bus, flags);
+
+    return true;
+}
+
+static void modbus_reset (void)
+{
+    uint_fast8_t idx, slave;
+    modbus_bus_t *bus;
+
+    for(idx = 0; idx < n_buses; idx++) {
+
+        bus = &buses[idx];
+
+        if(sys.abort && consumer_enter(bus)) {
+
+            packet_done(bus, false);
+            bus_flush_queue(bus);
+            queue_collect(bus);
+
+            for(slave = 0; slave < MODBUS_RTU_SLAVES; slave++)
+                bus->slaves[slave].failures = 0;
+
+            bus->silence_until = 0;
+            bus->state = ModBus_Idle;
+
+            bus->stream.flush_tx_buffer();
+            bus->stream.flush_rx_buffer();
+
+            consumer_exit(bus);
+        }
+
+        while(bus->state != ModBus_Idle)
+            modbus_poll(bus);
+    }
 
     driver_reset();
 }
@@ -401,9 +1385,14 @@ static setting_details_t setting_details = {
 
 static status_code_t modbus_set_baud (setting_id_t id, uint_fast16_t value)
 {
+    uint_fast8_t idx;
+
     modbus.baud_rate = baud[(uint32_t)value];
-    silence_timeout = silence.timeout[(uint32_t)value];
-    stream.set_baud_rate(modbus.baud_rate);
+
+    for(idx = 0; idx < n_buses; idx++) {
+        set_timing(&buses[idx], (uint32_t)value);
+        buses[idx].stream.set_baud_rate(modbus.baud_rate);
+    }
 
     return Status_OK;
 }
@@ -423,13 +1412,17 @@ static void modbus_settings_restore (void)
 
 static void modbus_settings_load (void)
 {
+    uint_fast8_t idx;
+
     if(hal.nvs.memcpy_from_nvs((uint8_t *)&modbus, nvs_address, sizeof(modbus_settings_t), true) != NVS_TransferResult_OK)
         modbus_settings_restore();
 
     is_up = true;
-    silence_timeout = silence.timeout[get_baudrate(modbus.baud_rate)];
 
-    stream.set_baud_rate(modbus.baud_rate);
+    for(idx = 0; idx < n_buses; idx++) {
+        set_timing(&buses[idx], get_baudrate(modbus.baud_rate));
+        buses[idx].stream.set_baud_rate(modbus.baud_rate);
+    }
 }
 
 static void onReportOptions (bool newopt)
@@ -440,26 +1433,295 @@ static void onReportOptions (bool newopt)
         hal.stream.write("[PLUGIN:MODBUS v0.16]" ASCII_EOL);
 }
 
+#if MODBUS_CRC_BENCHMARK
+
+#define CRC_BENCHMARK_PASSES 1000
+
+static uint32_t crc_benchmark (modbus_crc16_ptr crc16, const char *buf, uint_fast16_t len, uint16_t *crc)
+{
+    uint_fast16_t pass = CRC_BENCHMARK_PASSES;
+    uint32_t us = hal.get_micros();
+
+    do {
+        *crc = crc16(buf, len);
+    } while(--pass);
+
+    us = hal.get_micros() - us;
+
+    return (us * hal.f_mcu) / CRC_BENCHMARK_PASSES;
+}
+
+// Reports cycles per frame for each CRC backend for a typical 8 byte and a maximum size ADU.
+static status_code_t crc_benchmark_report (sys_state_t state, char *args)
+{
+    static const struct {
+        const char *name;
+        modbus_crc16_ptr crc16;
+    } backend[] = {
+        { "bitwise", modbus_CRC16x },
+        { "nibble table", modbus_CRC16n },
+        { "byte table", modbus_CRC16t }
+    };
+
+    char buf[MODBUS_MAX_ADU_SIZE];
+    uint16_t crc, crc_ref;
+    uint_fast8_t idx, frame;
+    uint_fast16_t len;
+
+    if(hal.get_micros == NULL)
+        return Status_InvalidStatement;
+
+    for(idx = 0; idx < sizeof(buf); idx++)
+        buf[idx] = (char)(0x5A + idx * 0x3B);
+
+    for(frame = 0; frame < 2; frame++) {
+
+        len = (frame == 0 ? 8 : MODBUS_MAX_ADU_SIZE) - 2;
+        crc_ref = modbus_CRC16x(buf, len);
+
+        for(idx = 0; idx <= sizeof(backend) / sizeof(backend[0]); idx++) {
+
+            modbus_crc16_ptr crc16 = idx < sizeof(backend) / sizeof(backend[0]) ? backend[idx].crc16 : modbus_CRC16;
+
+            if(idx == sizeof(backend) / sizeof(backend[0]) && crc16 == backend[MODBUS_CRC_TABLE].crc16)
+                break; // no HAL provided CRC
+
+            hal.stream.write("[MODBUSCRC:");
+            hal.stream.write(idx < sizeof(backend) / sizeof(backend[0]) ? backend[idx].name : "HAL");
+            hal.stream.write("|");
+            hal.stream.write(uitoa(len + 2));
+            hal.stream.write(" bytes|");
+            hal.stream.write(uitoa(crc_benchmark(crc16, buf, len, &crc)));
+            hal.stream.write(crc == crc_ref ? " cycles]" ASCII_EOL : " cycles|CRC mismatch!]" ASCII_EOL);
+        }
+    }
+
+    return Status_OK;
+}
+
+#endif // MODBUS_CRC_BENCHMARK
+
+static void stats_report (const char *name, uint32_t value)
+{
+    hal.stream.write("[MODBUSSTATS:");
+    hal.stream.write(name);
+    hal.stream.write("|");
+    hal.stream.write(uitoa(value));
+    hal.stream.write("]" ASCII_EOL);
+}
+
+static void link_stats_field (const char *name, uint32_t value)
+{
+    hal.stream.write("|");
+    hal.stream.write(name);
+    hal.stream.write(":");
+    hal.stream.write(uitoa(value));
+}
+
+// [MODBUSSLAVE:<address>|sent:<n>|...] followed by [MODBUSLATENCY:<address>|<2:<n>|...|>=200:<n>], latency buckets in ms.
+static void link_stats_report (modbus_link_stats_t *link)
+{
+    uint_fast8_t idx;
+
+    hal.stream.write("[MODBUSSLAVE:");
+    hal.stream.write(uitoa(link->address));
+    link_stats_field("sent", link->sent);
+    link_stats_field("replies", link->replies);
+    link_stats_field("timeouts", link->timeouts);
+    link_stats_field("crc errors", link->crc_errors);
+    link_stats_field("exceptions", link->exceptions);
+    link_stats_field("queue full", link->queue_full);
+    link_stats_field("max depth", link->max_depth);
+    link_stats_field("max latency us", link->latency_max);
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[MODBUSLATENCY:");
+    hal.stream.write(uitoa(link->address));
+    for(idx = 0; idx < N_LATENCY_BUCKETS; idx++) {
+        hal.stream.write(idx < N_LATENCY_BUCKETS - 1 ? "|<" : "|>=");
+        hal.stream.write(uitoa(latency_limit[idx < N_LATENCY_BUCKETS - 1 ? idx : idx - 1]));
+        hal.stream.write(":");
+        hal.stream.write(uitoa(link->latency[idx]));
+    }
+    hal.stream.write("]" ASCII_EOL);
+}
+
+// Reports queue and poller contention counters and link statistics per slave, $MODBUSSTATS=R resets them.
+// With more than one bus the counters for each bus are preceded by [MODBUSBUS:<n>].
+static status_code_t modbus_stats_report (sys_state_t state, char *args)
+{
+    uint_fast8_t idx, link;
+    modbus_bus_t *bus;
+
+    if(args && !(*args == 'R' && *(args + 1) == '\0'))
+        return Status_InvalidStatement;
+
+    for(idx = 0; idx < n_buses; idx++) {
+
+        bus = &buses[idx];
+
+        if(args) {
+            memset(&bus->stats, 0, sizeof(modbus_stats_t));
+            for(link = 0; link < bus->n_link_stats; link++) {
+                uint8_t address = bus->link_stats[link].address;
+                memset(&bus->link_stats[link], 0, sizeof(modbus_link_stats_t));
+                bus->link_stats[link].address = address;
+            }
+        }
+
+        if(n_buses > 1) {
+            hal.stream.write("[MODBUSBUS:");
+            hal.stream.write(uitoa(bus->id));
+            hal.stream.write("]" ASCII_EOL);
+        }
+
+        stats_report("polls skipped", bus->stats.poll_skipped);
+        stats_report("events deferred", bus->stats.event_deferred);
+        stats_report("sends deferred", bus->stats.kick_deferred);
+        stats_report("sends nested", bus->stats.send_nested);
+        stats_report("queue full", bus->stats.queue_full);
+        stats_report("backoff drops", bus->stats.backoff_dropped);
+        stats_report("stale drops", bus->stats.stale_dropped);
+        stats_report("aged", bus->stats.aged);
+        stats_report("coalesced", bus->stats.coalesced);
+        stats_report("slave flushed", bus->stats.slave_flushed);
+
+        for(link = 0; link < bus->n_link_stats; link++)
+            link_stats_report(&bus->link_stats[link]);
+    }
+
+    return Status_OK;
+}
+
+static const sys_command_t modbus_command_list[] = {
+    { "MODBUSSTATS", modbus_stats_report, { .allow_blocking = On }, { .str = "report ModBus queue statistics, R to reset" } },
+#if MODBUS_CRC_BENCHMARK
+    { "MODBUSCRC", crc_benchmark_report, { .allow_blocking = On, .noargs = On }, { .str = "report ModBus CRC backend cost in cycles per frame" } }
+#endif
+};
+
+static sys_commands_t modbus_commands = {
+    .n_commands = sizeof(modbus_command_list) / sizeof(sys_command_t),
+    .commands = modbus_command_list
+};
+
 static bool modbus_rtu_isup (void)
 {
     return is_up;
 }
 
+// Producer side, the consumer discards the queued messages before starting the next transmission.
+static void bus_flush_queue (modbus_bus_t *bus)
+{
+    bus->flush_head = bus->ready_slots.head;
+    ring_store(bus->flush_seq, bus->flush_seq + 1);
+}
+
 static void modbus_rtu_flush_queue (void)
 {
-    while(spin_lock);
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < n_buses; idx++)
+        bus_flush_queue(&buses[idx]);
+}
+
+// Producer side, the consumer discards the messages queued for the slave before the next transmission.
+// Messages for other slaves and messages queued after the call are kept, a message in flight is completed.
+void modbus_rtu_flush_slave (uint8_t address)
+{
+    modbus_bus_t *bus = bus_get(address);
+    uint_fast8_t next = (bus->flush_request_head + 1) % FLUSH_REQUESTS;
+
+    if(next == ring_load(bus->flush_request_tail)) {
+        bus_flush_queue(bus);
+        return;
+    }
+
+    bus->flush_request[bus->flush_request_head].address = address;
+    bus->flush_request[bus->flush_request_head].ready_count = bus->ready_count;
+    ring_store(bus->flush_request_head, next);
+}
+
+// Binds a slave address to a bus, messages for the slave are then queued and sent on that bus.
+// Binding to the first bus removes the binding.
+bool modbus_rtu_bind_address (uint8_t address, uint8_t bus)
+{
+#if MODBUS_RTU_BUSES > 1
+    uint_fast8_t idx = n_bindings;
+
+    if(bus >= n_buses)
+        return false;
+
+    while(idx && bindings[--idx].address != address);
+
+    if(n_bindings && bindings[idx].address == address) {
+        if(bus)
+            bindings[idx].bus = bus;
+        else
+            bindings[idx] = bindings[--n_bindings];
+        return true;
+    }
+
+    if(bus == 0)
+        return true;
+
+    if(n_bindings == MODBUS_RTU_BINDINGS)
+        return false;
+
+    bindings[n_bindings].address = address;
+    bindings[n_bindings++].bus = bus;
+
+    return true;
+#else
+    return bus == 0;
+#endif
+}
+
+uint8_t modbus_rtu_get_bus (uint8_t address)
+{
+    return (uint8_t)(bus_get(address) - buses);
+}
+
+bool modbus_rtu_get_link_stats (uint8_t address, modbus_link_stats_t *stats)
+{
+    modbus_link_stats_t *link;
+
+    if(!is_up || (link = link_stats_find(bus_get(address), address)) == NULL)
+        return false;
 
-    tail = head;
+    memcpy(stats, link, sizeof(modbus_link_stats_t));
+
+    return true;
 }
 
+// The silence periods apply to all buses.
 static void modbus_rtu_set_silence (const modbus_silence_timeout_t *timeout)
 {
-    if(timeout)
-        memcpy(&silence, timeout, sizeof(modbus_silence_timeout_t));
-    else
-        memcpy(&silence, &dflt_timeout, sizeof(modbus_silence_timeout_t));
+    uint_fast8_t idx;
+    modbus_bus_t *bus;
+
+    for(idx = 0; idx < n_buses; idx++) {
+
+        bus = &buses[idx];
+
+        if((bus->silence_custom = !!timeout))
+            memcpy(&bus->silence, timeout, sizeof(modbus_silence_timeout_t));
+        else
+            memcpy(&bus->silence, &dflt_timeout, sizeof(modbus_silence_timeout_t));
+
+        set_timing(bus, get_baudrate(modbus.baud_rate));
+    }
+}
 
-    silence_timeout = silence.timeout[get_baudrate(modbus.baud_rate)];
+void modbus_rtu_set_crc16 (modbus_crc16_ptr crc16)
+{
+#if MODBUS_CRC_TABLE == 2
+    modbus_CRC16 = crc16 ? crc16 : modbus_CRC16t;
+#elif MODBUS_CRC_TABLE == 1
+    modbus_CRC16 = crc16 ? crc16 : modbus_CRC16n;
+#else
+    modbus_CRC16 = crc16 ? crc16 : modbus_CRC16x;
+#endif
 }
 
 static bool stream_is_valid (const io_stream_t *stream)
@@ -475,36 +1737,67 @@ static bool stream_is_valid (const io_stream_t *stream)
                      stream->set_enqueue_rt_handler == NULL);
 }
 
-#if MODBUS_ENABLE & MODBUS_RTU_DIR_ENABLED
-static void modbus_set_direction (bool tx)
+#if MODBUS_RTU_BUSES > 1
+
+static void modbus_stream_event1 (modbus_stream_event_t event)
 {
-    hal.port.digital_out(dir_port, tx);
+    modbus_stream_event(&buses[1], event);
 }
+
 #endif
 
-static bool claim_stream (io_stream_properties_t const *sstream)
+static void modbus_stream_event0 (modbus_stream_event_t event)
 {
-    io_stream_t const *claimed = NULL;
+    modbus_stream_event(&buses[0], event);
+}
 
-#if MODBUS_RTU_STREAM >= 0
-    if(sstream->type == StreamType_Serial && sstream->instance == MODBUS_RTU_STREAM) {
+// Returns true if the stream can be claimed for the next bus.
+static bool match_stream (io_stream_properties_t const *sstream)
+{
+    uint_fast8_t idx;
+#if MODBUS_RTU_BUSES > 1
+    int8_t instance = n_buses == 0 ? MODBUS_RTU_STREAM : MODBUS_RTU_STREAM1;
 #else
-    if(sstream->type == StreamType_Serial && sstream->flags.modbus_ready && !sstream->flags.claimed) {
+    int8_t instance = MODBUS_RTU_STREAM;
 #endif
+
+    if(!(sstream->type == StreamType_Serial && (instance >= 0 ? sstream->instance == instance : (sstream->flags.modbus_ready && !sstream->flags.claimed))))
+        return false;
+
+    for(idx = 0; idx < n_buses; idx++) {
+        if(buses[idx].instance == sstream->instance)
+            return false;
+    }
+
+    return true;
+}
+
+// Claims a stream for the next bus.
+static bool claim_stream (io_stream_properties_t const *sstream)
+{
+    uint_fast8_t idx;
+    io_stream_t const *claimed = NULL;
+    modbus_bus_t *bus = &buses[n_buses];
+
+    if(match_stream(sstream)) {
+
         if((claimed = sstream->claim(baud[MODBUS_BAUDRATE])) && stream_is_valid(claimed)) {
 
             claimed->set_enqueue_rt_handler(stream_buffer_all);
 
-            stream.set_baud_rate = claimed->set_baud_rate;
-            stream.get_tx_buffer_count = claimed->get_tx_buffer_count;
-            stream.get_rx_buffer_count = claimed->get_rx_buffer_count;
-            stream.write = claimed->write_n;
-            stream.read = claimed->read;
-            stream.flush_tx_buffer = claimed->reset_write_buffer;
-            stream.flush_rx_buffer = claimed->reset_read_buffer;
-#if MODBUS_ENABLE & MODBUS_RTU_DIR_ENABLED
-            stream.set_direction = modbus_set_direction;
-#endif
+            bus->id = n_buses;
+            bus->instance = claimed->instance;
+            bus->stream.set_baud_rate = claimed->set_baud_rate;
+            bus->stream.get_tx_buffer_count = claimed->get_tx_buffer_count;
+            bus->stream.get_rx_buffer_count = claimed->get_rx_buffer_count;
+            bus->stream.write = claimed->write_n;
+            bus->stream.read = claimed->read;
+            bus->stream.flush_tx_buffer = claimed->reset_write_buffer;
+            bus->stream.flush_rx_buffer = claimed->reset_read_buffer;
+            for(idx = 0; idx < MODBUS_RTU_BUSES; idx++) {
+                if(stream_events[idx].set_event_handler && stream_events[idx].instance == claimed->instance)
+                    bus->stream.set_event_handler = stream_events[idx].set_event_handler;
+            }
             if(hal.periph_port.set_pin_description) {
                 hal.periph_port.set_pin_description(Output_TX, (pin_group_t)(PinGroup_UART + claimed->instance), "Modbus");
                 hal.periph_port.set_pin_description(Input_RX, (pin_group_t)(PinGroup_UART + claimed->instance), "Modbus");
@@ -516,40 +1809,99 @@ static bool claim_stream (io_stream_properties_t const *sstream)
     return claimed != NULL;
 }
 
-void modbus_rtu_init (void)
+// Events are registered for up to MODBUS_RTU_BUSES streams.
+void modbus_rtu_register_stream_events (uint8_t instance, stream_set_event_handler_ptr set_event_handler)
 {
-    const modbus_api_t api = {
-        .interface = Modbus_InterfaceRTU,
-        .is_up = modbus_rtu_isup,
-        .flush_queue = modbus_rtu_flush_queue,
-        .set_silence = modbus_rtu_set_silence,
-        .send = modbus_send_rtu
-    };
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < MODBUS_RTU_BUSES; idx++) {
+        if(stream_events[idx].set_event_handler == NULL || stream_events[idx].instance == instance) {
+            stream_events[idx].instance = instance;
+            stream_events[idx].set_event_handler = set_event_handler;
+            break;
+        }
+    }
+}
+
+// Claims the direction output and the stream for the next bus.
+// Neither can be released, the direction output is only claimed when there is a stream for the bus.
+static bool bus_claim (void)
+{
+    uint_fast8_t idx;
+    modbus_bus_t *bus = &buses[n_buses];
 
 #if MODBUS_ENABLE & MODBUS_RTU_DIR_ENABLED
 
+    if(!stream_enumerate_streams(match_stream))
+        return false;
+
     uint8_t n_out = ioports_available(Port_Digital, Port_Output);
 
+    if(n_buses == 0) {
   #if MODBUS_DIR_AUX >= 0
-    dir_port = MODBUS_DIR_AUX;
+        bus->dir_port = MODBUS_DIR_AUX;
   #else
-    dir_port = n_out - 1;
+        bus->dir_port = n_out - 1;
   #endif
-
-    if(!(n_out > dir_port && ioport_claim(Port_Digital, Port_Output, &dir_port, "Modbus RX/TX direction"))) {
-        protocol_enqueue_foreground_task(report_warning, "Modbus failed to initialize!");
-        system_raise_alarm(Alarm_SelftestFailed);
-        return;
     }
+  #if MODBUS_RTU_BUSES > 1
+    else {
+    #if MODBUS_DIR_AUX1 >= 0
+        bus->dir_port = MODBUS_DIR_AUX1;
+    #else
+        bus->dir_port = buses[0].dir_port - 1;
+    #endif
+    }
+  #endif
+
+    if(!(n_out > bus->dir_port && ioport_claim(Port_Digital, Port_Output, &bus->dir_port, "Modbus RX/TX direction")))
+        return false;
 
 #endif
 
-    if(stream_enumerate_streams(claim_stream) && (nvs_address = nvs_alloc(sizeof(modbus_settings_t)))) {
+    if(!stream_enumerate_streams(claim_stream))
+        return false;
+
+    for(idx = 0; idx < MODBUS_QUEUE_LENGTH; idx++)
+        ring_push(&bus->free_slots, idx);
+
+    for(idx = 0; idx < MODBUS_RTU_SLAVES; idx++)
+        bus->slaves[idx].pending[ModBus_PriorityHigh].head = bus->slaves[idx].pending[ModBus_PriorityHigh].tail =
+         bus->slaves[idx].pending[ModBus_PriorityLow].head = bus->slaves[idx].pending[ModBus_PriorityLow].tail = SLOT_NONE;
+
+    bus->reserved = SLOT_NONE;
+    bus->state = ModBus_Idle;
+
+    n_buses++;
+
+    return true;
+}
+
+void modbus_rtu_init (void)
+{
+    const modbus_api_t api = {
+        .interface = Modbus_InterfaceRTU,
+        .is_up = modbus_rtu_isup,
+        .flush_queue = modbus_rtu_flush_queue,
+        .set_silence = modbus_rtu_set_silence,
+        .send = modbus_send_rtu
+    };
+
+    if(bus_claim() && (nvs_address = nvs_alloc(sizeof(modbus_settings_t)))) {
+
+        uint_fast8_t idx;
+        bool events = false;
+
+#if MODBUS_RTU_BUSES > 1
+        if(!bus_claim()) // the second bus is optional
+            protocol_enqueue_foreground_task(report_warning, "Modbus second bus not available!");
+#endif
 
         driver_reset = hal.driver_reset;
         hal.driver_reset = modbus_reset;
 
-        task_add_systick(modbus_poll, NULL);
+        for(idx = 0; idx < n_buses; idx++)
+            task_add_systick(modbus_poll, &buses[idx]);
 
         on_report_options = grbl.on_report_options;
         grbl.on_report_options = onReportOptions;
@@ -558,14 +1910,28 @@ void modbus_rtu_init (void)
 
         settings_register(&setting_details);
 
-        head = tail = &queue[0];
+        system_register_commands(&modbus_commands);
 
-        uint_fast8_t idx;
-        for(idx = 0; idx < MODBUS_QUEUE_LENGTH; idx++)
-            queue[idx].next = idx == MODBUS_QUEUE_LENGTH - 1 ? &queue[0] : &queue[idx + 1];
+        spindle_trace_init();
 
         modbus_register_api(&api);
 
+        for(idx = 0; idx < n_buses; idx++) {
+#if MODBUS_RTU_BUSES > 1
+            modbus_stream_event_ptr handler = idx ? modbus_stream_event1 : modbus_stream_event0;
+#else
+            modbus_stream_event_ptr handler = modbus_stream_event0;
+#endif
+            if(buses[idx].stream.set_event_handler && !buses[idx].stream.set_event_handler(handler))
+                buses[idx].stream.set_event_handler = NULL;
+            events |= buses[idx].stream.set_event_handler != NULL;
+        }
+
+        if(hal.get_micros || events) {
+            on_execute_realtime = grbl.on_execute_realtime;
+            grbl.on_execute_realtime = onExecuteRealtime;
+        }
+
         modbus_set_silence(NULL);
 
     } else {
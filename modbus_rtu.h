@@ -30,6 +30,10 @@
 #include "grbl/modbus.h"
 #endif
 
+#ifndef MODBUS_RTU_BUSES
+#define MODBUS_RTU_BUSES 1          // number of serial streams to claim, each is run as a separate bus
+#endif
+
 typedef enum {
     ModBus_Idle,
     ModBus_Silent,
@@ -40,7 +44,49 @@ typedef enum {
     ModBus_Exception
 } modbus_state_t;
 
+typedef enum {
+    ModBus_StreamEvent_TXComplete = 0,  // last character shifted out
+    ModBus_StreamEvent_RXIdle           // RX line idle for t3.5 after receiving data
+} modbus_stream_event_t;
+
+typedef enum {
+    ModBus_PriorityLow = 0,     // telemetry, may be dropped when the slave is not responding
+    ModBus_PriorityHigh,        // realtime commands such as set RPM and set state
+    ModBus_Priorities
+} modbus_priority_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t priority :1,
+                coalesce :1,    // replace a pending message to the same slave that differs only in the last data word, e.g. an RPM write
+                notify   :1,    // call on_rx_exception on timeouts, short frames and when dropped during a slave backoff too, by default only CRC errors are reported for queued messages
+                unused   :5;
+    };
+} modbus_msg_flags_t;
+
+#define MODBUS_RTU_DROPPED 0xFF // on_rx_exception code for a notify message dropped unsent while its slave backs off
+
+#define MODBUS_LATENCY_BUCKETS 8 // latency histogram buckets: <2, <5, <10, <20, <50, <100, <200 and >=200 ms
+
+// Link statistics per slave address, entries are assigned on first transmission, any more slaves than MODBUS_RTU_SLAVES share the last entry.
+typedef struct {
+    uint8_t address;
+    uint8_t max_depth;          // max messages pending
+    uint32_t sent;
+    uint32_t replies;
+    uint32_t timeouts;
+    uint32_t crc_errors;        // CRC errors and malformed (short) frames
+    uint32_t exceptions;
+    uint32_t queue_full;        // copied sends dropped since the queue was full
+    uint32_t latency_max;       // us, TX start to reply received
+    uint32_t latency[MODBUS_LATENCY_BUCKETS];
+} modbus_link_stats_t;
+
 typedef void (*stream_set_direction_ptr)(bool tx);
+typedef void (*modbus_stream_event_ptr)(modbus_stream_event_t event);
+typedef bool (*stream_set_event_handler_ptr)(modbus_stream_event_ptr handler);
+typedef uint16_t (*modbus_crc16_ptr)(const char *buf, uint_fast16_t len);
 
 typedef struct {
     set_baud_rate_ptr set_baud_rate;
@@ -51,9 +97,74 @@ typedef struct {
     stream_read_ptr read;
     flush_stream_buffer_ptr flush_tx_buffer;
     flush_stream_buffer_ptr flush_rx_buffer;
+    stream_set_event_handler_ptr set_event_handler; // NULL if TX complete and RX idle events are not available
 } modbus_stream_t;
 
+/*! \brief Register TX complete and RX idle event support for a serial stream.
+
+Must be called by the driver before the ModBus RTU plugin is initialized. If the stream with the given instance
+is claimed for ModBus \a set_event_handler is called with the handler to call from the UART interrupt handler(s).
+The state machine then advances on these events instead of waiting for the next 1 ms systick.
+*/
+void modbus_rtu_register_stream_events (uint8_t instance, stream_set_event_handler_ptr set_event_handler);
 void modbus_rtu_init (void);
 bool modbus_rtu_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+void modbus_rtu_set_crc16 (modbus_crc16_ptr crc16); // For MCUs with a CRC peripheral, NULL restores the software CRC
+
+/*! \brief Reserve the next free slot in the async transmit queue of the bus the slave is bound to.
+
+The ADU is built directly in the returned message which is cleared on return, the slave address must be set to \a address.
+The slot is not transmitted before it is handed back by modbus_rtu_commit(), only one slot per bus may be reserved at a time.
+\returns pointer to the message or NULL if the queue is full.
+*/
+modbus_message_t *modbus_rtu_reserve (uint8_t address);
+
+/*! \brief Add the CRC to and queue a message previously obtained from modbus_rtu_reserve().
 
+Queued messages are scheduled per slave address: high priority messages are sent before low priority,
+then round robin across slaves. A slave that times out backs off and its low priority messages are dropped meanwhile.
+\returns true if the message was queued.
+*/
+bool modbus_rtu_commit (modbus_message_t *msg, const modbus_callbacks_t *callbacks, modbus_msg_flags_t flags);
+
+/*! \brief Hand back a message obtained from modbus_rtu_reserve() without queueing it.
+*/
+void modbus_rtu_cancel (modbus_message_t *msg);
+
+/*! \brief Discard the messages queued for a slave.
+
+Messages for other slaves, messages queued after the call and a message in flight are kept.
+If too many requests are pending the whole queue is flushed.
+*/
+void modbus_rtu_flush_slave (uint8_t address);
+
+/*! \brief Bind a slave address to a bus.
+
+Each bus claims its own serial stream and has its own queue and state machine, messages for the slave are sent on the bus bound to.
+Unbound addresses are on the first bus, binding an address to bus 0 removes the binding.
+\returns false if the bus is not available or the binding table is full.
+*/
+bool modbus_rtu_bind_address (uint8_t address, uint8_t bus);
+
+/*! \brief Get the bus a slave address is bound to.
+\returns the bus number, 0 if the address is not bound.
+*/
+uint8_t modbus_rtu_get_bus (uint8_t address);
+
+/*! \brief Get a copy of the link statistics for a slave.
+
+For plugins and for host side test harnesses that run the driver against a simulated stream and measure throughput and latency.
+The counters are updated from the poller context and may change while being copied, the copy is not reset.
+\returns false if nothing has been sent to the slave yet.
+*/
+bool modbus_rtu_get_link_stats (uint8_t address, modbus_link_stats_t *stats);
+
+/*! \brief Queue a copy of a message with the given priority.
+
+Messages sent via modbus_send() are queued as high priority if the function code is a write, low priority otherwise.
+Low priority messages waiting longer than \a MODBUS_PRIORITY_AGING ms are sent ahead of high priority messages,
+a low priority message identical to one already pending for the same slave is dropped.
+\returns true if the message was queued.
+*/
+bool modbus_rtu_send_async (modbus_message_t *msg, const modbus_callbacks_t *callbacks, modbus_msg_flags_t flags);
 #endif
@@ -29,9 +29,14 @@
 #include "grbl/nvs_buffer.h"
 #include "grbl/protocol.h"
 #include "grbl/motion_control.h"
+#include "grbl/gcode.h"
 
 #define N_OFFSETS 1
 
+#ifndef SPINDLE_OFFSET_QUEUED
+#define SPINDLE_OFFSET_QUEUED 0 // set to 1 to queue the offset move behind pending motion, M104 still synchronizes before the switch
+#endif
+
 typedef struct {
     float x;
     float y;
@@ -62,10 +67,18 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
         plan_data_init(&plan_data);
         plan_data.condition.rapid_motion = On;
 
-        protocol_buffer_synchronize();
-        system_convert_array_steps_to_mpos(target.values, sys.position);
+        // synchronize only when the offset is to be applied or removed
+        if((move_offset = spindle->id != default_spindle_id && spindle->cap.laser && laser_spindle_id == -1) || laser_spindle_id != -1) {
+#if SPINDLE_OFFSET_QUEUED
+            // start from the parser position, the end of the queued motion. M104 has synchronized already, tool selection has not
+            memcpy(target.values, gc_state.position, sizeof(coord_data_t));
+#else
+            protocol_buffer_synchronize();
+            system_convert_array_steps_to_mpos(target.values, sys.position);
+#endif
+        }
 
-        if((move_offset = spindle->id != default_spindle_id && spindle->cap.laser && laser_spindle_id == -1)) {
+        if(move_offset) {
             laser_spindle_id = spindle->id;
             target.x += plugin_settings.offset[0].x;
             target.y += plugin_settings.offset[0].y;
@@ -77,8 +90,12 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
 
         if(move_offset) {
             if(mc_line(target.values, &plan_data)) {
+#if SPINDLE_OFFSET_QUEUED
+                memcpy(gc_state.position, target.values, sizeof(gc_state.position));
+#else
                 protocol_buffer_synchronize();
                 sync_position();
+#endif
             } // else alarm?
         }
     }
@@ -46,6 +46,7 @@ typedef struct {
 } onoff_spindle_settings_t;
 
 static onoff_spindle_settings_t spindle_config, run;
+static spindle_id_t spindle_id = -1;
 static spindle_state_t spindle_state = {0};
 static nvs_address_t nvs_address;
 static uint8_t n_dout;
@@ -56,6 +57,8 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_SetState, spindle_id, state.value, rpm);
+
     spindle_state = state;
 
 #if SPINDLE_ENABLE & (1<<SPINDLE_ONOFF1_DIR)
@@ -87,9 +90,10 @@ static void onoff_spindle_register (void)
         .get_state = spindleGetState
     };
 
-    if((spindle_register(&spindle, "On/off spindle")) != -1)
+    if((spindle_id = spindle_register(&spindle, "On/off spindle")) != -1) {
+        spindle_trace_init();
         spindleSetState(NULL, spindle_state, 0.0f);
-    else
+    } else
         protocol_enqueue_foreground_task(report_warning, "On/off spindle failed to initialize!");
 }
 
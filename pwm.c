@@ -36,10 +36,64 @@ static spindle_id_t spindle_id = -1;
 static spindle1_settings_t *spindle_config;
 static spindle_state_t spindle_state = {0};
 
+#if ENABLE_SPINDLE_LINEARIZATION
+
+// Linearisation segment, PWM duty in percent is rpm * gain + offset for RPMs up to the segment RPM.
+typedef struct {
+    float rpm;
+    float gain;
+    float offset;
+} pwm_segment_t;
+
+static uint_fast8_t n_segments = 0;
+static float duty_min, duty_max;
+static pwm_segment_t segments[SPINDLE_NPWM_PIECES];
+
+// Builds the segment table from the linearisation points, the last segment is used for RPMs above its RPM.
+static void linearisation_init (spindle_settings_t *cfg)
+{
+    uint_fast8_t idx;
+
+    n_segments = 0;
+    duty_min = cfg->pwm_min_value;
+    duty_max = cfg->pwm_max_value;
+
+    for(idx = 0; idx < SPINDLE_NPWM_PIECES; idx++) {
+        if(cfg->pwm_piece[idx].rpm > 0.0f && cfg->pwm_piece[idx].start != 0.0f) {
+            segments[n_segments].rpm = cfg->pwm_piece[idx].rpm;
+            segments[n_segments].gain = cfg->pwm_piece[idx].start;
+            segments[n_segments++].offset = -cfg->pwm_piece[idx].end;
+        }
+    }
+}
+
+static inline float rpm_to_pwm (float rpm)
+{
+    if(n_segments && rpm > 0.0f) {
+
+        uint_fast8_t n = n_segments;
+        const pwm_segment_t *segment = segments;
+
+        while(--n && rpm > segment->rpm)
+            segment++;
+
+        rpm = rpm * segment->gain + segment->offset;
+        rpm = rpm < duty_min ? duty_min : (rpm > duty_max ? duty_max : rpm);
+    }
+
+    return rpm;
+}
+
+#else
+#define rpm_to_pwm(rpm) (rpm)
+#endif
+
 static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_SetState, spindle_id, state.value, rpm);
+
     spindle_state = state;
 
     if(state.on && port_dir != 255)
@@ -60,7 +114,9 @@ static void spindleSetSpeed (spindle_ptrs_t *spindle, float rpm)
 {
     UNUSED(spindle);
 
-    hal.port.analog_out(port_pwm, rpm);
+    spindle_trace(SpindleTrace_UpdateRPM, spindle_id, 0, rpm);
+
+    hal.port.analog_out(port_pwm, rpm_to_pwm(rpm));
 }
 
 // Start or stop spindle
@@ -68,13 +124,15 @@ static void spindleSetStateVariable (spindle_ptrs_t *spindle, spindle_state_t st
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_SetState, spindle_id, state.value, rpm);
+
     spindle_state = state;
 
     if(state.on && port_dir != 255)
         hal.port.digital_out(port_dir, state.ccw);
 
     hal.port.digital_out(port_on, state.on);
-    hal.port.analog_out(port_pwm, rpm);
+    hal.port.analog_out(port_pwm, rpm_to_pwm(rpm));
 }
 
 static bool spindleConfig (spindle_ptrs_t *spindle)
@@ -94,6 +152,16 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
     config.off_value = spindle_config->cfg.pwm_off_value;
     config.invert = Off; // TODO: add setting
 
+#if ENABLE_SPINDLE_LINEARIZATION
+    linearisation_init(&spindle_config->cfg);
+
+    // The segment table outputs the duty cycle, configure the port to pass it through unscaled.
+    if(n_segments) {
+        config.min = config.min_value;
+        config.max = config.max_value;
+    }
+#endif
+
     spindle->cap.direction = port_dir != 255;
     spindle->cap.rpm_range_locked = On;
     spindle->rpm_min = spindle_config->cfg.rpm_min;
@@ -127,9 +195,10 @@ static void pwm_spindle_register (void)
         .get_state = spindleGetState
     };
 
-    if((spindle_id = spindle_register(&spindle, "PWM2")) != -1)
+    if((spindle_id = spindle_register(&spindle, "PWM2")) != -1) {
+        spindle_trace_init();
         spindleSetState(NULL, spindle_state, 0.0f);
-    else
+    } else
         protocol_enqueue_foreground_task(report_warning, "PWM2 spindle failed to initialize!");
 }
 
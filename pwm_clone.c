@@ -38,9 +38,12 @@ static spindle_state_t spindle0_state = {0}, spindle1_state = {0};
 static spindle_pwm_t pwm_data;
 static on_spindle_selected_ptr on_spindle_selected;
 static spindle_set_state_ptr set_state;
+static spindle_update_pwm_ptr update_pwm;
 
 static void spindle0SetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
+    spindle_trace(SpindleTrace_SetState, spindle->id, state.value, rpm);
+
     spindle0_state = state;
 
     state.ccw = state.on;
@@ -58,6 +61,8 @@ static spindle_state_t spindle0GetState (spindle_ptrs_t *spindle)
 
 static void spindle1SetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
+    spindle_trace(SpindleTrace_SetState, spindle->id, state.value, rpm);
+
     spindle1_state = state;
 
     state.ccw = Off;
@@ -94,7 +99,17 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
     if(on_spindle_selected)
         on_spindle_selected(spindle);
 
-    if(spindle->id == 0 && spindle->set_state != spindle0SetState) {
+    if(spindle->id == spindle_id) {
+        // Laser mode: let the core write the precomputed PWM value directly to the base spindle output,
+        // the direction output is already set for spindle 1 by spindle1SetState().
+        if(settings.mode == Mode_Laser && spindle->context.pwm) {
+            spindle->cap.laser = On;
+            spindle->update_pwm = update_pwm;
+        } else {
+            spindle->cap.laser = Off;
+            spindle->update_pwm = NULL;
+        }
+    } else if(spindle->id == 0 && spindle->set_state != spindle0SetState) {
         set_state = spindle->set_state;
         spindle->set_state = spindle0SetState;
         spindle->get_state = spindle0GetState;
@@ -131,6 +146,7 @@ void cloned_spindle_init (void)
           (spindle_config = spindle1_settings_add(false))) {
 
         set_state = pwm_spindle->set_state;
+        update_pwm = pwm_spindle->update_pwm;
         memcpy(&spindle1, pwm_spindle, sizeof(spindle_ptrs_t));
         spindle1.config = NULL;
         spindle1.update_pwm = NULL;
@@ -144,6 +160,8 @@ void cloned_spindle_init (void)
 
         spindle1_settings_register(spindle1.cap, spindle_settings_changed);
 
+        spindle_trace_init();
+
         on_spindle_selected = grbl.on_spindle_selected;
         grbl.on_spindle_selected = onSpindleSelected;
     }
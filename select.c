@@ -32,6 +32,12 @@
 #include "grbl/protocol.h"
 #endif
 
+#include "trace.h"
+
+#ifndef SPINDLE_HOT_STANDBY
+#define SPINDLE_HOT_STANDBY 0
+#endif
+
 #if N_SPINDLE > 1
 
 #define N_SPINDLE_SETTINGS 8
@@ -59,10 +65,40 @@ static nvs_address_t nvs_address;
 #if N_SYS_SPINDLE == 1
 
 static bool select_by_tool = false;
+#if SPINDLE_HOT_STANDBY
+static bool hot_swap = false;
+static uint32_t standby = 0; // spindle ids that have been selected since startup
+#endif
 static user_mcode_ptrs_t user_mcode;
 static on_report_options_ptr on_report_options;
 static on_tool_selected_ptr on_tool_selected = NULL;
 
+#if SPINDLE_HOT_STANDBY
+
+// Spindles stay configured when deselected, a spindle that has been selected before
+// is swapped in without the plugins reconfiguring it. Selecting the active spindle is a no-op.
+static bool select_spindle (spindle_id_t spindle_id)
+{
+    bool ok;
+    spindle_ptrs_t *spindle = spindle_get(0);
+
+    if(spindle && spindle->id == spindle_id)
+        return true;
+
+    hot_swap = spindle_id >= 0 && spindle_id < 32 && (standby & (1UL << spindle_id));
+
+    if((ok = spindle_select(spindle_id)) && spindle_id >= 0 && spindle_id < 32)
+        standby |= (1UL << spindle_id);
+
+    hot_swap = false;
+
+    return ok;
+}
+
+#else
+#define select_spindle spindle_select
+#endif
+
 static user_mcode_type_t check (user_mcode_t mcode)
 {
     return mcode == Spindle_Select ? UserMCode_Normal : (user_mcode.check ? user_mcode.check(mcode) : UserMCode_Unsupported);
@@ -103,9 +139,9 @@ static void execute (sys_state_t state, parser_block_t *gc_block)
 {
     if(gc_block->user_mcode == Spindle_Select) {
         if(gc_block->words.p)
-            spindle_select((spindle_id_t)(gc_block->values.p == 0.0f ? 0 : settings.spindle.flags.type));
+            select_spindle((spindle_id_t)(gc_block->values.p == 0.0f ? 0 : settings.spindle.flags.type));
         else
-            spindle_select(spindle_setting[(uint32_t)gc_block->values.q].spindle_id);
+            select_spindle(spindle_setting[(uint32_t)gc_block->values.q].spindle_id);
     } else if(user_mcode.execute)
         user_mcode.execute(state, gc_block);
 }
@@ -118,7 +154,7 @@ static void tool_selected (tool_data_t *tool)
     if(select_by_tool) do {
         idx--;
         if(spindle_setting[idx].spindle_id != -1 && (idx == 0 || spindle_setting[idx].min_tool_id > 0) && tool->tool_id >= spindle_setting[idx].min_tool_id)
-            ok = spindle_select(idx == 0 ? settings.spindle.flags.type : spindle_setting[idx].spindle_id);
+            ok = select_spindle(idx == 0 ? settings.spindle.flags.type : spindle_setting[idx].spindle_id);
     } while(idx && !ok);
 
     if(on_tool_selected)
@@ -418,6 +454,17 @@ static setting_details_t setting_details = {
 
 #endif
 
+// Returns true while a spindle that has been selected before is swapped in by the hot standby mode,
+// plugins may then keep the spindle configuration and cached parameters from the previous selection.
+bool spindle_select_hot_swap (void)
+{
+#if N_SPINDLE > 1 && N_SYS_SPINDLE == 1 && SPINDLE_HOT_STANDBY
+    return hot_swap;
+#else
+    return false;
+#endif
+}
+
 int8_t spindle_select_get_binding (spindle_id_t spindle_id)
 {
     uint_fast8_t idx = N_SPINDLE;
@@ -460,6 +507,7 @@ void spindle_select_init (void)
 {
     if((nvs_address = nvs_alloc(sizeof(spindle_setting)))) {
         settings_register(&setting_details);
+        spindle_trace_init();
         protocol_enqueue_foreground_task(spindle_select_config, NULL); // delay plugin config until all spindles are registered
     } else
         protocol_enqueue_foreground_task(report_warning, "Spindle select plugin failed to initialize!");
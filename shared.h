@@ -29,6 +29,22 @@
 #include "driver.h"
 #endif
 
+#include "trace.h"
+
+// VFDs driven by the register map engine in vfd/profile.c
+#define VFD_PROFILE_SPINDLES ((1<<SPINDLE_GS20)|(1<<SPINDLE_YL620A)|(1<<SPINDLE_H100)|(1<<SPINDLE_NOWFOREVER))
+
 int8_t spindle_select_get_binding (spindle_id_t spindle_id);
+bool spindle_select_hot_swap (void);
+
+// Stepper spindle position sample for spindle synchronized motion.
+typedef struct {
+    int64_t position;           // steps since the spindle data was reset
+    float angular_position;     // revolutions since the spindle data was reset
+    float rpm;
+    uint32_t timestamp;         // µs, derived from the ms tick if hal.get_micros is not available
+} stepper_spindle_sample_t;
+
+bool stepper_spindle_get_sample (stepper_spindle_sample_t *sample);
 
 /**/
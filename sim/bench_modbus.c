@@ -0,0 +1,538 @@
+/*
+
+  bench_modbus.c - ModBus RTU driver benchmarks against the simulated RS-485 line
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  bench_modbus <scenario> [--baud <rate>] [--no-events] [--no-micros] [--min <value>] [--verbose]
+
+  throughput - back to back reads from one slave, transactions/s against the line limit
+  latency    - commands to one slave while four slaves are loaded with telemetry, command latency
+  load       - mixed traffic to a healthy, a slow and a dead slave with lost and corrupted frames,
+               checks that every transmitted message is completed once and that the queue recovers
+  buses      - throughput on two buses at once, needs a build with MODBUS_RTU_BUSES=2
+
+  --min overrides the pass threshold of the scenario: efficiency in % for throughput and buses, max latency in ms for latency.
+  Returns non zero if a check fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "slave.h"
+
+#define MAX_MESSAGES 200000
+#define DRAIN_MS 3000 // ms, longer than the max slave backoff
+#define MSG_ID(context) ((uint32_t)(uintptr_t)(context) & 0x7FFFFF)
+#define MSG_WRITE(context) (((uintptr_t)(context) & 0x800000) != 0)
+#define MSG_ADDRESS(context) ((uint8_t)((uintptr_t)(context) >> 24))
+#define MSG_CONTEXT(id, address, write) ((void *)(uintptr_t)((id) | ((write) ? 0x800000 : 0) | ((address) << 24)))
+
+typedef struct {
+    uint8_t address;
+    uint_fast8_t line;
+    uint32_t inflight;              // reads, only used for flow control where the line is clean
+    uint32_t committed;
+    uint32_t replies;
+    uint32_t exceptions;
+} producer_t;
+
+static sim_options_t options = {
+    .events = true,
+    .micros = true,
+    .baud = 19200
+};
+
+static float threshold = -1.0f;
+static uint8_t done[MAX_MESSAGES];  // callbacks per read
+static uint8_t cmd_done[0x10000];   // callbacks per command, by the value written
+static uint32_t cmd_commit_us[0x10000];
+static uint32_t n_messages = 0, duplicates = 0;
+static producer_t producers[4];
+static uint_fast8_t n_producers = 0, max_inflight = 4; // 0 to flood the queue
+static bool producing = true;
+static uint32_t cmd_latency_max = 0, cmd_latency_sum = 0, cmd_replies = 0, cmd_interval = 0, cmd_last = 0;
+static uint16_t cmd_value = 0;
+
+static producer_t *producer_get (uint8_t address)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < n_producers; idx++) {
+        if(producers[idx].address == address)
+            return &producers[idx];
+    }
+
+    return NULL;
+}
+
+// Reads are identified by the context, commands share a context so that they can be coalesced
+// and are identified by the value written, echoed in the reply. msg is NULL for an exception.
+static void message_done (void *context, modbus_message_t *msg)
+{
+    uint32_t id = MSG_ID(context), latency;
+    uint16_t value;
+    producer_t *producer;
+
+    if(!MSG_WRITE(context)) {
+        if(id >= n_messages)
+            return;
+        if(done[id]++)
+            duplicates++;
+    }
+
+    if((producer = producer_get(MSG_ADDRESS(context)))) {
+        if(msg)
+            producer->replies++;
+        else
+            producer->exceptions++;
+        if(!MSG_WRITE(context))
+            producer->inflight--;
+    }
+
+    if(msg && MSG_WRITE(context)) {
+        value = ((uint8_t)msg->adu[4] << 8) | (uint8_t)msg->adu[5];
+        if(cmd_done[value]++)
+            duplicates++;
+        latency = sim_us() - cmd_commit_us[value];
+        cmd_latency_max = max(cmd_latency_max, latency);
+        cmd_latency_sum += latency;
+        cmd_replies++;
+    }
+}
+
+static void rx_packet (modbus_message_t *msg)
+{
+    message_done(msg->context, msg);
+}
+
+static void rx_exception (uint8_t code, void *context)
+{
+    message_done(context, NULL);
+}
+
+static const modbus_callbacks_t callbacks = {
+    .on_rx_packet = rx_packet,
+    .on_rx_exception = rx_exception
+};
+
+// Reads of one register, rotating through the registers so that requests are never identical.
+static bool queue_read (producer_t *producer, modbus_priority_t priority)
+{
+    modbus_message_t msg = {
+        .context = MSG_CONTEXT(n_messages, producer->address, false),
+        .crc_check = true,
+        .adu[0] = producer->address,
+        .adu[1] = ModBus_ReadHoldingRegisters,
+        .adu[2] = 0x00,
+        .adu[3] = n_messages % 16,
+        .adu[4] = 0x00,
+        .adu[5] = 0x01,
+        .tx_length = 8,
+        .rx_length = 7
+    };
+
+    if(n_messages == MAX_MESSAGES)
+        return false;
+
+    // counted before the send, a read dropped while the slave backs off completes from within the call
+    n_messages++;
+    producer->committed++;
+    producer->inflight++;
+
+    if(!modbus_rtu_send_async(&msg, &callbacks, (modbus_msg_flags_t){ .priority = priority, .notify = On })) {
+        n_messages--;
+        producer->committed--;
+        producer->inflight--;
+        return false;
+    }
+
+    return true;
+}
+
+// Setpoint style write built in place, a newer write replaces a pending one.
+static bool queue_write (producer_t *producer)
+{
+    modbus_message_t *msg;
+
+    if((msg = modbus_rtu_reserve(producer->address)) == NULL)
+        return false;
+
+    msg->context = MSG_CONTEXT(0, producer->address, true);
+    msg->crc_check = true;
+    msg->adu[0] = producer->address;
+    msg->adu[1] = ModBus_WriteRegister;
+    msg->adu[2] = 0x00;
+    msg->adu[3] = 0x01;
+    msg->adu[4] = cmd_value >> 8;
+    msg->adu[5] = cmd_value & 0xFF;
+    msg->tx_length = 8;
+    msg->rx_length = 8;
+
+    if(!modbus_rtu_commit(msg, &callbacks, (modbus_msg_flags_t){ .priority = ModBus_PriorityHigh, .coalesce = On, .notify = On }))
+        return false;
+
+    cmd_commit_us[cmd_value++] = sim_us();
+    producer->committed++;
+
+    return true;
+}
+
+// Called from the simulated protocol loop, keeps up to max_inflight reads pending per slave.
+static void producer_loop (void)
+{
+    uint_fast8_t idx;
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if(!producing)
+        return;
+
+    for(idx = 0; idx < n_producers; idx++) {
+        if(max_inflight == 0 || producers[idx].inflight < max_inflight)
+            queue_read(&producers[idx], ModBus_PriorityLow);
+    }
+
+    if(cmd_interval && ms - cmd_last >= cmd_interval) {
+        cmd_last = ms;
+        queue_write(&producers[0]);
+    }
+}
+
+// Sums a counter from the $MODBUSSTATS report over all buses.
+static uint32_t modbus_stat (const char *name)
+{
+    static char report[4096];
+
+    char *s = report, key[40];
+    uint32_t sum = 0;
+
+    sim_command_capture("MODBUSSTATS", NULL, report, sizeof(report));
+    snprintf(key, sizeof(key), "[MODBUSSTATS:%s|", name);
+
+    while((s = strstr(s, key))) {
+        s += strlen(key);
+        sum += (uint32_t)strtoul(s, NULL, 10);
+    }
+
+    return sum;
+}
+
+static slave_model_t *add_slave (slave_model_t *model, uint_fast8_t line, uint8_t address, uint32_t latency_us)
+{
+    slave_model_init(model, Slave_Registers, address);
+    model->slave.latency_us = latency_us;
+    rs485_attach(line, &model->slave);
+
+    producers[n_producers].address = address;
+    producers[n_producers].line = line;
+    n_producers++;
+
+    return model;
+}
+
+// Line limited transaction time in us: request, t3.5 at the slave, turnaround, reply and the t3.5 silence before the next request.
+static float transaction_us (uint32_t baud, uint_fast8_t tx_len, uint_fast8_t rx_len, uint32_t latency_us)
+{
+    float char_us = 11e6f / (float)baud;
+
+    return char_us * (tx_len + rx_len + 7.0f) + (float)latency_us;
+}
+
+static void report_link (uint8_t address)
+{
+    modbus_link_stats_t stats;
+
+    if(modbus_rtu_get_link_stats(address, &stats))
+        printf("  slave %u: sent %u, replies %u, timeouts %u, crc errors %u, exceptions %u, queue full %u, max depth %u, max latency %.2f ms\n",
+                address, (unsigned)stats.sent, (unsigned)stats.replies, (unsigned)stats.timeouts, (unsigned)stats.crc_errors,
+                 (unsigned)stats.exceptions, (unsigned)stats.queue_full, stats.max_depth, stats.latency_max / 1000.0f);
+}
+
+// Stops the producer and waits for the slaves to finish backing off and the queue to drain.
+static void drain (void)
+{
+    producing = false;
+    sim_run(DRAIN_MS);
+}
+
+// Every message transmitted completes once with a reply or an error and the line saw the same frames,
+// every message queued is either transmitted or dropped by the scheduler. The messages are queued with the notify flag,
+// those dropped during a slave backoff complete with the MODBUS_RTU_DROPPED exception too.
+static void check_accounting (void)
+{
+    uint_fast8_t idx;
+    uint32_t callbacks = 0, sent = 0, committed = 0, dropped, backoff_dropped;
+    modbus_link_stats_t stats;
+    const rs485_stats_t *wire;
+    char what[100];
+
+    for(idx = 0; idx < n_producers; idx++) {
+
+        committed += producers[idx].committed;
+        callbacks += producers[idx].replies + producers[idx].exceptions;
+
+        if(!modbus_rtu_get_link_stats(producers[idx].address, &stats))
+            continue;
+
+        sent += stats.sent;
+        wire = rs485_get_stats(producers[idx].line);
+
+        snprintf(what, sizeof(what), "slave %u: sent == replies + timeouts + crc errors + exceptions", producers[idx].address);
+        sim_check(stats.sent == stats.replies + stats.timeouts + stats.crc_errors + stats.exceptions, what);
+
+        snprintf(what, sizeof(what), "slave %u: frames on the wire == sent", producers[idx].address);
+        sim_check(wire->frames_by_address[producers[idx].address] == stats.sent, what);
+    }
+
+    backoff_dropped = modbus_stat("backoff drops");
+    dropped = backoff_dropped + modbus_stat("stale drops") + modbus_stat("coalesced") + modbus_stat("slave flushed");
+
+    printf("  queued %u, transmitted %u, dropped by the scheduler %u\n", (unsigned)committed, (unsigned)sent, (unsigned)dropped);
+
+    sim_check(duplicates == 0, "no message completed twice");
+    sim_check(callbacks == sent + backoff_dropped, "one callback per transmitted or backoff dropped message");
+    sim_check(committed == sent + dropped, "queued messages transmitted or dropped");
+
+    for(idx = 0; idx < RS485_LINES; idx++) {
+        snprintf(what, sizeof(what), "line %u: no characters sent in receive mode", idx);
+        sim_check(rs485_get_stats(idx)->tx_undriven == 0, what);
+    }
+}
+
+// Replies arriving after the RX timeout may collide with the next request, only where slaves are slow.
+static void check_no_collisions (void)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < RS485_LINES; idx++)
+        sim_check(rs485_get_stats(idx)->collisions == 0, "no collisions");
+}
+
+// After the load the queue must accept MODBUS_QUEUE_LENGTH messages again, i.e. all slots are back in the free ring.
+static void check_queue_recovered (producer_t *producer)
+{
+    uint_fast8_t idx, accepted = 0;
+    uint32_t completed = producer->replies + producer->exceptions;
+
+    rs485_set_faults(0, &(rs485_faults_t){0});
+
+    for(idx = 0; idx < MODBUS_QUEUE_LENGTH; idx++)
+        accepted += queue_read(producer, ModBus_PriorityHigh);
+
+    sim_check(accepted == MODBUS_QUEUE_LENGTH, "all queue slots free after the load");
+
+    sim_run(1000);
+
+    sim_check(producer->replies + producer->exceptions - completed == accepted, "messages queued after the load completed");
+}
+
+static void bench_throughput (void)
+{
+    slave_model_t slave;
+    uint32_t replies, start_us, elapsed_us;
+    float tps, ideal, efficiency;
+
+    add_slave(&slave, 0, 1, 500);
+    sim_set_loop(producer_loop);
+
+    sim_run(100);
+    replies = producers[0].replies;
+    start_us = sim_us();
+    sim_run(2000);
+    elapsed_us = sim_us() - start_us;
+
+    tps = (producers[0].replies - replies) * 1e6f / elapsed_us;
+    ideal = 1e6f / transaction_us(options.baud, 8, 7, slave.slave.latency_us);
+    efficiency = tps * 100.0f / ideal;
+
+    printf("throughput: %u baud, %s, %s: %.1f transactions/s, line limit %.1f, %.1f%%\n", (unsigned)options.baud,
+            options.events ? "stream events" : "no stream events", options.micros ? "us timebase" : "ms timebase", tps, ideal, efficiency);
+    report_link(1);
+
+    if(threshold < 0.0f) // ms timing rounds each phase up to the next tick
+        threshold = options.micros ? (options.events ? 85.0f : 80.0f) : 40.0f;
+
+    sim_check(efficiency >= threshold, "throughput above threshold");
+
+    drain();
+    check_accounting();
+    check_no_collisions();
+    check_queue_recovered(&producers[0]);
+}
+
+static void bench_latency (void)
+{
+    uint_fast8_t idx;
+    slave_model_t slaves[4];
+    float tx_us = transaction_us(options.baud, 8, 8, 500);
+
+    for(idx = 0; idx < 4; idx++)
+        add_slave(&slaves[idx], 0, idx + 1, 500);
+
+    max_inflight = 1;               // leaves half of the queue for commands
+    cmd_interval = 20;
+    sim_set_loop(producer_loop);
+
+    sim_run(5000);
+
+    printf("latency: %u baud, %u commands, average %.2f ms, max %.2f ms, transaction %.2f ms\n", (unsigned)options.baud, (unsigned)cmd_replies,
+            cmd_replies ? cmd_latency_sum / 1000.0f / cmd_replies : 0.0f, cmd_latency_max / 1000.0f, tx_us / 1000.0f);
+    for(idx = 0; idx < 4; idx++)
+        report_link(idx + 1);
+
+    // a command waits for the transaction in flight at most, the reply is taken on RX idle (t3.5) or the next systick,
+    // plus a systick to start the command when not kicked by an event
+    if(threshold < 0.0f)
+        threshold = (2.0f * tx_us + 3.5f * 11e6f / (float)options.baud + 2000.0f) / 1000.0f;
+
+    sim_check(cmd_replies > 0, "commands completed");
+    sim_check(cmd_latency_max / 1000.0f <= threshold, "command latency below threshold");
+
+    drain();
+    sim_check(slaves[0].regs[1] == (uint16_t)(cmd_value - 1), "last command written to the slave");
+    check_accounting();
+    check_no_collisions();
+    check_queue_recovered(&producers[1]);
+}
+
+static void bench_load (void)
+{
+    slave_model_t healthy, slow, dead;
+    modbus_link_stats_t stats;
+    const rs485_stats_t *wire = rs485_get_stats(0);
+
+    add_slave(&healthy, 0, 1, 500);
+    add_slave(&slow, 0, 2, 20000);
+    slow.slave.jitter_us = 40000;   // at times beyond the RX timeout
+    add_slave(&dead, 0, 3, 500);
+    dead.slave.dead = true;
+
+    rs485_set_faults(0, &(rs485_faults_t){ .drop_pct = 5, .crc_pct = 5, .seed = 12345 });
+
+    max_inflight = 0;               // flood, the queue is always full
+    cmd_interval = 5;
+    sim_set_loop(producer_loop);
+
+    sim_run(5000);
+
+    printf("load: %u baud, %u messages queued, line: %u frames, %u dropped, %u corrupted, %u collisions, %u reply characters lost in transmit mode\n",
+            (unsigned)options.baud, (unsigned)n_messages, (unsigned)wire->frames, (unsigned)wire->dropped, (unsigned)wire->corrupted,
+             (unsigned)wire->collisions, (unsigned)wire->rx_lost);
+    report_link(1);
+    report_link(2);
+    report_link(3);
+
+    if(modbus_rtu_get_link_stats(3, &stats))
+        sim_check(stats.sent <= 15, "dead slave backs off");
+    sim_check(producers[0].replies >= 100, "healthy slave served while the other slaves fail");
+    sim_check(cmd_replies > 0, "commands completed under load");
+
+    drain();
+    check_accounting();
+    check_queue_recovered(&producers[0]);
+}
+
+static void bench_buses (void)
+{
+#if MODBUS_RTU_BUSES > 1
+    uint_fast8_t idx;
+    slave_model_t slaves[2];
+    uint32_t replies[2], start_us, elapsed_us;
+    float tps[2], ideal = 1e6f / transaction_us(options.baud, 8, 7, 500), efficiency;
+
+    add_slave(&slaves[0], 0, 1, 500);
+    add_slave(&slaves[1], 1, 2, 500);
+
+    sim_check(modbus_rtu_bind_address(2, 1), "address bound to the second bus");
+    sim_check(modbus_rtu_get_bus(2) == 1, "bus of the bound address");
+
+    sim_set_loop(producer_loop);
+
+    sim_run(100);
+    for(idx = 0; idx < 2; idx++)
+        replies[idx] = producers[idx].replies;
+    start_us = sim_us();
+    sim_run(2000);
+    elapsed_us = sim_us() - start_us;
+
+    if(threshold < 0.0f)
+        threshold = options.events ? 85.0f : 80.0f;
+
+    for(idx = 0; idx < 2; idx++) {
+        tps[idx] = (producers[idx].replies - replies[idx]) * 1e6f / elapsed_us;
+        efficiency = tps[idx] * 100.0f / ideal;
+        printf("buses: bus %u, %u baud: %.1f transactions/s, line limit %.1f, %.1f%%\n", (unsigned)idx, (unsigned)options.baud, tps[idx], ideal, efficiency);
+        report_link(idx + 1);
+        sim_check(efficiency >= threshold, "throughput of both buses above threshold");
+        sim_check(rs485_get_stats(idx)->frames_by_address[idx + 1] == rs485_get_stats(idx)->frames, "frames only on the bus the slave is bound to");
+    }
+
+    drain();
+    check_accounting();
+    check_no_collisions();
+    check_queue_recovered(&producers[1]);
+#else
+    sim_check(false, "built with MODBUS_RTU_BUSES > 1");
+#endif
+}
+
+int main (int argc, char **argv)
+{
+    int arg;
+    const char *scenario = argc > 1 ? argv[1] : "";
+
+    for(arg = 2; arg < argc; arg++) {
+        if(!strcmp(argv[arg], "--baud") && arg + 1 < argc)
+            options.baud = (uint32_t)atol(argv[++arg]);
+        else if(!strcmp(argv[arg], "--no-events"))
+            options.events = false;
+        else if(!strcmp(argv[arg], "--no-micros"))
+            options.micros = false;
+        else if(!strcmp(argv[arg], "--min") && arg + 1 < argc)
+            threshold = (float)atof(argv[++arg]);
+        else if(!strcmp(argv[arg], "--verbose"))
+            options.verbose = true;
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    sim_init(&options);
+
+    if(!strcmp(scenario, "throughput"))
+        bench_throughput();
+    else if(!strcmp(scenario, "latency"))
+        bench_latency();
+    else if(!strcmp(scenario, "load"))
+        bench_load();
+    else if(!strcmp(scenario, "buses"))
+        bench_buses();
+    else {
+        fprintf(stderr, "usage: %s throughput|latency|load|buses [--baud <rate>] [--no-events] [--no-micros] [--min <value>] [--verbose]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(options.verbose)
+        sim_command("MODBUSSTATS", NULL);
+
+    return sim_result();
+}
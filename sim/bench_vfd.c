@@ -0,0 +1,263 @@
+/*
+
+  bench_vfd.c - VFD spindle benchmarks against scripted slave models on the simulated RS-485 line
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  bench_vfd <drive> [--baud <rate>] [--no-events] [--faults] [--seed <n>] [--verbose]
+
+  drive: huanyang1, huanyang2, gs20, yl620a, h100, nowforever or modvfd
+
+  Selects the spindle for the drive with the slave model at address 1 and the core polling the spindle state every ms, then
+  starts the spindle and measures the time to at speed against the ramp time of the model, measures the RPM set latency,
+  from the update_rpm() call to the setpoint received by the slave, for a number of RPM changes and stops the spindle.
+  The status poll rate is checked against the per bus poll budget.
+
+  --faults loses 10% of the requests and corrupts 5% of the replies, the spindle must still reach the programmed
+  speeds and stop without raising an alarm. --seed selects another fault pattern.
+  Returns non zero if a check fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sim.h"
+#include "slave.h"
+#include "vfd/spindle.h"
+
+#define VFD_ADDRESS 1
+#define POLL_BUDGET 40              // status poll frames per second, VFD_POLL_BUDGET in vfd/spindle.c
+
+static sim_options_t options = {
+    .events = true,
+    .micros = true,
+    .vfd = true,
+    .baud = 19200
+};
+
+static slave_model_t slave;
+static spindle_ptrs_t *spindle;
+static bool faults = false;
+static uint32_t seed = 4711;
+static uint32_t polled_ms = 0;
+
+// The core polls the spindle state from the foreground loop, at least once per ms while the spindle is in use.
+static void core_loop (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if(ms != polled_ms) {
+        polled_ms = ms;
+        spindle->get_state(spindle);
+    }
+}
+
+static bool at_speed (void *data)
+{
+    return slave.running && spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
+}
+
+static bool setpoint_received (void *data)
+{
+    return slave.setpoints != *(uint32_t *)data;
+}
+
+static bool rpm_reached (void *data)
+{
+    return fabsf(slave.rpm_target - *(float *)data) <= 30.0f; // setpoint resolution of the coarsest drive (10 RPM) with rounding
+}
+
+static bool stopped (void *data)
+{
+    return !slave.running;
+}
+
+// Line limited transaction time in us: request, t3.5 at the slave, turnaround, reply and the t3.5 silence before the next request.
+static float transaction_us (uint_fast8_t tx_len, uint_fast8_t rx_len)
+{
+    return 11e6f / (float)options.baud * (tx_len + rx_len + 7.0f) + (float)slave.slave.latency_us;
+}
+
+static void bench_limits (slave_type_t type)
+{
+    // drives with the limits in the register map, the others keep the configured RPM range
+    if(type == Slave_HuanyangV1 || type == Slave_H100 || type == Slave_Nowforever) {
+        printf("  RPM range read from the VFD: %.0f - %.0f\n", spindle->rpm_min, spindle->rpm_max);
+        sim_check(fabsf(spindle->rpm_max - SLAVE_RPM_MAX) <= 30.0f, "max RPM read from the VFD");
+        sim_check(fabsf(spindle->rpm_min - SLAVE_RPM_MIN) <= 30.0f, "min RPM read from the VFD");
+    }
+}
+
+static void bench_start (void)
+{
+    uint32_t start_us = sim_us(), elapsed_ms, ramp_ms = (uint32_t)(12000.0f * 0.95f / slave.ramp * 1000.0f), bound_ms;
+
+    spindle->set_state(spindle, (spindle_state_t){ .on = On }, 12000.0f);
+
+    sim_check(sim_run_until(at_speed, NULL, 5000), "at speed");
+
+    elapsed_ms = (sim_us() - start_us) / 1000;
+
+    // the ramp starts after the run command and the setpoint, the at speed state is taken from a status poll:
+    // one fast poll interval (20 ms) and up to five transactions, polls may take two frames. Retries add to that with faults.
+    bound_ms = ramp_ms + 20 + (uint32_t)(5.0f * transaction_us(8, 8) / 1000.0f) + (faults ? 500 : 0);
+
+    printf("  start to at speed: %u ms, ramp to the at speed window %u ms, bound %u ms\n", (unsigned)elapsed_ms, (unsigned)ramp_ms, (unsigned)bound_ms);
+
+    sim_check(elapsed_ms <= bound_ms, "at speed within the ramp time");
+}
+
+static void bench_rpm (void)
+{
+    static const float rpms[] = { 6000.0f, 18000.0f, 9000.0f, 24000.0f, 3000.0f, 12000.0f };
+
+    uint_fast8_t idx;
+    uint32_t setpoints, latency_us, latency_max = 0, latency_sum = 0, n_latency = 0;
+    uint64_t call_ns;
+    float bound_us = 2.0f * transaction_us(8, 8) + 2000.0f;
+
+    for(idx = 0; idx < sizeof(rpms) / sizeof(float); idx++) {
+
+        setpoints = slave.setpoints;
+        call_ns = sim_ns();
+
+        spindle->update_rpm(spindle, rpms[idx]);
+
+        if(sim_run_until(setpoint_received, &setpoints, 1000)) {
+            latency_us = (uint32_t)((slave.setpoint_ns - call_ns) / 1000);
+            latency_max = max(latency_max, latency_us);
+            latency_sum += latency_us;
+            n_latency++;
+        }
+
+        // a lost setpoint is retried by the driver
+        sim_check(sim_run_until(rpm_reached, (void *)&rpms[idx], 2000), "RPM setpoint received");
+        sim_run(200);
+    }
+
+    printf("  RPM set latency: average %.2f ms, max %.2f ms, %u setpoints, bound %.2f ms\n",
+            n_latency ? latency_sum / 1000.0f / n_latency : 0.0f, latency_max / 1000.0f, (unsigned)n_latency, bound_us / 1000.0f);
+
+    // the setpoint waits for a status poll in flight at most
+    if(!faults)
+        sim_check(latency_max <= bound_us, "RPM set latency below bound");
+}
+
+static void bench_polls (void)
+{
+    uint32_t reads = slave.reads;
+
+    sim_run(2000);
+
+    reads = slave.reads - reads;
+
+    printf("  status polls at speed: %.1f/s, budget %u/s\n", reads / 2.0f, POLL_BUDGET);
+
+    sim_check(reads > 0, "spindle polled at speed");
+    sim_check(reads <= 2 * POLL_BUDGET, "poll rate within the budget");
+}
+
+static void bench_stop (void)
+{
+    spindle->set_state(spindle, (spindle_state_t){0}, 0.0f);
+
+    sim_check(sim_run_until(stopped, NULL, 2000), "spindle stopped");
+
+    sim_run(1000);
+
+    sim_check(!spindle->get_state(spindle).on, "spindle reported off");
+    sim_check(slave_model_rpm(&slave) == 0.0f, "spindle ramped down");
+}
+
+int main (int argc, char **argv)
+{
+    int arg;
+    slave_type_t type;
+    spindle_id_t spindle_id;
+
+    if(argc < 2 || !slave_model_find(argv[1], &type) || type == Slave_Registers) {
+        fprintf(stderr, "usage: %s huanyang1|huanyang2|gs20|yl620a|h100|nowforever|modvfd [--baud <rate>] [--no-events] [--faults] [--seed <n>] [--verbose]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for(arg = 2; arg < argc; arg++) {
+        if(!strcmp(argv[arg], "--baud") && arg + 1 < argc)
+            options.baud = (uint32_t)atol(argv[++arg]);
+        else if(!strcmp(argv[arg], "--no-events"))
+            options.events = false;
+        else if(!strcmp(argv[arg], "--faults"))
+            faults = true;
+        else if(!strcmp(argv[arg], "--seed") && arg + 1 < argc)
+            seed = (uint32_t)atol(argv[++arg]);
+        else if(!strcmp(argv[arg], "--verbose"))
+            options.verbose = true;
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    sim_init(&options);
+
+    slave_model_init(&slave, type, VFD_ADDRESS);
+    rs485_attach(0, &slave.slave);
+
+    if(faults)
+        rs485_set_faults(0, &(rs485_faults_t){ .drop_pct = 10, .crc_pct = 5, .seed = seed });
+
+    if(type == Slave_MODVFD) {
+        // the model has the GS20 register map, frequency in 0.01 Hz at 60 RPM per Hz
+        vfd_config.in_multiplier = 100.0f;
+        vfd_config.in_divider = 60.0f;
+        vfd_config.out_multiplier = 60.0f;
+        vfd_config.out_divider = 100.0f;
+        sim_settings_changed();
+    }
+
+    if((spindle_id = sim_spindle_find(slave_model_spindle(type))) == -1 || !spindle_select(spindle_id)) {
+        fprintf(stderr, "spindle %s not available\n", slave_model_spindle(type));
+        return EXIT_FAILURE;
+    }
+
+    spindle = sim_spindle_active();
+    sim_set_loop(core_loop);
+    sim_run(500);
+
+    printf("vfd: %s, %u baud, %s%s\n", slave_model_spindle(type), (unsigned)options.baud,
+            options.events ? "stream events" : "no stream events", faults ? ", lost and corrupted frames" : "");
+
+    bench_limits(type);
+    bench_start();
+    bench_rpm();
+    bench_polls();
+    bench_stop();
+
+    printf("  slave: %u requests, %u commands, %u setpoints, %u reads, %u exceptions\n", (unsigned)slave.slave.requests,
+            (unsigned)slave.commands, (unsigned)slave.setpoints, (unsigned)slave.reads, (unsigned)slave.exceptions);
+
+    sim_check(slave.exceptions == 0, "no exception responses");
+    sim_check(sim_alarms() == 0, "no alarms");
+
+    if(options.verbose)
+        sim_command("MODBUSSTATS", NULL);
+
+    return sim_result();
+}
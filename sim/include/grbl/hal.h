@@ -0,0 +1,493 @@
+/*
+
+  sim/include/grbl/hal.h - host replacement for the grblHAL core HAL
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// Only the parts of the core API used by the ModBus RTU driver and the VFD spindles are declared here,
+// with the same names and signatures as in the core. The implementation is in sim/sim.c.
+
+#ifndef _SIM_HAL_H_
+#define _SIM_HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define ASCII_EOL "\r\n"
+#define UNUSED(x) (void)(x)
+#define On 1
+#define Off 0
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#ifndef N_SPINDLE
+#define N_SPINDLE 8
+#endif
+#ifndef N_SYS_SPINDLE
+#define N_SYS_SPINDLE 1
+#endif
+#ifndef N_SPINDLE_SELECTABLE
+#define N_SPINDLE_SELECTABLE 1
+#endif
+
+#define SPINDLE_HUANYANG1   1
+#define SPINDLE_HUANYANG2   2
+#define SPINDLE_GS20        3
+#define SPINDLE_YL620A      4
+#define SPINDLE_MODVFD      5
+#define SPINDLE_H100        6
+#define SPINDLE_ONOFF1      7
+#define SPINDLE_NOWFOREVER  13
+#define SPINDLE_ALL        -1
+
+typedef uint_fast16_t sys_state_t;
+typedef uint16_t nvs_address_t;
+typedef int8_t spindle_id_t;
+typedef int8_t spindle_num_t;
+
+typedef enum {
+    Status_OK = 0,
+    Status_Unhandled,
+    Status_InvalidStatement,
+    Status_SettingDisabled,
+    Status_SettingValueOutOfRange
+} status_code_t;
+
+typedef enum {
+    NVS_TransferResult_OK = 0,
+    NVS_TransferResult_Failed
+} nvs_transfer_result_t;
+
+typedef enum {
+    Alarm_Spindle = 1,
+    Alarm_SelftestFailed
+} alarm_code_t;
+
+typedef enum {
+    Message_Plain = 0,
+    Message_Info,
+    Message_Warning
+} message_type_t;
+
+// Spindle
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t on               :1,
+                ccw              :1,
+                pwm              :1,
+                reserved         :1,
+                override_disable :1,
+                encoder_error    :1,
+                at_speed         :1,
+                synchronized     :1;
+    };
+} spindle_state_t;
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint32_t variable         :1,
+                 direction        :1,
+                 at_speed         :1,
+                 laser            :1,
+                 pwm_invert       :1,
+                 pid              :1,
+                 rpm_range_locked :1,
+                 gpio_controlled  :1,
+                 cmd_controlled   :1,
+                 cloned           :1;
+    };
+} spindle_cap_t;
+
+typedef enum {
+    SpindleType_PWM = 0,
+    SpindleType_Basic,
+    SpindleType_VFD,
+    SpindleType_Solenoid,
+    SpindleType_Stepper,
+    SpindleType_Null
+} spindle_type_t;
+
+typedef enum {
+    SpindleData_Counters = 0,
+    SpindleData_RPM,
+    SpindleData_AngularPosition,
+    SpindleData_AtSpeed
+} spindle_data_request_t;
+
+typedef enum {
+    SpindleHAL_Raw = 0,
+    SpindleHAL_Configured,
+    SpindleHAL_Active
+} spindle_hal_t;
+
+typedef struct {
+    float rpm;
+    float rpm_low_limit;
+    float rpm_high_limit;
+    float rpm_programmed;
+    float angular_position;
+    uint32_t index_count;
+    uint32_t pulse_count;
+    uint32_t error_count;
+    bool at_speed_enabled;
+    spindle_state_t state_programmed;
+} spindle_data_t;
+
+typedef struct spindle_ptrs spindle_ptrs_t;
+
+typedef bool (*spindle_config_ptr)(spindle_ptrs_t *spindle);
+typedef void (*spindle_set_state_ptr)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm);
+typedef spindle_state_t (*spindle_get_state_ptr)(spindle_ptrs_t *spindle);
+typedef void (*spindle_update_rpm_ptr)(spindle_ptrs_t *spindle, float rpm);
+typedef spindle_data_t *(*spindle_get_data_ptr)(spindle_data_request_t request);
+typedef void (*spindle_reset_data_ptr)(void);
+typedef void (*spindle_off_ptr)(spindle_ptrs_t *spindle);
+
+struct spindle_ptrs {
+    spindle_id_t id;
+    uint8_t ref_id;
+    spindle_type_t type;
+    spindle_cap_t cap;
+    float rpm_min;
+    float rpm_max;
+    float at_speed_tolerance;
+    spindle_config_ptr config;
+    spindle_set_state_ptr set_state;
+    spindle_get_state_ptr get_state;
+    spindle_update_rpm_ptr update_rpm;
+    spindle_get_data_ptr get_data;
+    spindle_reset_data_ptr reset_data;
+    spindle_off_ptr esp32_off;
+};
+
+#define spindle_validate_at_speed(d, r) { (d).rpm = r; (d).state_programmed.at_speed = !(d).at_speed_enabled || ((d).rpm >= (d).rpm_low_limit && (d).rpm <= (d).rpm_high_limit); }
+
+spindle_id_t spindle_register (const spindle_ptrs_t *spindle, const char *name);
+spindle_ptrs_t *spindle_get_hal (spindle_id_t spindle_id, spindle_hal_t hal);
+spindle_ptrs_t *spindle_get (spindle_num_t spindle_num);
+const char *spindle_get_name (spindle_id_t spindle_id);
+bool spindle_select (spindle_id_t spindle_id);
+spindle_id_t spindle_add_null (void);
+void spindle_set_at_speed_range (spindle_ptrs_t *spindle, spindle_data_t *spindle_data, float rpm);
+
+// Streams
+
+typedef bool (*set_baud_rate_ptr)(uint32_t baud_rate);
+typedef uint16_t (*get_stream_buffer_count_ptr)(void);
+typedef void (*stream_write_ptr)(const char *s);
+typedef void (*stream_write_n_ptr)(const char *s, uint16_t len);
+typedef int16_t (*stream_read_ptr)(void);
+typedef void (*flush_stream_buffer_ptr)(void);
+typedef bool (*enqueue_realtime_command_ptr)(char c);
+typedef enqueue_realtime_command_ptr (*set_enqueue_rt_handler_ptr)(enqueue_realtime_command_ptr handler);
+
+typedef enum {
+    StreamType_Serial = 0,
+    StreamType_MPG,
+    StreamType_Null
+} stream_type_t;
+
+typedef struct {
+    stream_type_t type;
+    uint8_t instance;
+    stream_write_ptr write;
+    stream_write_n_ptr write_n;
+    stream_read_ptr read;
+    set_baud_rate_ptr set_baud_rate;
+    get_stream_buffer_count_ptr get_tx_buffer_count;
+    get_stream_buffer_count_ptr get_rx_buffer_count;
+    flush_stream_buffer_ptr reset_write_buffer;
+    flush_stream_buffer_ptr reset_read_buffer;
+    set_enqueue_rt_handler_ptr set_enqueue_rt_handler;
+} io_stream_t;
+
+typedef const io_stream_t *(*stream_claim_ptr)(uint32_t baud_rate);
+
+typedef struct {
+    stream_type_t type;
+    uint8_t instance;
+    struct {
+        uint8_t claimable    :1,
+                claimed      :1,
+                modbus_ready :1;
+    } flags;
+    stream_claim_ptr claim;
+} io_stream_properties_t;
+
+typedef bool (*stream_enumerate_callback_ptr)(io_stream_properties_t const *properties);
+
+bool stream_enumerate_streams (stream_enumerate_callback_ptr callback);
+bool stream_buffer_all (char c);
+
+// Ports
+
+typedef enum {
+    Port_Digital = 0,
+    Port_Analog
+} io_port_type_t;
+
+typedef enum {
+    Port_Input = 0,
+    Port_Output
+} io_port_direction_t;
+
+typedef enum {
+    Output_TX = 0,
+    Input_RX
+} pin_function_t;
+
+typedef enum {
+    PinGroup_UART = 1
+} pin_group_t;
+
+uint8_t ioports_available (io_port_type_t type, io_port_direction_t dir);
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+
+// Settings
+
+typedef struct {
+    struct {
+        float rpm_max;
+        float rpm_min;
+        float at_speed_tolerance;
+    } spindle;
+} settings_t;
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint32_t spindle :1;
+    };
+} settings_changed_flags_t;
+
+typedef enum {
+    Group_Root = 0,
+    Group_ModBus,
+    Group_VFD
+} setting_group_t;
+
+typedef enum {
+    Format_Bool = 0,
+    Format_Bitfield,
+    Format_XBitfield,
+    Format_RadioButtons,
+    Format_AxisMask,
+    Format_Integer,
+    Format_Decimal,
+    Format_String,
+    Format_Password,
+    Format_IPv4,
+    Format_Int8,
+    Format_Int16
+} setting_datatype_t;
+
+typedef enum {
+    Setting_NonCore = 0,
+    Setting_NonCoreFn,
+    Setting_IsExtended,
+    Setting_IsExtendedFn
+} setting_type_t;
+
+typedef enum {
+    Setting_VFD_ModbusAddress = 360,
+    Settings_ModBus_BaudRate = 374,
+    Settings_ModBus_RXTimeout = 375,
+    Setting_VFD_RPM_Hz = 461,
+    Setting_VFD_10 = 462,
+    Setting_VFD_11,
+    Setting_VFD_12,
+    Setting_VFD_13,
+    Setting_VFD_14,
+    Setting_VFD_15,
+    Setting_VFD_16,
+    Setting_VFD_17,
+    Setting_VFD_18,
+    Setting_VFD_19,
+    Setting_VFD_ModbusAddress0 = 476,
+    Setting_VFD_ModbusAddress1,
+    Setting_VFD_ModbusAddress2,
+    Setting_VFD_ModbusAddress3
+} setting_id_t;
+
+typedef struct setting_detail {
+    setting_id_t id;
+    setting_group_t group;
+    const char *name;
+    const char *unit;
+    setting_datatype_t datatype;
+    const char *format;
+    const char *min_value;
+    const char *max_value;
+    setting_type_t type;
+    void *value;
+    void *get_value;
+    bool (*is_available)(const struct setting_detail *setting);
+} setting_detail_t;
+
+typedef struct {
+    setting_group_t parent;
+    setting_group_t id;
+    const char *name;
+} setting_group_detail_t;
+
+typedef struct {
+    setting_id_t id;
+    const char *description;
+} setting_descr_t;
+
+typedef struct setting_details {
+    const setting_group_detail_t *groups;
+    uint8_t n_groups;
+    const setting_detail_t *settings;
+    uint8_t n_settings;
+    const setting_descr_t *descriptions;
+    uint8_t n_descriptions;
+    void (*save)(void);
+    void (*load)(void);
+    void (*restore)(void);
+    struct setting_details *next;
+} setting_details_t;
+
+typedef status_code_t (*setting_set_int_ptr)(setting_id_t id, uint_fast16_t value);
+typedef uint32_t (*setting_get_int_ptr)(setting_id_t id);
+
+extern settings_t settings;
+
+void settings_register (setting_details_t *details);
+nvs_address_t nvs_alloc (size_t size);
+
+// System
+
+typedef struct {
+    bool abort;
+    bool cold_start;
+} system_t;
+
+extern system_t sys;
+
+typedef status_code_t (*sys_command_ptr)(sys_state_t state, char *args);
+
+typedef union {
+    uint8_t flags;
+    struct {
+        uint8_t noargs         :1,
+                allow_blocking :1,
+                help_fn        :1;
+    };
+} sys_command_flags_t;
+
+typedef struct {
+    const char *command;
+    sys_command_ptr execute;
+    sys_command_flags_t flags;
+    union {
+        const char *str;
+    } help;
+} sys_command_t;
+
+typedef struct sys_commands_str {
+    uint8_t n_commands;
+    const sys_command_t *commands;
+    struct sys_commands_str *next;
+} sys_commands_t;
+
+void system_register_commands (sys_commands_t *commands);
+void system_raise_alarm (alarm_code_t alarm);
+sys_state_t state_get (void);
+
+// Reports
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint32_t all     :1,
+                 spindle :1;
+    };
+} report_tracking_flags_t;
+
+void report_message (const char *msg, message_type_t type);
+void report_warning (void *message);
+void report_plugin (const char *name, const char *version);
+char *uitoa (uint32_t n);
+char *ftoa (float n, uint8_t decimal_places);
+
+// Tasks
+
+typedef void (*foreground_task_ptr)(void *data);
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
+bool task_add_systick (foreground_task_ptr fn, void *data);
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay_ms);
+void task_delete (foreground_task_ptr fn, void *data);
+
+// Core event hooks
+
+typedef void (*on_realtime_report_ptr)(stream_write_ptr stream_write, report_tracking_flags_t report);
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_spindle_selected_ptr)(spindle_ptrs_t *spindle);
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_reset_ptr)(void);
+
+typedef struct {
+    on_realtime_report_ptr on_realtime_report;
+    on_report_options_ptr on_report_options;
+    on_spindle_selected_ptr on_spindle_selected;
+    on_execute_realtime_ptr on_execute_realtime;
+    on_reset_ptr on_reset;
+} grbl_t;
+
+extern grbl_t grbl;
+
+// HAL
+
+typedef void (*driver_reset_ptr)(void);
+typedef void (*settings_changed_ptr)(settings_t *settings, settings_changed_flags_t changed);
+
+typedef struct {
+    uint32_t f_mcu;                     // MHz
+    uint32_t (*get_elapsed_ticks)(void);
+    uint32_t (*get_micros)(void);
+    driver_reset_ptr driver_reset;
+    settings_changed_ptr settings_changed;
+    struct {
+        nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum);
+        nvs_transfer_result_t (*memcpy_to_nvs)(nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum);
+    } nvs;
+    io_stream_t stream;
+    struct {
+        void (*set_pin_description)(pin_function_t function, pin_group_t group, const char *description);
+    } periph_port;
+    struct {
+        void (*digital_out)(uint8_t port, bool on);
+    } port;
+} hal_t;
+
+extern hal_t hal;
+
+#endif
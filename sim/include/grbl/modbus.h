@@ -0,0 +1,99 @@
+/*
+
+  sim/include/grbl/modbus.h - host replacement for the grblHAL core ModBus API
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _SIM_MODBUS_H_
+#define _SIM_MODBUS_H_
+
+#include "hal.h"
+
+#define MODBUS_MAX_ADU_SIZE 12
+#define MODBUS_QUEUE_LENGTH 8
+
+typedef enum {
+    Modbus_InterfaceRTU = 0,
+    Modbus_InterfaceASCII,
+    Modbus_InterfaceTCP
+} modbus_interface_t;
+
+typedef enum {
+    ModBus_ReadCoils = 1,
+    ModBus_ReadDiscreteInputs = 2,
+    ModBus_ReadHoldingRegisters = 3,
+    ModBus_ReadInputRegisters = 4,
+    ModBus_WriteCoil = 5,
+    ModBus_WriteRegister = 6,
+    ModBus_ReadExceptionStatus = 7,
+    ModBus_Diagnostics = 8,
+    ModBus_WriteCoils = 15,
+    ModBus_WriteRegisters = 16
+} modbus_function_t;
+
+typedef struct {
+    void *context;
+    uint8_t tx_length;
+    uint8_t rx_length;
+    bool crc_check;
+    char adu[MODBUS_MAX_ADU_SIZE];
+} modbus_message_t;
+
+typedef struct {
+    void (*on_rx_packet)(modbus_message_t *msg);
+    void (*on_rx_exception)(uint8_t code, void *context);
+} modbus_callbacks_t;
+
+typedef union {
+    uint32_t timeout[6];
+    struct {
+        uint32_t b2400;
+        uint32_t b4800;
+        uint32_t b9600;
+        uint32_t b19200;
+        uint32_t b38400;
+        uint32_t b115200;
+    };
+} modbus_silence_timeout_t;
+
+typedef struct {
+    uint32_t baud_rate;
+    uint32_t rx_timeout;
+} modbus_settings_t;
+
+typedef bool (*modbus_is_up_ptr)(void);
+typedef void (*modbus_flush_queue_ptr)(void);
+typedef void (*modbus_set_silence_ptr)(const modbus_silence_timeout_t *timeout);
+typedef bool (*modbus_send_ptr)(modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+
+typedef struct {
+    modbus_interface_t interface;
+    modbus_is_up_ptr is_up;
+    modbus_flush_queue_ptr flush_queue;
+    modbus_set_silence_ptr set_silence;
+    modbus_send_ptr send;
+} modbus_api_t;
+
+bool modbus_enabled (void);
+bool modbus_isup (void);
+void modbus_flush_queue (void);
+void modbus_set_silence (const modbus_silence_timeout_t *timeout);
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+bool modbus_register_api (const modbus_api_t *api);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+
+  rs485.c - simulated half-duplex RS-485 line with ModBus slaves for the host simulation
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Each line is a UART with a transmit and a receive buffer behind a half-duplex transceiver, characters are
+  11 bits at the configured baud rate. The UART is the master, the slaves see the characters put on the wire
+  while the transceiver is in transmit mode and end a frame when the line has been idle for t3.5.
+  A slave addressed by a frame with a valid CRC replies character by character after its turnaround latency,
+  the reply is only received while the transceiver is in receive mode. A character sent by the master while
+  a slave is replying collides and corrupts both frames.
+
+  The TX complete event is raised when the last character has been shifted out, RX idle when the line has been idle
+  for t3.5 after a received character. Both are called from rs485_update() which the simulation calls on every step,
+  i.e. as from an interrupt handler.
+*/
+
+#include <stdio.h>
+
+#include "rs485.h"
+
+typedef struct {
+    uint8_t instance;
+    uint32_t baud;
+    uint64_t char_ns, t3_5_ns;
+    bool tx_dir;
+    // UART transmitter, the character being shifted out is at tx_tail
+    uint8_t tx_buf[RS485_BUFSIZE];
+    uint_fast16_t tx_head, tx_tail;
+    uint64_t tx_done_ns;                    // end of the character being shifted out, 0 when idle
+    // UART receiver
+    uint8_t rx_buf[RS485_BUFSIZE];
+    uint_fast16_t rx_head, rx_tail;
+    uint64_t rx_last_ns;
+    bool rx_idle_pending;
+    // request frame seen by the slaves
+    uint8_t frame[RS485_BUFSIZE];
+    uint_fast8_t frame_len;
+    bool frame_bad;
+    uint64_t frame_last_ns;
+    // reply being sent by a slave
+    rs485_slave_t *replier;
+    uint8_t reply[RS485_BUFSIZE];
+    uint_fast8_t reply_len, reply_pos;
+    uint64_t reply_next_ns;                 // start of the next reply character
+    uint_fast8_t n_slaves;
+    rs485_slave_t *slaves[RS485_SLAVES];
+    rs485_faults_t faults;
+    uint32_t rng;
+    rs485_stats_t stats;
+    modbus_stream_event_ptr event_handler;
+    enqueue_realtime_command_ptr enqueue_rt;
+} rs485_line_t;
+
+static bool events = false;
+static uint64_t now = 0;
+static rs485_line_t lines[RS485_LINES];
+
+static uint16_t crc16 (const uint8_t *buf, uint_fast16_t len)
+{
+    uint_fast8_t bit;
+    uint_fast16_t crc = 0xFFFF;
+
+    while(len--) {
+        crc ^= *buf++;
+        for(bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+
+    return (uint16_t)crc;
+}
+
+// xorshift32, the fault pattern is reproducible for a given seed.
+static uint32_t line_random (rs485_line_t *line)
+{
+    line->rng ^= line->rng << 13;
+    line->rng ^= line->rng >> 17;
+    line->rng ^= line->rng << 5;
+
+    return line->rng;
+}
+
+static inline bool line_fault (rs485_line_t *line, uint_fast8_t pct)
+{
+    return pct && line_random(line) % 100 < pct;
+}
+
+static inline uint_fast16_t ring_count (uint_fast16_t head, uint_fast16_t tail)
+{
+    return (head + RS485_BUFSIZE - tail) % RS485_BUFSIZE;
+}
+
+static void line_set_baud (rs485_line_t *line, uint32_t baud)
+{
+    line->baud = baud;
+    line->char_ns = 11000000000ULL / baud;
+    line->t3_5_ns = line->char_ns * 7 / 2;
+}
+
+static rs485_slave_t *slave_get (rs485_line_t *line, uint8_t address)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < line->n_slaves; idx++) {
+        if(line->slaves[idx]->address == address)
+            return line->slaves[idx];
+    }
+
+    return NULL;
+}
+
+// A request frame has ended, let the addressed slave reply.
+static void frame_end (rs485_line_t *line)
+{
+    uint_fast8_t len;
+    rs485_slave_t *slave;
+
+    if(line->frame_len < 4 || line->frame_bad || crc16(line->frame, line->frame_len - 2) != (line->frame[line->frame_len - 2] | (line->frame[line->frame_len - 1] << 8))) {
+        line->stats.bad_frames++;
+        return;
+    }
+
+    if((slave = slave_get(line, line->frame[0])) == NULL)
+        return;
+
+    if(line_fault(line, line->faults.drop_pct)) {
+        line->stats.dropped++;
+        return;
+    }
+
+    slave->requests++;
+
+    if(slave->dead || (len = slave->request(slave, line->frame, line->frame_len - 2, line->reply)) == 0)
+        return;
+
+    uint16_t crc = crc16(line->reply, len);
+
+    line->reply[len++] = crc & 0xFF;
+    line->reply[len++] = crc >> 8;
+
+    if(line_fault(line, line->faults.crc_pct)) {
+        line->reply[line_random(line) % len] ^= 1 << (line_random(line) % 8);
+        line->stats.corrupted++;
+    }
+
+    slave->replies++;
+    line->stats.replies++;
+    line->replier = slave;
+    line->reply_len = len;
+    line->reply_pos = 0;
+    line->reply_next_ns = line->frame_last_ns + line->t3_5_ns + slave->latency_us * 1000ULL +
+                           (slave->jitter_us ? (line_random(line) % (slave->jitter_us + 1)) * 1000ULL : 0);
+}
+
+// Master character has been shifted out.
+static void tx_char_done (rs485_line_t *line, uint8_t c)
+{
+    if(!line->tx_dir) {
+        line->stats.tx_undriven++;
+        return;
+    }
+
+    if(line->frame_len == 0)
+        line->stats.frames++;
+
+    if(line->replier && line->reply_next_ns < line->tx_done_ns) {
+        line->stats.collisions++;
+        line->frame_bad = true;
+    }
+
+    if(line->frame_len < RS485_BUFSIZE)
+        line->frame[line->frame_len++] = c;
+    if(line->frame_len == 1)
+        line->stats.frames_by_address[c]++;
+
+    line->frame_last_ns = line->tx_done_ns;
+}
+
+static void line_update (rs485_line_t *line)
+{
+    // Transmitter, characters are sent back to back
+    while(line->tx_done_ns && now >= line->tx_done_ns) {
+
+        tx_char_done(line, line->tx_buf[line->tx_tail]);
+        line->tx_tail = (line->tx_tail + 1) % RS485_BUFSIZE;
+
+        if(line->tx_tail != line->tx_head)
+            line->tx_done_ns += line->char_ns;
+        else {
+            line->tx_done_ns = 0;
+            if(events && line->event_handler)
+                line->event_handler(ModBus_StreamEvent_TXComplete);
+        }
+    }
+
+    // End of request frame as seen by the slaves
+    if(line->frame_len && now - line->frame_last_ns >= line->t3_5_ns && !(line->tx_done_ns && line->tx_dir)) {
+        frame_end(line);
+        line->frame_len = 0;
+        line->frame_bad = false;
+    }
+
+    // Slave reply
+    while(line->replier && now >= line->reply_next_ns + line->char_ns) {
+
+        if(line->tx_done_ns && line->tx_dir) {
+            line->stats.collisions++;
+            line->frame_bad = true;
+        } else if(line->tx_dir)
+            line->stats.rx_lost++;
+        else if(ring_count(line->rx_head, line->rx_tail) < RS485_BUFSIZE - 1) {
+            line->rx_buf[line->rx_head] = line->reply[line->reply_pos];
+            line->rx_head = (line->rx_head + 1) % RS485_BUFSIZE;
+            line->rx_last_ns = line->reply_next_ns + line->char_ns;
+            line->rx_idle_pending = true;
+        }
+
+        line->reply_next_ns += line->char_ns;
+
+        if(++line->reply_pos == line->reply_len)
+            line->replier = NULL;
+    }
+
+    if(line->rx_idle_pending && now - line->rx_last_ns >= line->t3_5_ns) {
+        line->rx_idle_pending = false;
+        if(events && line->event_handler)
+            line->event_handler(ModBus_StreamEvent_RXIdle);
+    }
+}
+
+void rs485_update (uint64_t now_ns)
+{
+    uint_fast8_t idx;
+
+    now = now_ns;
+
+    for(idx = 0; idx < RS485_LINES; idx++) {
+        if(lines[idx].baud)
+            line_update(&lines[idx]);
+    }
+}
+
+// Stream functions
+
+static void stream_write_n (rs485_line_t *line, const char *s, uint16_t len)
+{
+    while(len--) {
+
+        if(ring_count(line->tx_head, line->tx_tail) == RS485_BUFSIZE - 1) {
+            fprintf(stderr, "rs485: TX buffer overflow\n");
+            return;
+        }
+
+        line->tx_buf[line->tx_head] = (uint8_t)*s++;
+        line->tx_head = (line->tx_head + 1) % RS485_BUFSIZE;
+
+        if(line->tx_done_ns == 0)
+            line->tx_done_ns = now + line->char_ns;
+    }
+}
+
+static int16_t stream_read (rs485_line_t *line)
+{
+    int16_t c = -1;
+
+    if(line->rx_tail != line->rx_head) {
+        c = line->rx_buf[line->rx_tail];
+        line->rx_tail = (line->rx_tail + 1) % RS485_BUFSIZE;
+    }
+
+    return c;
+}
+
+// The count includes the character being shifted out so that the transceiver is not switched while it is on the wire.
+static uint16_t stream_get_tx_count (rs485_line_t *line)
+{
+    return (uint16_t)ring_count(line->tx_head, line->tx_tail);
+}
+
+// The character being shifted out cannot be recalled.
+static void stream_reset_write (rs485_line_t *line)
+{
+    if(line->tx_done_ns)
+        line->tx_head = (line->tx_tail + 1) % RS485_BUFSIZE;
+}
+
+#define LINE_STREAM(n) \
+static void stream_write_n##n (const char *s, uint16_t len) { stream_write_n(&lines[n], s, len); } \
+static void stream_write##n (const char *s) { stream_write_n(&lines[n], s, (uint16_t)strlen(s)); } \
+static int16_t stream_read##n (void) { return stream_read(&lines[n]); } \
+static bool stream_set_baud##n (uint32_t baud) { line_set_baud(&lines[n], baud); return true; } \
+static uint16_t stream_get_tx_count##n (void) { return stream_get_tx_count(&lines[n]); } \
+static uint16_t stream_get_rx_count##n (void) { return (uint16_t)ring_count(lines[n].rx_head, lines[n].rx_tail); } \
+static void stream_reset_write##n (void) { stream_reset_write(&lines[n]); } \
+static void stream_reset_read##n (void) { lines[n].rx_tail = lines[n].rx_head; } \
+static enqueue_realtime_command_ptr stream_set_rt##n (enqueue_realtime_command_ptr handler) \
+    { enqueue_realtime_command_ptr prev = lines[n].enqueue_rt; lines[n].enqueue_rt = handler; return prev; } \
+static bool stream_set_event_handler##n (modbus_stream_event_ptr handler) { lines[n].event_handler = handler; return true; } \
+static const io_stream_t stream##n = { \
+    .type = StreamType_Serial, \
+    .instance = RS485_INSTANCE + n, \
+    .write = stream_write##n, \
+    .write_n = stream_write_n##n, \
+    .read = stream_read##n, \
+    .set_baud_rate = stream_set_baud##n, \
+    .get_tx_buffer_count = stream_get_tx_count##n, \
+    .get_rx_buffer_count = stream_get_rx_count##n, \
+    .reset_write_buffer = stream_reset_write##n, \
+    .reset_read_buffer = stream_reset_read##n, \
+    .set_enqueue_rt_handler = stream_set_rt##n \
+}; \
+static const io_stream_t *stream_claim##n (uint32_t baud) { line_set_baud(&lines[n], baud); return &stream##n; }
+
+LINE_STREAM(0)
+LINE_STREAM(1)
+
+static const stream_claim_ptr stream_claim[RS485_LINES] = { stream_claim0, stream_claim1 };
+static const stream_set_event_handler_ptr set_event_handler[RS485_LINES] = { stream_set_event_handler0, stream_set_event_handler1 };
+
+bool rs485_enumerate_streams (stream_enumerate_callback_ptr callback)
+{
+    uint_fast8_t idx;
+    io_stream_properties_t properties = {
+        .type = StreamType_Serial,
+        .flags.claimable = On,
+        .flags.modbus_ready = On
+    };
+
+    for(idx = 0; idx < RS485_LINES; idx++) {
+        properties.instance = RS485_INSTANCE + idx;
+        properties.flags.claimed = lines[idx].baud != 0;
+        properties.claim = stream_claim[idx];
+        if(callback(&properties))
+            return true;
+    }
+
+    return false;
+}
+
+void rs485_init (bool with_events)
+{
+    uint_fast8_t idx;
+
+    events = with_events;
+    memset(lines, 0, sizeof(lines));
+
+    for(idx = 0; idx < RS485_LINES; idx++) {
+        lines[idx].instance = RS485_INSTANCE + idx;
+        lines[idx].rng = 0x2545F491 + idx;
+        if(events)
+            modbus_rtu_register_stream_events(RS485_INSTANCE + idx, set_event_handler[idx]);
+    }
+}
+
+void rs485_attach (uint_fast8_t line, rs485_slave_t *slave)
+{
+    if(line < RS485_LINES && lines[line].n_slaves < RS485_SLAVES)
+        lines[line].slaves[lines[line].n_slaves++] = slave;
+}
+
+void rs485_set_faults (uint_fast8_t line, const rs485_faults_t *faults)
+{
+    lines[line].faults = *faults;
+    if(faults->seed)
+        lines[line].rng = faults->seed;
+}
+
+void rs485_set_direction (uint_fast8_t line, bool tx)
+{
+    if(line < RS485_LINES)
+        lines[line].tx_dir = tx;
+}
+
+const rs485_stats_t *rs485_get_stats (uint_fast8_t line)
+{
+    return &lines[line].stats;
+}
+
+uint32_t rs485_get_baud (uint_fast8_t line)
+{
+    return lines[line].baud;
+}
@@ -0,0 +1,74 @@
+/*
+
+  rs485.h - simulated half-duplex RS-485 line with ModBus slaves for the host simulation
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "grbl/hal.h"
+#include "modbus_rtu.h"
+
+#define RS485_LINES     2
+#define RS485_SLAVES    8           // per line
+#define RS485_BUFSIZE   64
+#define RS485_INSTANCE  1           // stream instance of the first line
+
+struct rs485_slave;
+
+// Called with a complete request frame addressed to the slave, the CRC is checked by the line.
+// Returns the length of the reply built in reply without the CRC, 0 for no reply.
+typedef uint_fast8_t (*rs485_request_ptr)(struct rs485_slave *slave, const uint8_t *req, uint_fast8_t len, uint8_t *reply);
+
+typedef struct rs485_slave {
+    uint8_t address;
+    bool dead;                      // does not reply
+    uint32_t latency_us;            // turnaround, end of request frame (after t3.5) to first reply character
+    uint32_t jitter_us;             // random extra turnaround, 0 to jitter_us
+    rs485_request_ptr request;
+    void *model;
+    uint32_t requests;              // frames received with a valid CRC
+    uint32_t replies;
+} rs485_slave_t;
+
+typedef struct {
+    uint_fast8_t drop_pct;          // percent of requests lost on the way to the slave
+    uint_fast8_t crc_pct;           // percent of replies with a bit error
+    uint32_t seed;                  // for the fault pattern, 0 for the default
+} rs485_faults_t;
+
+typedef struct {
+    uint32_t frames;                // request frames put on the wire by the master
+    uint32_t frames_by_address[256];
+    uint32_t replies;               // reply frames put on the wire by the slaves
+    uint32_t dropped;               // requests lost by fault injection
+    uint32_t corrupted;             // replies corrupted by fault injection
+    uint32_t bad_frames;            // frames with a CRC error seen by the slaves, e.g. after a collision
+    uint32_t collisions;            // characters sent by the master and a slave at the same time
+    uint32_t rx_lost;               // reply characters lost since the master receiver was disabled
+    uint32_t tx_undriven;           // characters written by the master with the transceiver not in transmit mode
+} rs485_stats_t;
+
+void rs485_init (bool events);
+void rs485_update (uint64_t now_ns);
+void rs485_attach (uint_fast8_t line, rs485_slave_t *slave);
+void rs485_set_faults (uint_fast8_t line, const rs485_faults_t *faults);
+void rs485_set_direction (uint_fast8_t line, bool tx);
+const rs485_stats_t *rs485_get_stats (uint_fast8_t line);
+uint32_t rs485_get_baud (uint_fast8_t line);
+bool rs485_enumerate_streams (stream_enumerate_callback_ptr callback);
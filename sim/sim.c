@@ -0,0 +1,768 @@
+/*
+
+  sim.c - host simulation of the grblHAL core parts used by the ModBus RTU driver and the VFD spindles
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Time is virtual and only advances when the foreground calls grbl.on_execute_realtime(), as the core protocol loop
+  and the blocking ModBus send do. Each call is one SIM_STEP_NS step: the RS-485 lines are updated and may raise
+  their stream events, and on every ms tick the systick tasks are run. Both run at any nesting level, as they would
+  from an interrupt. Delayed and foreground tasks and the loop function set by the benchmark are only run from
+  the outermost call, as from the core protocol loop.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+#define SIM_NVS_SIZE    2048
+#define SIM_TASKS       16
+#define SIM_FG_TASKS    32
+#define SIM_DIR_PORTS   4
+
+extern void vfd_init (void);
+
+hal_t hal = {0};
+grbl_t grbl = {0};
+settings_t settings = {0};
+system_t sys = {0};
+
+static uint64_t now_ns = 1000000000ULL; // uptime 1 s at start
+static bool quiet = true;
+static char *capture = NULL;
+static size_t capture_size = 0, capture_len = 0;
+static uint32_t alarms = 0;
+static sim_loop_ptr loop = NULL;
+static uint8_t nvs[SIM_NVS_SIZE];
+static bool nvs_valid[SIM_NVS_SIZE];
+static nvs_address_t nvs_next = 1;
+static setting_details_t *setting_details = NULL;
+static sys_commands_t *commands = NULL;
+static const modbus_api_t *modbus_api = NULL;
+static uint_fast8_t n_ports_claimed = 0;
+
+static struct {
+    foreground_task_ptr fn;
+    void *data;
+} systick_tasks[SIM_TASKS];
+
+static struct {
+    foreground_task_ptr fn;
+    void *data;
+    uint32_t due;
+} delayed_tasks[SIM_TASKS];
+
+static struct {
+    foreground_task_ptr fn;
+    void *data;
+} fg_tasks[SIM_FG_TASKS];
+
+static uint_fast8_t fg_head = 0, fg_tail = 0;
+
+static struct {
+    spindle_ptrs_t hal;
+    const char *name;
+    int8_t binding;
+} spindles[N_SPINDLE];
+
+static uint_fast8_t n_spindles = 0;
+static spindle_ptrs_t active_spindle;
+static spindle_id_t null_spindle = -1;
+
+// Time base
+
+uint64_t sim_ns (void)
+{
+    return now_ns;
+}
+
+uint32_t sim_us (void)
+{
+    return (uint32_t)(now_ns / 1000);
+}
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return (uint32_t)(now_ns / 1000000);
+}
+
+// Tasks
+
+bool task_add_systick (foreground_task_ptr fn, void *data)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < SIM_TASKS; idx++) {
+        if(systick_tasks[idx].fn == NULL) {
+            systick_tasks[idx].fn = fn;
+            systick_tasks[idx].data = data;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay_ms)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < SIM_TASKS; idx++) {
+        if(delayed_tasks[idx].fn == NULL) {
+            delayed_tasks[idx].fn = fn;
+            delayed_tasks[idx].data = data;
+            delayed_tasks[idx].due = get_elapsed_ticks() + delay_ms;
+            return true;
+        }
+    }
+
+    fprintf(stderr, "sim: delayed task table full\n");
+
+    return false;
+}
+
+void task_delete (foreground_task_ptr fn, void *data)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < SIM_TASKS; idx++) {
+        if(delayed_tasks[idx].fn == fn && delayed_tasks[idx].data == data)
+            delayed_tasks[idx].fn = NULL;
+    }
+}
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data)
+{
+    uint_fast8_t next = (fg_head + 1) % SIM_FG_TASKS;
+
+    if(next == fg_tail)
+        return false;
+
+    fg_tasks[fg_head].fn = fn;
+    fg_tasks[fg_head].data = data;
+    fg_head = next;
+
+    return true;
+}
+
+static void run_tasks (void)
+{
+    uint_fast8_t idx;
+    uint32_t ms = get_elapsed_ticks();
+
+    for(idx = 0; idx < SIM_TASKS; idx++) {
+        if(delayed_tasks[idx].fn && (int32_t)(ms - delayed_tasks[idx].due) >= 0) {
+            foreground_task_ptr fn = delayed_tasks[idx].fn;
+            delayed_tasks[idx].fn = NULL;
+            fn(delayed_tasks[idx].data);
+        }
+    }
+
+    while(fg_tail != fg_head) {
+        foreground_task_ptr fn = fg_tasks[fg_tail].fn;
+        void *data = fg_tasks[fg_tail].data;
+        fg_tail = (fg_tail + 1) % SIM_FG_TASKS;
+        fn(data);
+    }
+}
+
+static void sim_step (sys_state_t state)
+{
+    static uint_fast8_t depth = 0;
+
+    uint_fast8_t idx;
+    uint32_t ms = get_elapsed_ticks();
+
+    now_ns += SIM_STEP_NS;
+
+    rs485_update(now_ns);
+
+    if(get_elapsed_ticks() != ms) {
+        for(idx = 0; idx < SIM_TASKS; idx++) {
+            if(systick_tasks[idx].fn)
+                systick_tasks[idx].fn(systick_tasks[idx].data);
+        }
+    }
+
+    if(depth == 0) {
+        depth++;
+        run_tasks();
+        if(loop)
+            loop();
+        depth--;
+    }
+}
+
+void sim_run_us (uint32_t us)
+{
+    uint64_t end = now_ns + us * 1000ULL;
+
+    while(now_ns < end)
+        grbl.on_execute_realtime(state_get());
+}
+
+void sim_run (uint32_t ms)
+{
+    sim_run_us(ms * 1000);
+}
+
+bool sim_run_until (sim_done_ptr done, void *data, uint32_t timeout_ms)
+{
+    uint64_t end = now_ns + timeout_ms * 1000000ULL;
+
+    while(!done(data)) {
+        if(now_ns >= end)
+            return false;
+        grbl.on_execute_realtime(state_get());
+    }
+
+    return true;
+}
+
+void sim_set_loop (sim_loop_ptr fn)
+{
+    loop = fn;
+}
+
+sys_state_t state_get (void)
+{
+    return 0; // Idle
+}
+
+// NVS, a location reads back as failed until written
+
+static nvs_transfer_result_t memcpy_from_nvs (uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum)
+{
+    uint32_t idx;
+
+    for(idx = 0; idx < size; idx++) {
+        if(source + idx >= SIM_NVS_SIZE || !nvs_valid[source + idx])
+            return NVS_TransferResult_Failed;
+    }
+
+    memcpy(dest, &nvs[source], size);
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t memcpy_to_nvs (nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    if(dest + size > SIM_NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(&nvs[dest], source, size);
+    memset(&nvs_valid[dest], true, size);
+
+    return NVS_TransferResult_OK;
+}
+
+nvs_address_t nvs_alloc (size_t size)
+{
+    nvs_address_t address = nvs_next;
+
+    if(nvs_next + size + 1 > SIM_NVS_SIZE)
+        return 0;
+
+    nvs_next += size + 1; // + checksum
+
+    return address;
+}
+
+// Settings
+
+void settings_register (setting_details_t *details)
+{
+    setting_details_t **last = &setting_details;
+
+    while(*last)
+        last = &(*last)->next;
+
+    details->next = NULL;
+    *last = details;
+}
+
+static void settings_load (void)
+{
+    setting_details_t *details;
+
+    for(details = setting_details; details; details = details->next) {
+        if(details->load)
+            details->load();
+    }
+}
+
+void sim_settings_changed (void)
+{
+    hal.settings_changed(&settings, (settings_changed_flags_t){ .spindle = On });
+}
+
+// Sets an integer setting as the core does from a $<id>=<value> command.
+status_code_t sim_setting (setting_id_t id, uint32_t value)
+{
+    uint_fast8_t idx;
+    status_code_t status = Status_Unhandled;
+    setting_details_t *details;
+    const setting_detail_t *setting = NULL;
+
+    for(details = setting_details; details && setting == NULL; details = details->next) {
+        for(idx = 0; idx < details->n_settings; idx++) {
+            if(details->settings[idx].id == id) {
+                setting = &details->settings[idx];
+                break;
+            }
+        }
+    }
+
+    if(setting == NULL)
+        return Status_Unhandled;
+
+    details = setting_details;
+    while(details->settings > setting || setting >= details->settings + details->n_settings)
+        details = details->next;
+
+    if(setting->is_available && !setting->is_available(setting))
+        return Status_SettingDisabled;
+
+    switch(setting->type) {
+
+        case Setting_NonCoreFn:
+        case Setting_IsExtendedFn:
+            status = ((setting_set_int_ptr)setting->value)(id, (uint_fast16_t)value);
+            break;
+
+        default:
+            status = Status_OK;
+            switch(setting->datatype) {
+
+                case Format_Integer:
+                    *(uint32_t *)setting->value = value;
+                    break;
+
+                case Format_Int16:
+                    *(uint16_t *)setting->value = (uint16_t)value;
+                    break;
+
+                case Format_Decimal:
+                    *(float *)setting->value = (float)value;
+                    break;
+
+                default:
+                    *(uint8_t *)setting->value = (uint8_t)value;
+                    break;
+            }
+            break;
+    }
+
+    if(status == Status_OK) {
+        if(details->save)
+            details->save();
+        hal.settings_changed(&settings, (settings_changed_flags_t){0});
+    }
+
+    return status;
+}
+
+static void settings_changed (settings_t *settings, settings_changed_flags_t changed)
+{
+}
+
+// System commands and reports
+
+void system_register_commands (sys_commands_t *cmds)
+{
+    cmds->next = commands;
+    commands = cmds;
+}
+
+status_code_t sim_command (const char *command, char *args)
+{
+    uint_fast8_t idx;
+    sys_commands_t *cmds;
+
+    for(cmds = commands; cmds; cmds = cmds->next) {
+        for(idx = 0; idx < cmds->n_commands; idx++) {
+            if(!strcmp(cmds->commands[idx].command, command))
+                return cmds->commands[idx].execute(state_get(), args);
+        }
+    }
+
+    return Status_Unhandled;
+}
+
+void system_raise_alarm (alarm_code_t alarm)
+{
+    alarms++;
+
+    if(!quiet)
+        printf("ALARM:%d\n", (int)alarm);
+}
+
+uint32_t sim_alarms (void)
+{
+    return alarms;
+}
+
+void sim_quiet (bool on)
+{
+    quiet = on;
+}
+
+static void stream_write (const char *s)
+{
+    if(capture) {
+        size_t len = strlen(s);
+        if(capture_len + len < capture_size) {
+            memcpy(capture + capture_len, s, len + 1);
+            capture_len += len;
+        }
+    } else if(!quiet)
+        fputs(s, stdout);
+}
+
+// Runs a system command with the output written to buf instead of the console.
+status_code_t sim_command_capture (const char *command, char *args, char *buf, size_t size)
+{
+    status_code_t status;
+
+    *buf = '\0';
+    capture = buf;
+    capture_size = size;
+    capture_len = 0;
+
+    status = sim_command(command, args);
+
+    capture = NULL;
+
+    return status;
+}
+
+void report_message (const char *msg, message_type_t type)
+{
+    if(!quiet)
+        printf("[MSG:%s]\n", msg);
+}
+
+void report_warning (void *message)
+{
+    report_message((char *)message, Message_Warning);
+}
+
+void report_plugin (const char *name, const char *version)
+{
+    if(!quiet)
+        printf("[PLUGIN:%s %s]\n", name, version);
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[12];
+
+    snprintf(buf, sizeof(buf), "%u", (unsigned)n);
+
+    return buf;
+}
+
+char *ftoa (float n, uint8_t decimal_places)
+{
+    static char buf[24];
+
+    snprintf(buf, sizeof(buf), "%.*f", decimal_places, (double)n);
+
+    return buf;
+}
+
+bool stream_buffer_all (char c)
+{
+    return false;
+}
+
+bool stream_enumerate_streams (stream_enumerate_callback_ptr callback)
+{
+    return rs485_enumerate_streams(callback);
+}
+
+// Ports, the direction outputs of the buses are mapped to the lines from the top port down.
+
+uint8_t ioports_available (io_port_type_t type, io_port_direction_t dir)
+{
+    return type == Port_Digital && dir == Port_Output ? SIM_DIR_PORTS : 0;
+}
+
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description)
+{
+    if(type != Port_Digital || dir != Port_Output || *port >= SIM_DIR_PORTS || n_ports_claimed == RS485_LINES)
+        return false;
+
+    n_ports_claimed++;
+
+    return true;
+}
+
+static void digital_out (uint8_t port, bool on)
+{
+    rs485_set_direction(SIM_DIR_PORTS - 1 - port, on);
+}
+
+// Spindles
+
+spindle_id_t spindle_register (const spindle_ptrs_t *spindle, const char *name)
+{
+    if(n_spindles == N_SPINDLE)
+        return -1;
+
+    memcpy(&spindles[n_spindles].hal, spindle, sizeof(spindle_ptrs_t));
+    spindles[n_spindles].hal.id = n_spindles;
+    spindles[n_spindles].name = name;
+    spindles[n_spindles].binding = -1;
+
+    return n_spindles++;
+}
+
+spindle_ptrs_t *spindle_get_hal (spindle_id_t spindle_id, spindle_hal_t hal)
+{
+    if(spindle_id < 0 || spindle_id >= n_spindles)
+        return NULL;
+
+    if(hal == SpindleHAL_Active)
+        return active_spindle.id == spindle_id && active_spindle.set_state ? &active_spindle : NULL;
+
+    return &spindles[spindle_id].hal;
+}
+
+spindle_ptrs_t *spindle_get (spindle_num_t spindle_num)
+{
+    return spindle_num == 0 && active_spindle.set_state ? &active_spindle : NULL;
+}
+
+const char *spindle_get_name (spindle_id_t spindle_id)
+{
+    return spindle_id >= 0 && spindle_id < n_spindles ? spindles[spindle_id].name : NULL;
+}
+
+spindle_id_t sim_spindle_find (const char *name)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < n_spindles; idx++) {
+        if(!strcmp(spindles[idx].name, name))
+            return idx;
+    }
+
+    return -1;
+}
+
+bool sim_spindle_bind (spindle_id_t spindle_id, int8_t binding)
+{
+    if(spindle_id < 0 || spindle_id >= n_spindles)
+        return false;
+
+    spindles[spindle_id].binding = binding;
+
+    return true;
+}
+
+spindle_ptrs_t *sim_spindle_active (void)
+{
+    return active_spindle.set_state ? &active_spindle : NULL;
+}
+
+int8_t spindle_select_get_binding (spindle_id_t spindle_id)
+{
+    return spindle_id >= 0 && spindle_id < n_spindles ? spindles[spindle_id].binding : -1;
+}
+
+bool spindle_select_hot_swap (void)
+{
+    return false;
+}
+
+// As the core: the configured copy becomes the active spindle, the RPM range is taken from the settings.
+bool spindle_select (spindle_id_t spindle_id)
+{
+    spindle_ptrs_t *spindle;
+
+    if((spindle = spindle_get_hal(spindle_id, SpindleHAL_Configured)) == NULL)
+        return false;
+
+    if(spindle->config && !spindle->config(spindle))
+        return false;
+
+    if(active_spindle.set_state && active_spindle.id != spindle_id)
+        active_spindle.set_state(&active_spindle, (spindle_state_t){0}, 0.0f);
+
+    memcpy(&active_spindle, spindle, sizeof(spindle_ptrs_t));
+    active_spindle.rpm_min = settings.spindle.rpm_min;
+    active_spindle.rpm_max = settings.spindle.rpm_max;
+    active_spindle.at_speed_tolerance = settings.spindle.at_speed_tolerance;
+
+    if(grbl.on_spindle_selected)
+        grbl.on_spindle_selected(&active_spindle);
+
+    return true;
+}
+
+static void null_set_state (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
+{
+}
+
+static spindle_state_t null_get_state (spindle_ptrs_t *spindle)
+{
+    return (spindle_state_t){0};
+}
+
+spindle_id_t spindle_add_null (void)
+{
+    static const spindle_ptrs_t spindle = {
+        .type = SpindleType_Null,
+        .set_state = null_set_state,
+        .get_state = null_get_state
+    };
+
+    if(null_spindle == -1)
+        null_spindle = spindle_register(&spindle, "NULL");
+
+    return null_spindle;
+}
+
+void spindle_set_at_speed_range (spindle_ptrs_t *spindle, spindle_data_t *spindle_data, float rpm)
+{
+    spindle_data->rpm_programmed = rpm;
+    spindle_data->state_programmed.at_speed = false;
+
+    if(spindle && spindle->at_speed_tolerance > 0.0f) {
+        spindle_data->rpm_low_limit = rpm * (1.0f - (spindle->at_speed_tolerance / 100.0f));
+        spindle_data->rpm_high_limit = rpm * (1.0f + (spindle->at_speed_tolerance / 100.0f));
+    }
+}
+
+// ModBus API registry
+
+bool modbus_register_api (const modbus_api_t *api)
+{
+    static modbus_api_t registered;
+
+    memcpy(&registered, api, sizeof(modbus_api_t));
+    modbus_api = &registered;
+
+    return true;
+}
+
+bool modbus_enabled (void)
+{
+    return modbus_api != NULL;
+}
+
+bool modbus_isup (void)
+{
+    return modbus_api && modbus_api->is_up();
+}
+
+void modbus_flush_queue (void)
+{
+    if(modbus_api)
+        modbus_api->flush_queue();
+}
+
+void modbus_set_silence (const modbus_silence_timeout_t *timeout)
+{
+    if(modbus_api)
+        modbus_api->set_silence(timeout);
+}
+
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block)
+{
+    return modbus_api && modbus_api->send(msg, callbacks, block);
+}
+
+// Benchmark results
+
+static uint32_t failures = 0;
+
+bool sim_check (bool ok, const char *what)
+{
+    if(!ok) {
+        failures++;
+        printf("FAIL: %s\n", what);
+    }
+
+    return ok;
+}
+
+int sim_result (void)
+{
+    printf(failures ? "%u check(s) failed\n" : "all checks passed\n", (unsigned)failures);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static uint32_t baud_index (uint32_t baud)
+{
+    static const uint32_t rates[] = { 2400, 4800, 9600, 19200, 38400, 115200 };
+
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < sizeof(rates) / sizeof(rates[0]); idx++) {
+        if(rates[idx] == baud)
+            return idx;
+    }
+
+    fprintf(stderr, "sim: unsupported baud rate %u\n", (unsigned)baud);
+    exit(EXIT_FAILURE);
+}
+
+// The plugins are initialized as from the driver init, then the settings are loaded and the cold start is ended as by the core.
+void sim_init (const sim_options_t *options)
+{
+    quiet = !options->verbose;
+
+    hal.f_mcu = 100;
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    hal.get_micros = options->micros ? sim_us : NULL;
+    hal.settings_changed = settings_changed;
+    hal.nvs.memcpy_from_nvs = memcpy_from_nvs;
+    hal.nvs.memcpy_to_nvs = memcpy_to_nvs;
+    hal.stream.write = stream_write;
+    hal.port.digital_out = digital_out;
+    grbl.on_execute_realtime = sim_step;
+
+    settings.spindle.rpm_min = 0.0f;
+    settings.spindle.rpm_max = 24000.0f;
+    settings.spindle.at_speed_tolerance = 5.0f;
+
+    sys.cold_start = true;
+
+    rs485_init(options->events);
+    rs485_update(now_ns); // the line time base starts at the uptime too, or frames written before the first step are sent in no time
+
+    modbus_rtu_init();
+
+    if(options->vfd)
+        vfd_init();
+
+    settings_load();
+    sim_settings_changed();
+
+    if(options->baud && sim_setting(Settings_ModBus_BaudRate, baud_index(options->baud)) != Status_OK) {
+        fprintf(stderr, "sim: failed to set the baud rate\n");
+        exit(EXIT_FAILURE);
+    }
+
+    sys.cold_start = false;
+}
@@ -0,0 +1,58 @@
+/*
+
+  sim.h - host simulation of the grblHAL core parts used by the ModBus RTU driver and the VFD spindles
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "grbl/hal.h"
+#include "grbl/modbus.h"
+#include "rs485.h"
+
+#define SIM_STEP_NS 5000            // simulation time step, 5 us
+
+typedef struct {
+    bool events;                    // register TX complete and RX idle stream events
+    bool micros;                    // provide hal.get_micros, the driver falls back to ms timing if not
+    bool vfd;                       // initialize the VFD spindles
+    bool verbose;                   // print reports and messages from the plugins
+    uint32_t baud;                  // ModBus baud rate, 0 for the default
+} sim_options_t;
+
+typedef void (*sim_loop_ptr)(void);
+typedef bool (*sim_done_ptr)(void *data);
+
+void sim_init (const sim_options_t *options);
+uint64_t sim_ns (void);
+uint32_t sim_us (void);
+void sim_run_us (uint32_t us);
+void sim_run (uint32_t ms);
+bool sim_run_until (sim_done_ptr done, void *data, uint32_t timeout_ms);
+void sim_set_loop (sim_loop_ptr loop);
+status_code_t sim_setting (setting_id_t id, uint32_t value);
+status_code_t sim_command (const char *command, char *args);
+status_code_t sim_command_capture (const char *command, char *args, char *buf, size_t size);
+void sim_settings_changed (void);
+void sim_quiet (bool quiet);
+uint32_t sim_alarms (void);
+spindle_id_t sim_spindle_find (const char *name);
+bool sim_spindle_bind (spindle_id_t spindle_id, int8_t binding);
+spindle_ptrs_t *sim_spindle_active (void);
+bool sim_check (bool ok, const char *what);
+int sim_result (void);
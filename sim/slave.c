@@ -0,0 +1,384 @@
+/*
+
+  slave.c - scripted VFD slave models for the host simulation
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Each model implements the register map and command words the corresponding driver in vfd/ uses,
+  for a 24000 RPM spindle at 400 Hz with the frequency limited to 20 - 400 Hz and the default RPM per Hz setting (60).
+  The MODVFD model is the GS20 register map, the benchmark sets the MODVFD scaling settings to match.
+  Requests for registers not in the map get an illegal data address exception.
+*/
+
+#include <stdio.h>
+
+#include "slave.h"
+#include "sim.h"
+
+// Frequency register units per RPM, for the setpoint and the output frequency.
+static const float units_per_rpm[Slave_Models] = {
+    [Slave_HuanyangV1] = 5000.0f / 3000.0f, // Hz * 100 with 3000 RPM at 50 Hz (PD144)
+    [Slave_HuanyangP2A] = 10000.0f / SLAVE_RPM_MAX, // setpoint in 0.01% of max RPM, RPM is read back as is
+    [Slave_GS20] = 100.0f / 60.0f,
+    [Slave_YL620A] = 10.0f / 60.0f,
+    [Slave_H100] = 10.0f / 60.0f,
+    [Slave_Nowforever] = 100.0f / 60.0f,
+    [Slave_MODVFD] = 100.0f / 60.0f,
+    [Slave_Registers] = 1.0f
+};
+
+static const struct {
+    const char *name;               // for the command line
+    const char *spindle;            // name the driver registers the spindle with
+} models[Slave_Models] = {
+    [Slave_HuanyangV1] = { "huanyang1", "Huanyang v1" },
+    [Slave_HuanyangP2A] = { "huanyang2", "Huanyang P2A" },
+    [Slave_GS20] = { "gs20", "Durapulse GS20" },
+    [Slave_YL620A] = { "yl620a", "Yalang YS620" },
+    [Slave_H100] = { "h100", "H-100" },
+    [Slave_Nowforever] = { "nowforever", "Nowforever" },
+    [Slave_MODVFD] = { "modvfd", "MODVFD" },
+    [Slave_Registers] = { "registers", NULL }
+};
+
+static void model_update (slave_model_t *model)
+{
+    uint64_t now = sim_ns();
+    float target = model->running ? model->rpm_target : 0.0f;
+    float step = model->ramp * (float)(now - model->updated_ns) / 1e9f;
+
+    if(model->rpm < target)
+        model->rpm = model->rpm + step > target ? target : model->rpm + step;
+    else
+        model->rpm = model->rpm - step < target ? target : model->rpm - step;
+
+    model->updated_ns = now;
+}
+
+static inline uint16_t to_units (slave_model_t *model, float rpm)
+{
+    return (uint16_t)(rpm * units_per_rpm[model->type] + 0.5f);
+}
+
+static void set_state (slave_model_t *model, bool running, bool ccw)
+{
+    model_update(model);
+    model->running = running;
+    model->ccw = ccw;
+    model->commands++;
+}
+
+static void set_setpoint (slave_model_t *model, uint16_t value)
+{
+    model_update(model);
+    model->rpm_target = (float)value / units_per_rpm[model->type];
+    model->setpoints++;
+    model->setpoint_ns = sim_ns();
+}
+
+// Returns false for an illegal data address.
+static bool model_write (slave_model_t *model, uint8_t function, uint16_t reg, uint16_t value)
+{
+    switch(model->type) {
+
+        case Slave_HuanyangP2A:
+            if(function == ModBus_WriteRegister && reg == 0x1000)
+                set_setpoint(model, value);
+            else if(function == ModBus_WriteRegister && reg == 0x2000 && (value == 1 || value == 2 || value == 6))
+                set_state(model, value != 6, value == 2);
+            else
+                return false;
+            break;
+
+        case Slave_GS20:
+        case Slave_YL620A:
+        case Slave_MODVFD:
+            // bit 1:0 - stop/run, bit 5:4 - forward/reverse
+            if(function == ModBus_WriteRegister && reg == 0x2000)
+                set_state(model, (value & 0x03) == 0x02, (value & 0x30) == 0x20);
+            else if(function == ModBus_WriteRegister && reg == 0x2001)
+                set_setpoint(model, value);
+            else
+                return false;
+            break;
+
+        case Slave_H100:
+            if(function == ModBus_WriteCoil && reg >= 0x0049 && reg <= 0x004B && value == 0xFF00)
+                set_state(model, reg != 0x004B, reg == 0x004A);
+            else if(function == ModBus_WriteRegister && reg == 0x0201)
+                set_setpoint(model, value);
+            else
+                return false;
+            break;
+
+        case Slave_Nowforever:
+            // bit 0 - run, bit 1 - reverse
+            if(function == ModBus_WriteRegisters && reg == 0x0900)
+                set_state(model, value & 0x01, value & 0x02);
+            else if(function == ModBus_WriteRegisters && reg == 0x0901)
+                set_setpoint(model, value);
+            else
+                return false;
+            break;
+
+        case Slave_Registers:
+            if(function == ModBus_WriteCoil || reg >= sizeof(model->regs) / sizeof(uint16_t))
+                return false;
+            model->regs[reg] = value;
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Returns false for an illegal data address.
+static bool model_read (slave_model_t *model, uint8_t function, uint16_t reg, uint16_t *value)
+{
+    model_update(model);
+
+    switch(model->type) {
+
+        case Slave_HuanyangP2A:
+            if(function != ModBus_ReadHoldingRegisters)
+                return false;
+            if(reg == 0x700C || reg == 0x700D)
+                *value = (uint16_t)(model->rpm + 0.5f);
+            else if(reg == 0xB005 || reg == 0xB006)
+                *value = (uint16_t)SLAVE_RPM_MAX;
+            else
+                return false;
+            break;
+
+        case Slave_GS20:
+        case Slave_MODVFD:
+            if(function != ModBus_ReadHoldingRegisters || reg != 0x2103)
+                return false;
+            *value = to_units(model, model->rpm);
+            break;
+
+        case Slave_YL620A:
+            if(function != ModBus_ReadHoldingRegisters || reg != 0x200B)
+                return false;
+            *value = to_units(model, model->rpm);
+            break;
+
+        case Slave_H100:
+            if(function == ModBus_ReadInputRegisters && reg == 0x0000)
+                *value = to_units(model, model->rpm);
+            else if(function == ModBus_ReadInputRegisters && reg == 0x0001)
+                *value = (uint16_t)(10.0f + model->rpm / SLAVE_RPM_MAX * 50.0f); // output current, A * 10
+            else if(function == ModBus_ReadHoldingRegisters && reg == 0x0005) // PD05, max frequency
+                *value = to_units(model, SLAVE_RPM_MAX);
+            else if(function == ModBus_ReadHoldingRegisters && reg == 0x000B) // PD11, min frequency
+                *value = to_units(model, SLAVE_RPM_MIN);
+            else
+                return false;
+            break;
+
+        case Slave_Nowforever:
+            if(function != ModBus_ReadHoldingRegisters)
+                return false;
+            if(reg == 0x0502)
+                *value = to_units(model, model->rpm);
+            else if(reg == 0x0007)
+                *value = to_units(model, SLAVE_RPM_MAX);
+            else if(reg == 0x0008)
+                *value = to_units(model, SLAVE_RPM_MIN);
+            else
+                return false;
+            break;
+
+        case Slave_Registers:
+            if(function != ModBus_ReadHoldingRegisters || reg >= sizeof(model->regs) / sizeof(uint16_t))
+                return false;
+            *value = model->regs[reg];
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+static uint_fast8_t exception (slave_model_t *model, const uint8_t *req, uint8_t code, uint8_t *reply)
+{
+    model->exceptions++;
+
+    reply[0] = req[0];
+    reply[1] = req[1] | 0x80;
+    reply[2] = code;
+
+    return 3;
+}
+
+static uint_fast8_t modbus_request (rs485_slave_t *slave, const uint8_t *req, uint_fast8_t len, uint8_t *reply)
+{
+    slave_model_t *model = (slave_model_t *)slave->model;
+    uint16_t reg = (req[2] << 8) | req[3], n, value, idx;
+
+    reply[0] = req[0];
+    reply[1] = req[1];
+
+    switch(req[1]) {
+
+        case ModBus_ReadHoldingRegisters:
+        case ModBus_ReadInputRegisters:
+            n = (req[4] << 8) | req[5];
+            if(len != 6 || n == 0 || n > 4)
+                return exception(model, req, 3, reply);
+            model->reads++;
+            for(idx = 0; idx < n; idx++) {
+                if(!model_read(model, req[1], reg + idx, &value))
+                    return exception(model, req, 2, reply);
+                reply[3 + idx * 2] = value >> 8;
+                reply[4 + idx * 2] = value & 0xFF;
+            }
+            // The P2A driver decodes the value from the bytes at offset 4 and 5 of the two register reply.
+            if(model->type == Slave_HuanyangP2A && n == 2) {
+                model_read(model, req[1], reg, &value);
+                reply[3] = 0;
+                reply[4] = value >> 8;
+                reply[5] = value & 0xFF;
+                reply[6] = 0;
+            }
+            reply[2] = n * 2;
+            return 3 + n * 2;
+
+        case ModBus_WriteCoil:
+        case ModBus_WriteRegister:
+            if(len != 6 || !model_write(model, req[1], reg, (req[4] << 8) | req[5]))
+                return exception(model, req, 2, reply);
+            memcpy(reply, req, 6);
+            return 6;
+
+        case ModBus_WriteRegisters:
+            n = (req[4] << 8) | req[5];
+            if(len != 7 + n * 2 || req[6] != n * 2)
+                return exception(model, req, 3, reply);
+            for(idx = 0; idx < n; idx++) {
+                if(!model_write(model, req[1], reg + idx, (req[7 + idx * 2] << 8) | req[8 + idx * 2]))
+                    return exception(model, req, 2, reply);
+            }
+            memcpy(reply, req, 6);
+            return 6;
+
+        default:
+            return exception(model, req, 1, reply);
+    }
+}
+
+// The Huanyang v1 protocol has its own function codes and a length byte in place of the register address.
+static uint_fast8_t huanyang_request (rs485_slave_t *slave, const uint8_t *req, uint_fast8_t len, uint8_t *reply)
+{
+    slave_model_t *model = (slave_model_t *)slave->model;
+    uint16_t value = 0;
+
+    memcpy(reply, req, len);
+
+    switch(req[1]) {
+
+        case 0x01: // function (PDxxx) read: 03 PD 00 00
+            if(len != 6)
+                return 0;
+            switch(req[3]) {
+                case 0x90: value = 3000; break; // PD144, RPM at 50 Hz
+                case 0x05: value = to_units(model, SLAVE_RPM_MAX); break; // PD005, max frequency
+                case 0x0B: value = to_units(model, SLAVE_RPM_MIN); break; // PD011, min frequency
+                case 0x8E: value = 70; break;   // PD142, rated current, A * 10
+            }
+            model->reads++;
+            reply[4] = value >> 8;
+            reply[5] = value & 0xFF;
+            return 6;
+
+        case 0x03: // control: 01 cmd
+            if(len != 4)
+                return 0;
+            if(req[3] == 0x08)
+                set_state(model, false, model->ccw);
+            else if(req[3] == 0x01 || req[3] == 0x11)
+                set_state(model, true, req[3] == 0x11);
+            return 4;
+
+        case 0x04: // status read: 03 idx 00 00
+            if(len != 6)
+                return 0;
+            model->reads++;
+            model_update(model);
+            if(req[3] == 0x01)
+                value = to_units(model, model->rpm);
+            else if(req[3] == 0x02)
+                value = (uint16_t)(10.0f + model->rpm / SLAVE_RPM_MAX * 50.0f);
+            reply[4] = value >> 8;
+            reply[5] = value & 0xFF;
+            return 6;
+
+        case 0x05: // frequency write: 02 hi lo, echoed
+            if(len != 5)
+                return 0;
+            set_setpoint(model, (req[3] << 8) | req[4]);
+            return 5;
+
+        default:
+            return 0;
+    }
+}
+
+void slave_model_init (slave_model_t *model, slave_type_t type, uint8_t address)
+{
+    memset(model, 0, sizeof(slave_model_t));
+
+    model->type = type;
+    model->ramp = 24000.0f; // RPM/s, 0 - 24000 RPM in 1 s
+    model->updated_ns = sim_ns();
+    model->slave.address = address;
+    model->slave.latency_us = 1000;
+    model->slave.request = type == Slave_HuanyangV1 ? huanyang_request : modbus_request;
+    model->slave.model = model;
+}
+
+float slave_model_rpm (slave_model_t *model)
+{
+    model_update(model);
+
+    return model->rpm;
+}
+
+const char *slave_model_spindle (slave_type_t type)
+{
+    return models[type].spindle;
+}
+
+bool slave_model_find (const char *name, slave_type_t *type)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < Slave_Models; idx++) {
+        if(!strcmp(models[idx].name, name)) {
+            *type = (slave_type_t)idx;
+            return true;
+        }
+    }
+
+    return false;
+}
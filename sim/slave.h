@@ -0,0 +1,61 @@
+/*
+
+  slave.h - scripted VFD slave models for the host simulation
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "rs485.h"
+
+#define SLAVE_RPM_MAX   24000.0f    // at 400 Hz
+#define SLAVE_RPM_MIN   1200.0f     // at 20 Hz
+
+typedef enum {
+    Slave_HuanyangV1 = 0,
+    Slave_HuanyangP2A,
+    Slave_GS20,
+    Slave_YL620A,
+    Slave_H100,
+    Slave_Nowforever,
+    Slave_MODVFD,
+    Slave_Registers,                // plain holding registers 0x0000 - 0x000F, for bus benchmarks
+    Slave_Models
+} slave_type_t;
+
+typedef struct {
+    slave_type_t type;
+    rs485_slave_t slave;
+    bool running;
+    bool ccw;
+    float rpm_target;               // setpoint converted to RPM
+    float rpm;                      // output, ramps towards the target while running and to 0 when stopped
+    float ramp;                     // RPM per second
+    uint64_t updated_ns;
+    uint32_t commands;              // run/stop commands received
+    uint32_t setpoints;             // frequency setpoints received
+    uint64_t setpoint_ns;           // time the last setpoint was received
+    uint32_t reads;
+    uint32_t exceptions;            // exception responses sent
+    uint16_t regs[16];              // for Slave_Registers
+} slave_model_t;
+
+void slave_model_init (slave_model_t *model, slave_type_t type, uint8_t address);
+float slave_model_rpm (slave_model_t *model);
+const char *slave_model_spindle (slave_type_t type);
+bool slave_model_find (const char *name, slave_type_t *type);
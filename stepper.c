@@ -36,13 +36,28 @@
 #include "grbl/protocol.h"
 #include "grbl/state_machine.h"
 
+#ifndef STEPPER_SPINDLE_TIMER
+#define STEPPER_SPINDLE_TIMER 1         // use a driver provided hardware timer for step generation if available
+#endif
+#ifndef STEPPER_SPINDLE_TICK_MIN
+#define STEPPER_SPINDLE_TICK_MIN 10     // shortest step generator tick in microseconds, limits the interrupt load
+#endif
+#define STEPPER_SPINDLE_TICK_MAX 1000   // longest step generator tick in microseconds
+
 static spindle_id_t spindle_id = -1;
 static const uint8_t axis_idx = N_AXIS - 1, axis_mask = 1 << (N_AXIS - 1);
 static int64_t offset = 0;
 static bool stopping = false, running = false;
+static volatile bool reversing = false;
+static float reverse_rpm, rev_per_step = 1.0f;
 static st2_motor_t *motor;
 static spindle_data_t spindle_data = {0};
 static axes_signals_t steppers_enabled = {0};
+#if STEPPER_SPINDLE_TIMER
+static hal_timer_t timer = NULL;
+static volatile bool timer_hold = false, timer_running = false;
+static uint32_t timer_tick = STEPPER_SPINDLE_TICK_MIN;
+#endif
 
 static on_execute_realtime_ptr on_execute_realtime = NULL, on_execute_delay;
 static stepper_enable_ptr stepper_enable;
@@ -60,14 +75,87 @@ static void stepperEnable (axes_signals_t enable, bool hold)
     stepper_enable(enable, hold);
 }
 
-static void onSpindleStopped (void *data)
+#if STEPPER_SPINDLE_TIMER
+
+// Steps are generated from the timer interrupt, st2_motor_run() outputs a step when due and updates the speed ramp.
+// stepper2 does not expose the time to the next step so the timer is periodic: at most one step is output per tick
+// and steps are delayed by up to a tick. The tick is half the step interval at the axis max rate, clamped
+// to STEPPER_SPINDLE_TICK_MIN - STEPPER_SPINDLE_TICK_MAX, so the interrupt rate is twice the max step rate while the spindle is on.
+static void onTimerTick (void *context)
+{
+    if(!timer_hold)
+        st2_motor_run(motor);
+}
+
+static void timer_set_tick (void)
+{
+    float step_rate = settings.axis[axis_idx].max_rate * settings.axis[axis_idx].steps_per_mm / 60.0f; // steps/s
+
+    timer_tick = step_rate > 0.0f ? (uint32_t)(500000.0f / step_rate) : STEPPER_SPINDLE_TICK_MAX;
+    timer_tick = min(max(timer_tick, STEPPER_SPINDLE_TICK_MIN), STEPPER_SPINDLE_TICK_MAX);
+}
+
+static void timer_start (void)
+{
+    if(timer && !timer_running)
+        timer_running = hal.timer.start(timer, timer_tick);
+}
+
+static void timer_stop (void)
+{
+    if(timer && timer_running && !st2_motor_running(motor)) {
+        hal.timer.stop(timer);
+        timer_running = false;
+    }
+}
+
+// Keeps the timer interrupt from running the motor while the foreground is changing the motion parameters.
+static inline void motor_lock (bool lock)
 {
+    timer_hold = lock;
+}
+
+#else
+#define timer_start()
+#define motor_lock(lock)
+#endif
+
+static void spindleStopped (void *data)
+{
+    // Direction change: the motor has decelerated to zero, accelerate in the new direction.
+    if(reversing) {
+        reversing = false;
+        if(!stopping) {
+            motor_lock(true);
+            st2_motor_move(motor, spindle_data.state_programmed.ccw ? -1.0f : 1.0f, reverse_rpm, Stepper2_InfiniteSteps);
+            motor_lock(false);
+            timer_start();
+            return;
+        }
+    }
+
     if(stopping) {
         stopping = running = false;
         hal.stepper.enable(steppers_enabled, hold);
         if(hal.stepper.claim_motor)
             hal.stepper.claim_motor(axis_idx, false);
     }
+#if STEPPER_SPINDLE_TIMER
+    timer_stop();
+#endif
+}
+
+static void onSpindleStopped (void *data)
+{
+#if STEPPER_SPINDLE_TIMER
+    // Called from the timer interrupt, defer to the foreground.
+    if(timer) {
+        protocol_enqueue_foreground_task(spindleStopped, data);
+        return;
+    }
+#endif
+
+    spindleStopped(data);
 }
 
 static void onExecuteRealtime (uint_fast16_t state)
@@ -88,8 +176,17 @@ static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_UpdateRPM, spindle->id, 0, rpm);
+
     spindle_data.rpm = rpm;
-    st2_motor_set_speed(motor, rpm);
+
+    if(reversing)
+        reverse_rpm = rpm;
+    else {
+        motor_lock(true);
+        st2_motor_set_speed(motor, rpm);
+        motor_lock(false);
+    }
 }
 
 // Start or stop spindle
@@ -97,6 +194,8 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_SetState, spindle->id, state.value, rpm);
+
     if(state.on) {
 
         running = true;
@@ -104,21 +203,26 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
         hal.stepper.enable(steppers_enabled);
         if(hal.stepper.claim_motor)
             hal.stepper.claim_motor(axis_idx, true);
-        if(st2_motor_running(motor)) {
+        motor_lock(true);
+        if(reversing)
+            reverse_rpm = rpm; // a pending reversal picks up the latest direction and speed
+        else if(st2_motor_running(motor)) {
             if(state.ccw != spindle_data.state_programmed.ccw) {
+                // Decelerate to zero, the stopped callback then starts the motor in the new direction.
+                reverse_rpm = rpm;
+                reversing = true;
                 st2_motor_stop(motor);
-                while(st2_motor_running(motor)) {
-                	if(on_execute_realtime)
-                		onExecuteRealtime(state_get());
-                	// else run main loop?
-                }
-                st2_motor_move(motor, state.ccw ? -1.0f : 1.0f, rpm, Stepper2_InfiniteSteps);
             } else
                 st2_motor_set_speed(motor, rpm);
         } else
             st2_motor_move(motor, state.ccw ? -1.0f : 1.0f, rpm, Stepper2_InfiniteSteps);
-    } else
-        stopping = st2_motor_stop(motor);
+        motor_lock(false);
+        timer_start();
+    } else {
+        motor_lock(true);
+        stopping = st2_motor_stop(motor) || reversing;
+        motor_lock(false);
+    }
 
     spindle_set_at_speed_range(spindle, &spindle_data, rpm);
 
@@ -131,6 +235,8 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
     if(spindle == NULL)
         return false;
 
+    rev_per_step = 1.0f / settings.axis[axis_idx].steps_per_mm;
+
     return st2_motor_bind_spindle(axis_idx);
 }
 
@@ -141,7 +247,7 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
     switch(request) {
 
         case SpindleData_Counters:
-            spindle_data.index_count = (uint32_t)floorf((float)position / settings.axis[axis_idx].steps_per_mm);
+            spindle_data.index_count = (uint32_t)floorf((float)position * rev_per_step);
             spindle_data.pulse_count = position;
             break;
 
@@ -150,7 +256,7 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
             break;
 
         case SpindleData_AngularPosition:
-            spindle_data.angular_position = (float)position / settings.axis[axis_idx].steps_per_mm;
+            spindle_data.angular_position = (float)position * rev_per_step;
             break;
 
         case SpindleData_AtSpeed:
@@ -167,6 +273,27 @@ static void spindleDataReset (void)
     offset = st2_get_position(motor);
 }
 
+// Returns position, speed and time sampled together, the sample is retaken if a step was output while sampling.
+bool stepper_spindle_get_sample (stepper_spindle_sample_t *sample)
+{
+    if(motor == NULL)
+        return false;
+
+    uint_fast8_t retries = 3;
+    int64_t position;
+
+    do {
+        position = st2_get_position(motor);
+        sample->rpm = st2_get_speed(motor);
+        sample->timestamp = hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+    } while(position != st2_get_position(motor) && --retries);
+
+    sample->position = position - offset;
+    sample->angular_position = (float)sample->position * rev_per_step;
+
+    return true;
+}
+
 // Returns spindle state in a spindle_state_t variable
 static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 {
@@ -185,6 +312,12 @@ static void settingsChanged (settings_t *settings, settings_changed_flags_t chan
 {
     settings_changed(settings, changed);
 
+    rev_per_step = 1.0f / settings->axis[axis_idx].steps_per_mm;
+
+#if STEPPER_SPINDLE_TIMER
+    timer_set_tick(); // used from the next spindle start
+#endif
+
     if(changed.spindle) {
 
         spindle_ptrs_t *spindle = spindle_get_hal(spindle_id, SpindleHAL_Configured);
@@ -207,7 +340,9 @@ static void raise_alarm (sys_state_t state)
 
 static void esp32_spindle_off (spindle_ptrs_t *spindle)
 {
+    motor_lock(true);
     stopping = st2_motor_stop(motor);
+    motor_lock(false);
 }
 
 #endif
@@ -239,11 +374,31 @@ void stepper_spindle_init (void)
 
         if(st2_motor_poll(motor)) {
 
+#if STEPPER_SPINDLE_TIMER
+            if(hal.timer.claim && (timer = hal.timer.claim((timer_cap_t){ .periodic = On }, 1000))) {
+
+                timer_cfg_t cfg = {
+                    .single_shot = false,
+                    .timeout_callback = onTimerTick
+                };
+
+                if(hal.timer.configure(timer, &cfg))
+                    timer_set_tick();
+                else
+                    timer = NULL;
+            }
+
+            // Fall back to running the motor from the foreground loop if no timer is available.
+            if(timer == NULL) {
+#endif
             on_execute_realtime = grbl.on_execute_realtime;
             grbl.on_execute_realtime = onExecuteRealtime;
 
             on_execute_delay = grbl.on_execute_delay;
             grbl.on_execute_delay = onExecuteDelay;
+#if STEPPER_SPINDLE_TIMER
+            }
+#endif
         }
 
         st2_motor_register_stopped_callback(motor, onSpindleStopped);
@@ -254,6 +409,8 @@ void stepper_spindle_init (void)
         settings_changed = hal.settings_changed;
         hal.settings_changed = settingsChanged;
 
+        spindle_trace_init();
+
     } else
         protocol_enqueue_foreground_task(report_warning, "Stepper spindle has been disabled!");
 }
@@ -0,0 +1,144 @@
+/*
+
+  trace.c - binary event trace ring for the spindle and ModBus plugins
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "trace.h"
+
+#if SPINDLE_TRACE
+
+#ifdef ARDUINO
+#include "../grbl/hal.h"
+#else
+#include "grbl/hal.h"
+#endif
+
+#if SPINDLE_TRACE_SIZE & (SPINDLE_TRACE_SIZE - 1)
+#error SPINDLE_TRACE_SIZE must be a power of 2!
+#endif
+
+// Events are recorded from the foreground, the ModBus poller and interrupt contexts, each claims an entry by
+// incrementing head. The newest SPINDLE_TRACE_SIZE events are kept, recording is paused while the ring is dumped.
+static volatile uint32_t head = 0;
+static volatile bool paused = false;
+static spindle_trace_entry_t ring[SPINDLE_TRACE_SIZE];
+static on_spindle_selected_ptr on_spindle_selected;
+
+static const char *const event_name[SpindleTrace_Events] = {
+    "MBTX",
+    "MBRX",
+    "MBTIMEOUT",
+    "MBEXCEPTION",
+    "MBCRC",
+    "STATE",
+    "RPM",
+    "SELECT",
+    "VFDFAIL"
+};
+
+void spindle_trace (spindle_trace_event_t event, uint8_t id, uint16_t data, float value)
+{
+    if(paused)
+        return;
+
+#ifdef __GNUC__
+    spindle_trace_entry_t *entry = &ring[__atomic_fetch_add(&head, 1, __ATOMIC_RELAXED) & (SPINDLE_TRACE_SIZE - 1)];
+#else
+    spindle_trace_entry_t *entry = &ring[head++ & (SPINDLE_TRACE_SIZE - 1)];
+#endif
+
+    entry->timestamp = hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+    entry->event = (uint8_t)event;
+    entry->id = id;
+    entry->data = data;
+    entry->value = value;
+}
+
+static void onSpindleSelected (spindle_ptrs_t *spindle)
+{
+    spindle_trace(SpindleTrace_Selected, (uint8_t)spindle->id, spindle->type, 0.0f);
+
+    if(on_spindle_selected)
+        on_spindle_selected(spindle);
+}
+
+// [TRACE:<timestamp>|<event>|<id>|<data>|<value>], oldest first.
+static status_code_t spindle_trace_dump (sys_state_t state, char *args)
+{
+    uint32_t idx, end;
+    spindle_trace_entry_t *entry;
+
+    if(args && !(*args == 'R' && *(args + 1) == '\0'))
+        return Status_InvalidStatement;
+
+    paused = true;
+
+    if(args)
+        head = 0;
+    else {
+        end = head;
+        idx = end > SPINDLE_TRACE_SIZE ? end - SPINDLE_TRACE_SIZE : 0;
+
+        for(; idx != end; idx++) {
+            entry = &ring[idx & (SPINDLE_TRACE_SIZE - 1)];
+            hal.stream.write("[TRACE:");
+            hal.stream.write(uitoa(entry->timestamp));
+            hal.stream.write("|");
+            hal.stream.write(entry->event < SpindleTrace_Events ? event_name[entry->event] : "?");
+            hal.stream.write("|");
+            hal.stream.write(uitoa(entry->id));
+            hal.stream.write("|");
+            hal.stream.write(uitoa(entry->data));
+            hal.stream.write("|");
+            hal.stream.write(ftoa(entry->value, 1));
+            hal.stream.write("]" ASCII_EOL);
+        }
+    }
+
+    paused = false;
+
+    return Status_OK;
+}
+
+static const sys_command_t trace_command_list[] = {
+    { "SPINDLETRACE", spindle_trace_dump, { .allow_blocking = On }, { .str = "dump spindle and ModBus event trace, R to clear" } }
+};
+
+static sys_commands_t trace_commands = {
+    .n_commands = sizeof(trace_command_list) / sizeof(sys_command_t),
+    .commands = trace_command_list
+};
+
+// Called from the init functions of the plugins that record events, only the first call has any effect.
+void spindle_trace_init (void)
+{
+    static bool init_ok = false;
+
+    if(!init_ok) {
+
+        init_ok = true;
+
+        on_spindle_selected = grbl.on_spindle_selected;
+        grbl.on_spindle_selected = onSpindleSelected;
+
+        system_register_commands(&trace_commands);
+    }
+}
+
+#endif
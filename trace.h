@@ -0,0 +1,68 @@
+/*
+
+  trace.h - binary event trace ring for the spindle and ModBus plugins
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#ifdef ARDUINO
+#include "../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#ifndef SPINDLE_TRACE
+#define SPINDLE_TRACE 0             // set to 1 to record spindle and ModBus events, adds the $SPINDLETRACE command
+#endif
+#ifndef SPINDLE_TRACE_SIZE
+#define SPINDLE_TRACE_SIZE 128      // number of events kept, must be a power of 2, 12 bytes per event
+#endif
+
+typedef enum {
+    SpindleTrace_ModBusTX = 0,      // id: slave address, data: function code
+    SpindleTrace_ModBusRX,          // id: slave address, data: function code, value: latency in µs
+    SpindleTrace_ModBusTimeout,     // id: slave address, data: function code
+    SpindleTrace_ModBusException,   // id: slave address, data: function code
+    SpindleTrace_ModBusCRCError,    // id: slave address, data: function code, also for short frames
+    SpindleTrace_SetState,          // id: spindle id, data: spindle state, value: RPM
+    SpindleTrace_UpdateRPM,         // id: spindle id, value: RPM
+    SpindleTrace_Selected,          // id: spindle id, data: spindle type
+    SpindleTrace_VFDFailed,         // data: 1 if the spindle is disabled
+    SpindleTrace_Events
+} spindle_trace_event_t;
+
+typedef struct {
+    uint32_t timestamp;             // µs, derived from the ms tick if hal.get_micros is not available
+    uint8_t event;                  // spindle_trace_event_t
+    uint8_t id;
+    uint16_t data;
+    float value;
+} spindle_trace_entry_t;
+
+#if SPINDLE_TRACE
+
+void spindle_trace_init (void);
+void spindle_trace (spindle_trace_event_t event, uint8_t id, uint16_t data, float value);
+
+#else
+
+#define spindle_trace_init()
+#define spindle_trace(event, id, data, value)
+
+#endif
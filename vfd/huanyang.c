@@ -32,6 +32,9 @@
 
 static uint32_t modbus_address;
 static float amps = 0.0f, amps_max = 0.0f, rpm_at_50Hz = 0.0f;
+static vfd_scale_t rpm_to_freq = 0, freq_to_rpm = 0;
+static uint16_t freq_min = 0, freq_max = 0;
+static bool freq_min_read = false, freq_max_read = false;
 static spindle_id_t spindle_id = -1;
 static spindle_ptrs_t *spindle_hal = NULL;
 static spindle_state_t vfd_state = {0};
@@ -60,12 +63,36 @@ static const modbus_callbacks_t callbacks = {
     .on_rx_exception = rx_exception
 };
 
+// Frequency is in Hz * 100, 5000 at the configured RPM at 50Hz
+// The limits are converted here as the replies may arrive in any order, only limits read from the VFD or the cache are applied.
+static void set_scaling (void)
+{
+    rpm_to_freq = vfd_scale(5000.0f, rpm_at_50Hz);
+    freq_to_rpm = vfd_scale(rpm_at_50Hz, 5000.0f);
+
+    if(spindle_hal) {
+        if(freq_min_read)
+            spindle_hal->rpm_min = (float)vfd_scaled(freq_min, freq_to_rpm);
+        if(freq_max_read && freq_max) {
+            spindle_hal->cap.rpm_range_locked = On;
+            spindle_hal->rpm_max = (float)vfd_scaled(freq_max, freq_to_rpm);
+        }
+    }
+}
+
+static void read_parameter (modbus_message_t *cmd, bool cached)
+{
+    if(!vfd_discovery_read(SPINDLE_HUANYANG1, cmd, &callbacks, cached))
+        vfd_modbus_send(cmd, &callbacks, true);
+}
+
 // Read maximum configured RPM from spindle, value is used later for calculating current RPM
 // In the case of the original Huanyang protocol, the value is the configured RPM at 50Hz
-static void spindleGetRPMLimits (void)
+static void spindleGetRPMLimits (bool cached)
 {
     modbus_message_t cmd = {
         .context = (void *)VFD_GetRPMAt50Hz,
+        .crc_check = true, // the replies are cached
         .adu[0] = modbus_address,
         .adu[1] = ModBus_ReadCoils,
         .adu[2] = 0x03,
@@ -76,29 +103,27 @@ static void spindleGetRPMLimits (void)
         .rx_length = 8
     };
 
-    rpm_at_50Hz = 0.0f;
+    rpm_at_50Hz = 3000.0f; // until read
+    freq_min_read = freq_max_read = false; // the configured limits are kept if the VFD does not reply
+    set_scaling();
 
-    if(modbus_send(&cmd, &callbacks, true)) {
+    read_parameter(&cmd, cached);
 
-        cmd.context = (void *)VFD_GetMinRPM;
-        cmd.adu[3] = 0x0B; // PD011
+    cmd.context = (void *)VFD_GetMinRPM;
+    cmd.adu[3] = 0x0B; // PD011
+    read_parameter(&cmd, cached);
 
-        if(modbus_send(&cmd, &callbacks, true)) {
-            cmd.context = (void *)VFD_GetMaxRPM;
-            cmd.adu[3] = 0x05; // PD005
-            modbus_send(&cmd, &callbacks, true);
-        }
-    }
-
-    if(rpm_at_50Hz == 0.0f)
-        rpm_at_50Hz = 3000.0f;
+    cmd.context = (void *)VFD_GetMaxRPM;
+    cmd.adu[3] = 0x05; // PD005
+    read_parameter(&cmd, cached);
 }
 
 // Read maximum configured current from spindle, value is used later for calculating spindle load
-static void spindleGetMaxAmps (void)
+static void spindleGetMaxAmps (bool cached)
 {
     modbus_message_t cmd = {
         .context = (void *)VFD_GetMaxAmps,
+        .crc_check = true, // the reply is cached
         .adu[0] = modbus_address,
         .adu[1] = ModBus_ReadCoils,
         .adu[2] = 0x03,
@@ -110,28 +135,29 @@ static void spindleGetMaxAmps (void)
     };
 
     modbus_set_silence(&silence);
-    modbus_send(&cmd, &callbacks, true);
+    read_parameter(&cmd, cached);
 }
 
 static void spindleSetRPM (float rpm, bool block)
 {
     if(rpm != spindle_data.rpm_programmed) {
 
-        uint32_t data = lroundf(rpm * 5000.0f / (float)rpm_at_50Hz); // send Hz * 10  (Ex:1500 RPM = 25Hz .... Send 2500)
+        uint32_t data = vfd_scaled((uint32_t)(rpm + 0.5f), rpm_to_freq); // send Hz * 10  (Ex:1500 RPM = 25Hz .... Send 2500)
+
+        modbus_message_t rpm_cmd, *cmd;
 
-        modbus_message_t rpm_cmd = {
-            .context = (void *)VFD_SetRPM,
-            .crc_check = false,
-            .adu[0] = modbus_address,
-            .adu[1] = ModBus_WriteCoil,
-            .adu[2] = 0x02,
-            .adu[3] = data >> 8,
-            .adu[4] = data & 0xFF,
-            .tx_length = 7,
-            .rx_length = 6
-        };
+        if((cmd = vfd_modbus_reserve(&rpm_cmd, modbus_address, block))) {
+            cmd->context = (void *)VFD_SetRPM;
+            cmd->adu[0] = modbus_address;
+            cmd->adu[1] = ModBus_WriteCoil;
+            cmd->adu[2] = 0x02;
+            cmd->adu[3] = data >> 8;
+            cmd->adu[4] = data & 0xFF;
+            cmd->tx_length = 7;
+            cmd->rx_length = 6;
 
-        modbus_send(&rpm_cmd, &callbacks, block);
+            vfd_modbus_send(cmd, &callbacks, block);
+        }
 
         spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
     }
@@ -141,14 +167,20 @@ static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_UpdateRPM, spindle->id, 0, rpm);
+
     spindleSetRPM(rpm, false);
 }
 
 // Start or stop spindle
 static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
+    static vfd_transaction_t transaction = {0};
+
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_SetState, spindle->id, state.value, rpm);
+
     modbus_message_t mode_cmd = {
         .context = (void *)VFD_SetStatus,
         .crc_check = false,
@@ -166,37 +198,49 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     vfd_state.on = spindle_data.state_programmed.on = state.on;
     vfd_state.ccw = spindle_data.state_programmed.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
+    if(vfd_state_async(state, &spindle_data) && vfd_transaction_send(&transaction, &mode_cmd, &callbacks))
+        spindleSetRPM(rpm, false);
+    else if(vfd_modbus_send(&mode_cmd, &callbacks, true))
         spindleSetRPM(rpm, true);
 }
 
 // Returns spindle state in a spindle_state_t variable
 static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 {
-    modbus_message_t rpm_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadInputRegisters,
-        .adu[2] = 0x03,
-        .adu[3] = 0x01,
-        .tx_length = 8,
-        .rx_length = 8
-    };
+    static bool poll_amps = false;
+    static vfd_poll_t poll = {0};
 
-    modbus_send(&rpm_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    modbus_message_t state_cmd, *cmd;
 
-    modbus_message_t amps_cmd = {
-        .context = (void *)VFD_GetAmps,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadInputRegisters,
-        .adu[2] = 0x03,
-        .adu[3] = 0x02,     // Output amps * 10
-        .tx_length = 8,
-        .rx_length = 8
-    };
-    modbus_send(&amps_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    if(vfd_poll_due(&poll, modbus_address, vfd_state, &spindle_data, poll_amps ? 1 : 2)) {
+
+        // The Huanyang protocol returns a single value per request, read output current on every other poll only
+        poll_amps = !poll_amps;
+
+        if((cmd = vfd_modbus_reserve(&state_cmd, modbus_address, false))) {
+            cmd->context = (void *)VFD_GetRPM;
+            cmd->adu[0] = modbus_address;
+            cmd->adu[1] = ModBus_ReadInputRegisters;
+            cmd->adu[2] = 0x03;
+            cmd->adu[3] = 0x01;
+            cmd->tx_length = 8;
+            cmd->rx_length = 8;
+
+            vfd_modbus_send(cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+        }
+
+        if(poll_amps && (cmd = vfd_modbus_reserve(&state_cmd, modbus_address, false))) {
+            cmd->context = (void *)VFD_GetAmps;
+            cmd->adu[0] = modbus_address;
+            cmd->adu[1] = ModBus_ReadInputRegisters;
+            cmd->adu[2] = 0x03;
+            cmd->adu[3] = 0x02;     // Output amps * 10
+            cmd->tx_length = 8;
+            cmd->rx_length = 8;
+
+            vfd_modbus_send(cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+        }
+    }
 
     vfd_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
@@ -207,35 +251,41 @@ static void rx_packet (modbus_message_t *msg)
 {
     if(!(msg->adu[0] & 0x80)) {
 
+        vfd_slave_ok(msg->adu[0]);
+
         switch((vfd_response_t)msg->context) {
 
             case VFD_GetRPM:
-                spindle_validate_at_speed(spindle_data, (float)((msg->adu[4] << 8) | msg->adu[5]) * rpm_at_50Hz / 5000.0f);
+                spindle_validate_at_speed(spindle_data, (float)vfd_scaled((msg->adu[4] << 8) | msg->adu[5], freq_to_rpm));
                 break;
 
             case VFD_GetMinRPM:
-                if(rpm_at_50Hz != 0.0f)
-                    spindle_hal->rpm_min = (float)((msg->adu[4] << 8) | msg->adu[5]) * rpm_at_50Hz / 5000.0f;
+                freq_min = (msg->adu[4] << 8) | msg->adu[5];
+                freq_min_read = true;
+                set_scaling();
                 break;
 
             case VFD_GetMaxRPM:
-                if(rpm_at_50Hz != 0.0f) {
-                    spindle_hal->cap.rpm_range_locked = On;
-                    spindle_hal->rpm_max = (float)((msg->adu[4] << 8) | msg->adu[5]) * rpm_at_50Hz / 5000.0f;
-                }
+                freq_max = (msg->adu[4] << 8) | msg->adu[5];
+                freq_max_read = true;
+                set_scaling();
                 break;
 
             case VFD_GetRPMAt50Hz:
-                if(spindle_hal)
+                if(spindle_hal) {
                     rpm_at_50Hz = (float)((msg->adu[4] << 8) | msg->adu[5]);
+                    set_scaling();
+                }
                 break;
 
             case VFD_GetMaxAmps:
                 amps_max = (float)((msg->adu[4] << 8) | msg->adu[5]) / 10.0f;
+                vfd_load_changed();
                 break;
 
             case VFD_GetAmps:
                 amps = (float)((msg->adu[4] << 8) | msg->adu[5]) / 10.0f;
+                vfd_load_changed();
                 break;
 
             default:
@@ -259,11 +309,28 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
     return &spindle_data;
 }
 
+static void retry_rpm (void *data)
+{
+    float rpm = spindle_data.rpm_programmed;
+
+    spindle_data.rpm_programmed = -1.0f; // force resend
+    spindleSetRPM(max(rpm, 0.0f), false);
+}
+
 static void rx_exception (uint8_t code, void *context)
 {
+    uint32_t delay;
+
     // Alarm needs to be raised directly to correctly handle an error during reset (the rt command queue is
     // emptied on a warm reset). Exception is during cold start, where alarms need to be queued.
-    vfd_failed(false);
+    // A setpoint dropped unsent while the VFD backs off is resent after the backoff, the timeout is already counted as a failure.
+    if(vfd_slave_dropped(code, modbus_address, &delay)) {
+        if((vfd_response_t)context == VFD_SetRPM)
+            task_add_delayed(retry_rpm, NULL, delay);
+    } else if(vfd_slave_failed(modbus_address, &delay))
+        vfd_failed(false);
+    else if((vfd_response_t)context == VFD_SetRPM)
+        task_add_delayed(retry_rpm, NULL, delay);
 }
 
 static void onReportOptions (bool newopt)
@@ -280,8 +347,8 @@ static void onDriverReset (void)
 
     if(spindle_hal) {
 
-        spindleGetRPMLimits();
-        spindleGetMaxAmps();
+        spindleGetRPMLimits(true);
+        spindleGetMaxAmps(true);
     }
 }
 
@@ -297,8 +364,8 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
         modbus_set_silence(&silence);
         modbus_address = vfd_get_modbus_address(spindle_id);
 
-        spindleGetRPMLimits();
-        spindleGetMaxAmps();
+        spindleGetRPMLimits(false);
+        spindleGetMaxAmps(false);
 
     } else
         spindle_hal = NULL;
@@ -31,6 +31,7 @@
 #include "spindle.h"
 
 static uint32_t modbus_address, rpm_max = 0;
+static vfd_scale_t rpm_to_data = 0; // setpoint is in 0.01% of max RPM
 static spindle_id_t spindle_id = -1;
 static spindle_ptrs_t *spindle_hal = NULL;
 static spindle_state_t vfd_state = {0};
@@ -50,7 +51,7 @@ static const modbus_callbacks_t callbacks = {
 
 // Read maximum configured RPM from spindle, value is used later for calculating current RPM
 // In the case of the original Huanyang protocol, the value is the configured RPM at 50Hz
-static void spindleGetMaxRPM (void)
+static void spindleGetMaxRPM (bool cached)
 {
     modbus_message_t cmd = {
         .context = (void *)VFD_GetMaxRPM,
@@ -65,28 +66,31 @@ static void spindleGetMaxRPM (void)
     };
 
     modbus_set_silence(NULL);
-    modbus_send(&cmd, &callbacks, true);
+
+    if(!vfd_discovery_read(SPINDLE_HUANYANG2, &cmd, &callbacks, cached))
+        vfd_modbus_send(&cmd, &callbacks, true);
 }
 
 static void spindleSetRPM (float rpm, bool block)
 {
     if (rpm != spindle_data.rpm_programmed) {
 
-        uint16_t data = (uint32_t)(rpm) * 10000UL / rpm_max;
+        uint16_t data = (uint16_t)min(vfd_scaled((uint32_t)(rpm + 0.5f), rpm_to_data), 0xFFFFUL);
+
+        modbus_message_t rpm_cmd, *cmd;
 
-        modbus_message_t rpm_cmd = {
-            .context = (void *)VFD_SetRPM,
-            .crc_check = false,
-            .adu[0] = modbus_address,
-            .adu[1] = ModBus_WriteRegister,
-            .adu[2] = 0x10,
-            .adu[4] = data >> 8,
-            .adu[5] = data & 0xFF,
-            .tx_length = 8,
-            .rx_length = 8
-        };
+        if((cmd = vfd_modbus_reserve(&rpm_cmd, modbus_address, block))) {
+            cmd->context = (void *)VFD_SetRPM;
+            cmd->adu[0] = modbus_address;
+            cmd->adu[1] = ModBus_WriteRegister;
+            cmd->adu[2] = 0x10;
+            cmd->adu[4] = data >> 8;
+            cmd->adu[5] = data & 0xFF;
+            cmd->tx_length = 8;
+            cmd->rx_length = 8;
 
-        modbus_send(&rpm_cmd, &callbacks, block);
+            vfd_modbus_send(cmd, &callbacks, block);
+        }
 
         spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
     }
@@ -96,14 +100,20 @@ static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_UpdateRPM, spindle->id, 0, rpm);
+
     spindleSetRPM(rpm, false);
 }
 
 // Start or stop spindle
 static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
+    static vfd_transaction_t transaction = {0};
+
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_SetState, spindle->id, state.value, rpm);
+
     modbus_message_t mode_cmd = {
         .context = (void *)VFD_SetStatus,
         .crc_check = false,
@@ -121,29 +131,34 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     vfd_state.on = spindle_data.state_programmed.on = state.on;
     vfd_state.ccw = spindle_data.state_programmed.ccw = state.ccw;
 
-    if(modbus_send(&mode_cmd, &callbacks, true))
+    if(vfd_state_async(state, &spindle_data) && vfd_transaction_send(&transaction, &mode_cmd, &callbacks))
+        spindleSetRPM(rpm, false);
+    else if(vfd_modbus_send(&mode_cmd, &callbacks, true))
         spindleSetRPM(rpm, true);
 }
 
 // Returns spindle state in a spindle_state_t variable
 static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 {
+    static vfd_poll_t poll = {0};
+
     UNUSED(spindle);
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadHoldingRegisters,
-        .adu[2] = 0x70,
-        .adu[3] = 0x0C,
-        .adu[4] = 0x00,
-        .adu[5] = 0x02,
-        .tx_length = 8,
-        .rx_length = 8
-    };
+    modbus_message_t state_cmd, *cmd;
+
+    if(vfd_poll_due(&poll, modbus_address, vfd_state, &spindle_data, 1) && (cmd = vfd_modbus_reserve(&state_cmd, modbus_address, false))) {
+        cmd->context = (void *)VFD_GetRPM;
+        cmd->adu[0] = modbus_address;
+        cmd->adu[1] = ModBus_ReadHoldingRegisters;
+        cmd->adu[2] = 0x70;
+        cmd->adu[3] = 0x0C;
+        cmd->adu[4] = 0x00;
+        cmd->adu[5] = 0x02;
+        cmd->tx_length = 8;
+        cmd->rx_length = 8;
 
-    modbus_send(&mode_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+        vfd_modbus_send(cmd, &callbacks, false); // TODO: add flag for not raising alarm?
+    }
 
     vfd_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
 
@@ -154,6 +169,8 @@ static void rx_packet (modbus_message_t *msg)
 {
     if(!(msg->adu[0] & 0x80)) {
 
+        vfd_slave_ok(msg->adu[0]);
+
         switch((vfd_response_t)msg->context) {
 
             case VFD_GetRPM:
@@ -162,6 +179,7 @@ static void rx_packet (modbus_message_t *msg)
 
             case VFD_GetMaxRPM:
                 rpm_max = (msg->adu[4] << 8) | msg->adu[5];
+                rpm_to_data = vfd_scale(10000.0f, (float)rpm_max);
                 //if(spindle_hal) {
                 //    spindle_hal->cap.rpm_range_locked = On;
                 //    spindle_hal->rpm_max = rpm_max50 = (float)((msg->adu[4] << 8) | msg->adu[5]);
@@ -184,11 +202,28 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
     return &spindle_data;
 }
 
+static void retry_rpm (void *data)
+{
+    float rpm = spindle_data.rpm_programmed;
+
+    spindle_data.rpm_programmed = -1.0f; // force resend
+    spindleSetRPM(max(rpm, 0.0f), false);
+}
+
 static void rx_exception (uint8_t code, void *context)
 {
+    uint32_t delay;
+
     // Alarm needs to be raised directly to correctly handle an error during reset (the rt command queue is
     // emptied on a warm reset). Exception is during cold start, where alarms need to be queued.
-    vfd_failed(false);
+    // A setpoint dropped unsent while the VFD backs off is resent after the backoff, the timeout is already counted as a failure.
+    if(vfd_slave_dropped(code, modbus_address, &delay)) {
+        if((vfd_response_t)context == VFD_SetRPM)
+            task_add_delayed(retry_rpm, NULL, delay);
+    } else if(vfd_slave_failed(modbus_address, &delay))
+        vfd_failed(false);
+    else if((vfd_response_t)context == VFD_SetRPM)
+        task_add_delayed(retry_rpm, NULL, delay);
 }
 
 static void onReportOptions (bool newopt)
@@ -204,7 +239,7 @@ static void onDriverReset (void)
     driver_reset();
 
     if(spindle_hal)
-        spindleGetMaxRPM();
+        spindleGetMaxRPM(true);
 }
 
 static void onSpindleSelected (spindle_ptrs_t *spindle)
@@ -216,7 +251,7 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
 
         modbus_address = vfd_get_modbus_address(spindle_id);
 
-        spindleGetMaxRPM();
+        spindleGetMaxRPM(false);
 
     } else
         spindle_hal = NULL;
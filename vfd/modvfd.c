@@ -33,8 +33,8 @@
 
 #include "spindle.h"
 
-static uint16_t retry_counter = 0;
 static uint32_t modbus_address;
+static vfd_scale_t rpm_to_freq = 0, freq_to_rpm = 0;
 static spindle_id_t spindle_id;
 static spindle_ptrs_t *spindle_hal;
 static spindle_state_t vfd_state = {0};
@@ -52,6 +52,12 @@ static const modbus_callbacks_t callbacks = {
     .on_rx_exception = rx_exception
 };
 
+static vfd_telemetry_t telemetry = {
+    .function = ModBus_ReadHoldingRegisters,
+    .reg = 0, // set from vfd_config.get_freq_reg
+    .n_regs = 1
+};
+
 // TODO: there should be a mechanism to read max RPM from the VFD in order to configure RPM/Hz instead of above define.
 
 
@@ -62,58 +68,62 @@ static bool spindleConfig (spindle_ptrs_t *spindle)
 
 static void spindleSetRPM (float rpm, bool block)
 {
-    static uint_fast8_t retries = 0;
+    static bool busy = false;
 
-    if(retries)
+    if(busy)
         return; // block reentry
 
-    bool ok;
-    uint16_t data = ((uint32_t)(rpm)) / vfd_config.in_divider * vfd_config.in_multiplier;
+    bool ok = true;
+    uint16_t data = (uint16_t)min(vfd_scaled((uint32_t)(rpm + 0.5f), rpm_to_freq), 0xFFFFUL);
 
-    modbus_message_t rpm_cmd = {
-        .context = (void *)VFD_SetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_WriteRegister,
-        .adu[2] = vfd_config.set_freq_reg >> 8,
-        .adu[3] = vfd_config.set_freq_reg & 0xFF,
-        .adu[4] = data >> 8,
-        .adu[5] = data & 0xFF,
-        .tx_length = 8,
-        .rx_length = 8
-    };
+    modbus_message_t rpm_cmd, *cmd;
 
-    do {
-        if(!(ok = modbus_send(&rpm_cmd, &callbacks, block)))
-            retries++;
-    } while(!ok && block && retries <= VFD_RETRIES);
+    if((cmd = vfd_modbus_reserve(&rpm_cmd, modbus_address, block))) {
+        cmd->context = (void *)VFD_SetRPM;
+        cmd->adu[0] = modbus_address;
+        cmd->adu[1] = ModBus_WriteRegister;
+        cmd->adu[2] = vfd_config.set_freq_reg >> 8;
+        cmd->adu[3] = vfd_config.set_freq_reg & 0xFF;
+        cmd->adu[4] = data >> 8;
+        cmd->adu[5] = data & 0xFF;
+        cmd->tx_length = 8;
+        cmd->rx_length = 8;
+
+        busy = block;
+        ok = vfd_modbus_send(cmd, &callbacks, block);
+    }
 
     if(!ok)
         vfd_failed(false);
 
     spindle_set_at_speed_range(spindle_hal, &spindle_data, rpm);
 
-    retries = 0;
+    busy = false;
 }
 
 static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
 {
     UNUSED(spindle);
 
+    spindle_trace(SpindleTrace_UpdateRPM, spindle->id, 0, rpm);
+
     spindleSetRPM(rpm, false);
 }
 
 // Start or stop spindle
 static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
 {
-    static uint_fast8_t retries = 0;
+    static bool busy = false;
+    static vfd_transaction_t transaction = {0};
 
     bool ok;
     uint16_t runstop;
 
     UNUSED(spindle);
 
-    if(retries)
+    spindle_trace(SpindleTrace_SetState, spindle->id, state.value, rpm);
+
+    if(busy)
         return; // block reentry
 
     if(!state.on || rpm == 0.0f)
@@ -140,17 +150,20 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     vfd_state.on = spindle_data.state_programmed.on = state.on;
     vfd_state.ccw = spindle_data.state_programmed.ccw = state.ccw;
 
-    do {
-        if(!(ok = modbus_send(&mode_cmd, &callbacks, true)))
-            retries++;
-    } while(!ok && retries <= VFD_RETRIES);
+    if(vfd_state_async(state, &spindle_data) && vfd_transaction_send(&transaction, &mode_cmd, &callbacks)) {
+        spindleSetRPM(rpm, false);
+        return;
+    }
+
+    busy = true;
+    ok = vfd_modbus_send(&mode_cmd, &callbacks, true);
 
     if(ok)
         spindleSetRPM(rpm, true);
     else
         vfd_failed(false);
 
-    retries = 0;
+    busy = false;
 }
 
 static spindle_data_t *spindleGetData (spindle_data_request_t request)
@@ -161,27 +174,13 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
 // Returns spindle state in a spindle_state_t variable
 static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 {
-    static uint32_t last_ms;
-    uint32_t ms = hal.get_elapsed_ticks();
+    static vfd_poll_t poll = {0};
 
     UNUSED(spindle);
 
-    modbus_message_t mode_cmd = {
-        .context = (void *)VFD_GetRPM,
-        .crc_check = false,
-        .adu[0] = modbus_address,
-        .adu[1] = ModBus_ReadHoldingRegisters,
-        .adu[2] = vfd_config.get_freq_reg >> 8,
-        .adu[3] = vfd_config.get_freq_reg & 0xFF,
-        .adu[4] = 0x00,
-        .adu[5] = 0x01,
-        .tx_length = 8,
-        .rx_length = 7
-    };
-
-    if(ms > (last_ms + VFD_RETRY_DELAY)){ //don't spam the port
-        modbus_send(&mode_cmd, &callbacks, false); // TODO: add flag for not raising alarm?
-        last_ms = ms;
+    if(vfd_poll_due(&poll, modbus_address, vfd_state, &spindle_data, 1)) {
+        telemetry.reg = vfd_config.get_freq_reg;
+        vfd_telemetry_request(&telemetry, modbus_address, &callbacks); // TODO: add flag for not raising alarm?
     }
 
     vfd_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
@@ -191,20 +190,22 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
 
 static float f2rpm (uint16_t f)
 {
-    return (float)f * (vfd_config.out_multiplier / vfd_config.out_divider);
+    return (float)vfd_scaled(f, freq_to_rpm);
 }
 
 static void rx_packet (modbus_message_t *msg)
 {
+    uint16_t value;
+
     if(!(msg->adu[0] & 0x80)) {
 
-        retry_counter = 0;
+        vfd_slave_ok(msg->adu[0]);
 
         switch((vfd_response_t)msg->context) {
 
             case VFD_GetRPM:
-                spindle_validate_at_speed(spindle_data, f2rpm((msg->adu[3] << 8) | msg->adu[4]));
-                retry_counter = 0;
+                if(vfd_telemetry_get(&telemetry, msg, 0, &value))
+                    spindle_validate_at_speed(spindle_data, f2rpm(value));
                 break;
 
 //            case VFD_GetMaxRPM:
@@ -218,42 +219,33 @@ static void rx_packet (modbus_message_t *msg)
     }
 }
 
+static void retry_rpm (void *data)
+{
+    spindleSetRPM(max(spindle_data.rpm_programmed, 0.0f), false);
+}
+
 static void rx_exception (uint8_t code, void *context)
 {
+    uint32_t delay;
+
     // Alarm needs to be raised directly to correctly handle an error during reset (the rt command queue is
     // emptied on a warm reset). Exception is during cold start, where alarms need to be queued.
-    if(sys.cold_start)
+    // A setpoint dropped unsent while the VFD backs off is resent after the backoff, the timeout is already counted as a failure.
+    if(vfd_slave_dropped(code, modbus_address, &delay)) {
+        if((vfd_response_t)context == VFD_SetRPM)
+            task_add_delayed(retry_rpm, NULL, delay);
+    } else if(sys.cold_start)
         vfd_failed(false);
-    else if ((vfd_response_t)context > 0) {
-
-        // when RX exceptions during one of the VFD messages, need to retry.
-
-        switch((vfd_response_t)context) {
-
-            case VFD_SetRPM:
-//              modbus_reset();
-                retry_counter++;
-                spindleSetRPM(max(spindle_data.rpm_programmed, 0.0f), false);
-                break;
-
-            case VFD_GetRPM:
-//              modbus_reset();
-//              spindleGetState(); no need to retry?
-                break;
-
-            default:
-                break;
-        }
+    else if((vfd_response_t)context > 0) {
 
-        if (retry_counter >= VFD_RETRIES) {
-            system_raise_alarm(Alarm_Spindle);
-            retry_counter = 0;
-        }
+        // when RX exceptions during one of the VFD messages, retry after the backoff delay until the circuit breaker opens.
 
-    } else {
-        retry_counter = 0;
+        if(vfd_slave_failed(modbus_address, &delay))
+            vfd_failed(false);
+        else if((vfd_response_t)context == VFD_SetRPM)
+            task_add_delayed(retry_rpm, NULL, delay);
+    } else
         system_raise_alarm(Alarm_Spindle);
-    }
 }
 
 static void onReportOptions (bool newopt)
@@ -266,11 +258,15 @@ static void onReportOptions (bool newopt)
 
 static void onDriverReset (void)
 {
-    retry_counter = 0;
-
     driver_reset();
 }
 
+static void set_scaling (void)
+{
+    rpm_to_freq = vfd_scale(vfd_config.in_multiplier, vfd_config.in_divider);
+    freq_to_rpm = vfd_scale(vfd_config.out_multiplier, vfd_config.out_divider);
+}
+
 static void onSpindleSelected (spindle_ptrs_t *spindle)
 {
     if(spindle->id == spindle_id) {
@@ -281,6 +277,8 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
         modbus_set_silence(NULL);
         modbus_address = vfd_get_modbus_address(spindle_id);
 
+        set_scaling();
+
 //        spindleGetMaxRPM();
 
     } else
@@ -294,6 +292,8 @@ static void settingsChanged (settings_t *settings, settings_changed_flags_t chan
 {
     settings_changed(settings, changed);
 
+    set_scaling(); // the VFD settings are not flagged
+
     if(changed.spindle) {
 
         spindle_ptrs_t *spindle = spindle_get_hal(spindle_id, SpindleHAL_Configured);
@@ -0,0 +1,551 @@
+/*
+  profile.c - register map driven VFD spindle support
+
+  Part of grblHAL
+
+  Copyright (c) 2022 Andrew Marles
+  Copyright (c) 2022-2024 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "../shared.h"
+
+#if SPINDLE_ENABLE & VFD_PROFILE_SPINDLES
+
+#include <math.h>
+#include <string.h>
+
+#include "spindle.h"
+
+#define N_PROFILES (sizeof(profiles) / sizeof(vfd_profile_t))
+
+/*
+    YL620 manual configuration required
+    Parameter number        Description                     Value
+    -------------------------------------------------------------------------------
+    P00.00                  Main frequency                  400.00Hz (match to your spindle)
+    P00.01                  Command source                  3
+
+    P03.00                  RS485 Baud rate                 3 (9600)
+    P03.01                  RS485 address                   1
+    P03.02                  RS485 protocol                  2
+    P03.08                  Frequency given lower limit     100.0Hz (match to your spindle cooling-type)
+    ===============================================================================================================
+    Given a parameter Pnn.mm, the high byte of the register address is nn, the low is mm.
+    The numbers nn and mm in the manual are given in decimal, so P13.16 would be register address 0x0d10 when represented in hex.
+*/
+
+/*
+  VFDs that differ only in register numbers, command words and scaling are described by a profile.
+  To add a VFD add an entry to the table below, guarded by its spindle number.
+*/
+
+static const vfd_profile_t profiles[] = {
+#if SPINDLE_ENABLE & (1<<SPINDLE_GS20)
+    {
+        .ref_id = SPINDLE_GS20,
+        .name = "Durapulse GS20",
+        .plugin = "Durapulse VFD GS20",
+        .version = "v0.07",
+        .state = { .function = ModBus_WriteRegister, .reg = 0x2000 }, // bit 1:0 - stop/run, bit 5:4 - forward/reverse
+        .state_cmd = { 0x11, 0x21, 0x12, 0x22 },
+        .rpm = { .function = ModBus_WriteRegister, .reg = 0x2001 },
+        .freq_per_rpm = 100.0f,
+        .per_rpm_hz = true,
+        .telemetry = { .function = ModBus_ReadHoldingRegisters, .reg = 0x2103, .n_regs = 1 } // output frequency
+    },
+#endif
+#if SPINDLE_ENABLE & (1<<SPINDLE_YL620A)
+    {
+        .ref_id = SPINDLE_YL620A,
+        .name = "Yalang YS620",
+        .plugin = "Yalang VFD YL620A",
+        .version = "0.04",
+        .state = { .function = ModBus_WriteRegister, .reg = 0x2000 }, // bit 1:0 - shutdown/start, bit 5:4 - forward/reverse
+        .state_cmd = { 0x11, 0x21, 0x12, 0x22 },
+        .rpm = { .function = ModBus_WriteRegister, .reg = 0x2001 },  // x0.1Hz
+        .freq_per_rpm = 10.0f,
+        .per_rpm_hz = true,
+        .telemetry = { .function = ModBus_ReadHoldingRegisters, .reg = 0x200B, .n_regs = 1 } // output frequency
+    },
+#endif
+#if SPINDLE_ENABLE & (1<<SPINDLE_H100)
+    {
+        .ref_id = SPINDLE_H100,
+        .name = "H-100",
+        .plugin = "H-100 VFD",
+        .version = "0.05",
+        .state = { .function = ModBus_WriteCoil, .reg = 0x0000 },
+        .state_cmd = { 0x4B, 0x4B, 0x49, 0x4A },
+        .rpm = { .function = ModBus_WriteRegister, .reg = 0x0201 },  // x0.1Hz
+        .freq_per_rpm = 10.0f / 60.0f,
+        .telemetry = { .function = ModBus_ReadInputRegisters, .reg = 0x0000, .n_regs = 2 }, // output frequency
+        .limits = {
+            { .block = { .function = ModBus_ReadHoldingRegisters, .reg = 0x000B, .n_regs = 1 }, .min_idx = 0, .max_idx = -1 }, // PD11
+            { .block = { .function = ModBus_ReadHoldingRegisters, .reg = 0x0005, .n_regs = 1 }, .min_idx = -1, .max_idx = 0 }  // PD05
+        }
+    },
+#endif
+#if SPINDLE_ENABLE & (1<<SPINDLE_NOWFOREVER)
+    {
+        .ref_id = SPINDLE_NOWFOREVER,
+        .name = "Nowforever",
+        .plugin = "Nowforever VFD",
+        .version = "0.03",
+        .state = { .function = ModBus_WriteRegisters, .reg = 0x0900 },
+        .state_cmd = { 0x00, 0x00, 0x01, 0x03 },
+        .rpm = { .function = ModBus_WriteRegisters, .reg = 0x0901 }, // x0.01Hz
+        .freq_per_rpm = 100.0f / 60.0f,
+        .telemetry = { .function = ModBus_ReadHoldingRegisters, .reg = 0x0502, .n_regs = 1 }, // output frequency
+        .limits = {
+            { .block = { .function = ModBus_ReadHoldingRegisters, .reg = 0x0007, .n_regs = 2 }, .min_idx = 1, .max_idx = 0 }
+        }
+    },
+#endif
+};
+
+typedef struct {
+    const vfd_profile_t *profile;
+    const modbus_callbacks_t *callbacks;
+    spindle_id_t id;
+    uint32_t modbus_address;
+    spindle_ptrs_t *spindle_hal;
+    spindle_state_t vfd_state;
+    spindle_data_t spindle_data;
+    vfd_scale_t rpm_to_freq;
+    vfd_scale_t freq_to_rpm;
+    uint16_t freq_min;
+    uint16_t freq_max;              // 0 if not known
+    bool busy;
+    vfd_poll_t poll;
+    vfd_transaction_t transaction;
+    vfd_spindle_ptrs_t vfd;
+} vfd_instance_t;
+
+static uint_fast8_t n_instances = 0;
+static vfd_instance_t instances[N_PROFILES];
+static on_report_options_ptr on_report_options;
+static on_spindle_selected_ptr on_spindle_selected;
+static settings_changed_ptr settings_changed;
+static driver_reset_ptr driver_reset;
+
+static void rx_packet (vfd_instance_t *vfd, modbus_message_t *msg);
+static void rx_exception (vfd_instance_t *vfd, uint8_t code, void *context);
+
+// The core spindle and ModBus callbacks do not identify the instance, dispatch by table index.
+
+#define INSTANCE_CALLBACKS(n) \
+static spindle_data_t *spindleGetData##n (spindle_data_request_t request) { return &instances[n].spindle_data; } \
+static void rx_packet##n (modbus_message_t *msg) { rx_packet(&instances[n], msg); } \
+static void rx_exception##n (uint8_t code, void *context) { rx_exception(&instances[n], code, context); }
+
+INSTANCE_CALLBACKS(0)
+INSTANCE_CALLBACKS(1)
+INSTANCE_CALLBACKS(2)
+INSTANCE_CALLBACKS(3)
+
+static const spindle_get_data_ptr get_data[] = {
+    spindleGetData0, spindleGetData1, spindleGetData2, spindleGetData3
+};
+
+static const modbus_callbacks_t callbacks[] = {
+    { .on_rx_packet = rx_packet0, .on_rx_exception = rx_exception0 },
+    { .on_rx_packet = rx_packet1, .on_rx_exception = rx_exception1 },
+    { .on_rx_packet = rx_packet2, .on_rx_exception = rx_exception2 },
+    { .on_rx_packet = rx_packet3, .on_rx_exception = rx_exception3 }
+};
+
+static vfd_instance_t *get_instance (spindle_ptrs_t *spindle)
+{
+    uint_fast8_t idx = n_instances;
+
+    do {
+        if(instances[--idx].id == spindle->id)
+            break;
+    } while(idx);
+
+    return &instances[idx];
+}
+
+// Builds a single register write, the ADU is the same for all VFDs sharing the function code.
+static void write_register (modbus_message_t *cmd, vfd_instance_t *vfd, const vfd_write_t *write, uint16_t value)
+{
+    cmd->adu[0] = vfd->modbus_address;
+    cmd->adu[1] = write->function;
+
+    switch(write->function) {
+
+        case ModBus_WriteCoil:
+            cmd->adu[2] = (write->reg + value) >> 8;
+            cmd->adu[3] = (write->reg + value) & 0xFF;
+            cmd->adu[4] = 0xFF;
+            cmd->adu[5] = 0x00;
+            cmd->tx_length = 8;
+            break;
+
+        case ModBus_WriteRegisters:
+            cmd->adu[2] = write->reg >> 8;
+            cmd->adu[3] = write->reg & 0xFF;
+            cmd->adu[4] = 0x00;
+            cmd->adu[5] = 0x01;
+            cmd->adu[6] = 0x02;
+            cmd->adu[7] = value >> 8;
+            cmd->adu[8] = value & 0xFF;
+            cmd->tx_length = 11;
+            break;
+
+        default:
+            cmd->adu[2] = write->reg >> 8;
+            cmd->adu[3] = write->reg & 0xFF;
+            cmd->adu[4] = value >> 8;
+            cmd->adu[5] = value & 0xFF;
+            cmd->tx_length = 8;
+            break;
+    }
+
+    cmd->rx_length = 8;
+}
+
+static void set_scaling (vfd_instance_t *vfd)
+{
+    float divider = vfd->profile->per_rpm_hz && vfd_config.vfd_rpm_hz ? (float)vfd_config.vfd_rpm_hz : 1.0f;
+
+    vfd->rpm_to_freq = vfd_scale(vfd->profile->freq_per_rpm, divider);
+    vfd->freq_to_rpm = vfd_scale(divider, vfd->profile->freq_per_rpm);
+}
+
+// Read min and max configured frequency from the VFD, on a warm reset the cached values are used
+static void spindleGetRPMLimits (vfd_instance_t *vfd, bool cached)
+{
+    uint_fast8_t idx;
+    modbus_message_t cmd;
+
+    vfd->freq_min = vfd->freq_max = 0;
+
+    for(idx = 0; idx < sizeof(vfd->profile->limits) / sizeof(vfd_limits_t); idx++) {
+
+        const vfd_telemetry_t *block = &vfd->profile->limits[idx].block;
+
+        if(block->n_regs == 0)
+            break;
+
+        memset(&cmd, 0, sizeof(modbus_message_t));
+        cmd.context = idx ? (void *)VFD_GetMaxRPM : (void *)VFD_GetMinRPM;
+        cmd.adu[0] = vfd->modbus_address;
+        cmd.adu[1] = block->function;
+        cmd.adu[2] = block->reg >> 8;
+        cmd.adu[3] = block->reg & 0xFF;
+        cmd.adu[4] = 0x00;
+        cmd.adu[5] = block->n_regs;
+        cmd.tx_length = 8;
+        cmd.rx_length = 5 + block->n_regs * 2;
+        cmd.crc_check = true; // the replies are cached
+
+        if(!vfd_discovery_read(vfd->profile->ref_id, &cmd, vfd->callbacks, cached) && !vfd_modbus_send(&cmd, vfd->callbacks, true))
+            break;
+    }
+}
+
+static void spindleSetRPM (vfd_instance_t *vfd, float rpm, bool block, bool force)
+{
+    if(vfd->busy || (rpm == vfd->spindle_data.rpm_programmed && !force))
+        return; // block reentry
+
+    bool ok = true;
+    uint32_t freq = vfd_scaled((uint32_t)(rpm + 0.5f), vfd->rpm_to_freq);
+
+    if(vfd->freq_max)
+        freq = min(max(freq, vfd->freq_min), vfd->freq_max);
+
+    modbus_message_t rpm_cmd, *cmd;
+
+    if((cmd = vfd_modbus_reserve(&rpm_cmd, vfd->modbus_address, block))) {
+        cmd->context = (void *)VFD_SetRPM;
+        write_register(cmd, vfd, &vfd->profile->rpm, (uint16_t)min(freq, 0xFFFF));
+
+        vfd->busy = block;
+        ok = vfd_modbus_send(cmd, vfd->callbacks, block);
+    }
+
+    if(!ok)
+        vfd_failed(false);
+
+    spindle_set_at_speed_range(vfd->spindle_hal, &vfd->spindle_data, rpm);
+
+    vfd->busy = false;
+}
+
+static void spindleUpdateRPM (spindle_ptrs_t *spindle, float rpm)
+{
+    spindle_trace(SpindleTrace_UpdateRPM, spindle->id, 0, rpm);
+
+    spindleSetRPM(get_instance(spindle), rpm, false, false);
+}
+
+// Start or stop spindle
+static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
+{
+    bool ok;
+    vfd_instance_t *vfd = get_instance(spindle);
+
+    spindle_trace(SpindleTrace_SetState, spindle->id, state.value, rpm);
+
+    if(vfd->busy)
+        return; // block reentry
+
+    modbus_message_t mode_cmd = {
+        .context = (void *)VFD_SetStatus,
+        .crc_check = false
+    };
+
+    write_register(&mode_cmd, vfd, &vfd->profile->state, vfd->profile->state_cmd[((state.on && rpm != 0.0f) << 1) | state.ccw]);
+
+    if(vfd->vfd_state.ccw != state.ccw)
+        vfd->spindle_data.rpm_programmed = -1.0f;
+
+    vfd->vfd_state.on = vfd->spindle_data.state_programmed.on = state.on;
+    vfd->vfd_state.ccw = vfd->spindle_data.state_programmed.ccw = state.ccw;
+
+    if(vfd_state_async(state, &vfd->spindle_data) && vfd_transaction_send(&vfd->transaction, &mode_cmd, vfd->callbacks)) {
+        spindleSetRPM(vfd, rpm, false, false);
+        return;
+    }
+
+    vfd->busy = true;
+    ok = vfd_modbus_send(&mode_cmd, vfd->callbacks, true);
+    vfd->busy = false;
+
+    if(ok)
+        spindleSetRPM(vfd, rpm, true, false);
+    else
+        vfd_failed(false);
+}
+
+// Returns spindle state in a spindle_state_t variable
+static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
+{
+    vfd_instance_t *vfd = get_instance(spindle);
+
+    if(vfd_poll_due(&vfd->poll, vfd->modbus_address, vfd->vfd_state, &vfd->spindle_data, 1))
+        vfd_telemetry_request(&vfd->profile->telemetry, vfd->modbus_address, vfd->callbacks);
+
+    vfd->vfd_state.at_speed = spindle->get_data(SpindleData_AtSpeed)->state_programmed.at_speed;
+
+    return vfd->vfd_state; // return previous state as we do not want to wait for the response
+}
+
+static bool spindleConfig (spindle_ptrs_t *spindle)
+{
+    return modbus_isup();
+}
+
+static void rx_packet (vfd_instance_t *vfd, modbus_message_t *msg)
+{
+    uint16_t value;
+    const vfd_limits_t *limits;
+
+    if(!(msg->adu[0] & 0x80)) {
+
+        vfd_slave_ok(msg->adu[0]);
+
+        switch((vfd_response_t)msg->context) {
+
+            case VFD_GetRPM:
+                if(vfd_telemetry_get(&vfd->profile->telemetry, msg, 0, &value))
+                    spindle_validate_at_speed(vfd->spindle_data, (float)vfd_scaled(value, vfd->freq_to_rpm));
+                break;
+
+            case VFD_GetMinRPM:
+            case VFD_GetMaxRPM:
+                limits = &vfd->profile->limits[(vfd_response_t)msg->context == VFD_GetMaxRPM];
+
+                if(limits->min_idx >= 0 && vfd_telemetry_get(&limits->block, msg, limits->min_idx, &value))
+                    vfd->freq_min = value;
+                if(limits->max_idx >= 0 && vfd_telemetry_get(&limits->block, msg, limits->max_idx, &value))
+                    vfd->freq_max = value;
+
+                if(vfd->freq_max && vfd->spindle_hal) {
+                    vfd->spindle_hal->cap.rpm_range_locked = On;
+                    vfd->spindle_hal->rpm_min = (float)vfd_scaled(vfd->freq_min, vfd->freq_to_rpm);
+                    vfd->spindle_hal->rpm_max = (float)vfd_scaled(vfd->freq_max, vfd->freq_to_rpm);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+static void retry_rpm (void *data)
+{
+    vfd_instance_t *vfd = (vfd_instance_t *)data;
+
+    spindleSetRPM(vfd, max(vfd->spindle_data.rpm_programmed, 0.0f), false, true);
+}
+
+static void rx_exception (vfd_instance_t *vfd, uint8_t code, void *context)
+{
+    uint32_t delay;
+
+    // Alarm needs to be raised directly to correctly handle an error during reset (the rt command queue is
+    // emptied on a warm reset). Exception is during cold start, where alarms need to be queued.
+    // A setpoint dropped unsent while the VFD backs off is resent after the backoff, the timeout is already counted as a failure.
+    if(vfd_slave_dropped(code, vfd->modbus_address, &delay)) {
+        if((vfd_response_t)context == VFD_SetRPM)
+            task_add_delayed(retry_rpm, vfd, delay);
+    } else if(sys.cold_start)
+        vfd_failed(false);
+    else if((vfd_response_t)context > 0) {
+
+        // when RX exceptions during one of the VFD messages, retry after the backoff delay until the circuit breaker opens.
+
+        if(vfd_slave_failed(vfd->modbus_address, &delay))
+            vfd_failed(false);
+        else if((vfd_response_t)context == VFD_SetRPM)
+            task_add_delayed(retry_rpm, vfd, delay);
+    } else
+        system_raise_alarm(Alarm_Spindle);
+}
+
+static void onReportOptions (bool newopt)
+{
+    uint_fast8_t idx;
+
+    on_report_options(newopt);
+
+    if(!newopt) for(idx = 0; idx < n_instances; idx++)
+        report_plugin(instances[idx].profile->plugin, instances[idx].profile->version);
+}
+
+static void onDriverReset (void)
+{
+    uint_fast8_t idx;
+
+    driver_reset();
+
+    for(idx = 0; idx < n_instances; idx++) {
+        if(instances[idx].spindle_hal)
+            spindleGetRPMLimits(&instances[idx], true);
+    }
+}
+
+static void onSpindleSelected (spindle_ptrs_t *spindle)
+{
+    uint_fast8_t idx;
+    vfd_instance_t *vfd;
+
+    for(idx = 0; idx < n_instances; idx++) {
+
+        vfd = &instances[idx];
+
+        if(spindle->id == vfd->id) {
+
+            vfd->spindle_hal = spindle;
+            vfd->spindle_data.rpm_programmed = -1.0f;
+
+            modbus_set_silence(vfd->profile->silence);
+            vfd->modbus_address = vfd_get_modbus_address(vfd->id);
+
+            set_scaling(vfd);
+            spindleGetRPMLimits(vfd, false);
+
+        } else
+            vfd->spindle_hal = NULL;
+    }
+
+    if(on_spindle_selected)
+        on_spindle_selected(spindle);
+}
+
+static void settingsChanged (settings_t *settings, settings_changed_flags_t changed)
+{
+    uint_fast8_t idx;
+    vfd_instance_t *vfd;
+
+    settings_changed(settings, changed);
+
+    for(idx = 0; idx < n_instances; idx++) {
+
+        vfd = &instances[idx];
+
+        set_scaling(vfd); // the RPM per Hz setting is not flagged
+
+        if(changed.spindle) {
+
+            spindle_ptrs_t *spindle = spindle_get_hal(vfd->id, SpindleHAL_Configured);
+
+            spindle->at_speed_tolerance = settings->spindle.at_speed_tolerance;
+            vfd->spindle_data.at_speed_enabled = settings->spindle.at_speed_tolerance >= 0.0f;
+        }
+    }
+}
+
+// Registers the VFD described by the profile for the spindle number, called from vfd_init() to keep the spindle registration order.
+void vfd_profile_init (uint8_t ref_id)
+{
+    static const spindle_ptrs_t spindle = {
+        .type = SpindleType_VFD,
+        .cap = {
+            .variable = On,
+            .at_speed = On,
+            .direction = On,
+            .cmd_controlled = On
+        },
+        .config = spindleConfig,
+        .set_state = spindleSetState,
+        .get_state = spindleGetState,
+        .update_rpm = spindleUpdateRPM
+    };
+
+    uint_fast8_t idx = N_PROFILES;
+    vfd_instance_t *vfd = &instances[n_instances];
+
+    do {
+        if(profiles[--idx].ref_id == ref_id)
+            break;
+    } while(idx);
+
+    if(profiles[idx].ref_id != ref_id || n_instances == sizeof(callbacks) / sizeof(modbus_callbacks_t))
+        return;
+
+    memset(vfd, 0, sizeof(vfd_instance_t));
+    memcpy(&vfd->vfd.spindle, &spindle, sizeof(spindle_ptrs_t));
+
+    vfd->profile = &profiles[idx];
+    vfd->callbacks = &callbacks[n_instances];
+    vfd->vfd.spindle.ref_id = ref_id;
+    vfd->vfd.spindle.get_data = get_data[n_instances];
+
+    set_scaling(vfd);
+
+    if((vfd->id = vfd_register(&vfd->vfd, vfd->profile->name)) != -1 && n_instances++ == 0) {
+
+        on_spindle_selected = grbl.on_spindle_selected;
+        grbl.on_spindle_selected = onSpindleSelected;
+
+        settings_changed = hal.settings_changed;
+        hal.settings_changed = settingsChanged;
+
+        on_report_options = grbl.on_report_options;
+        grbl.on_report_options = onReportOptions;
+
+        driver_reset = hal.driver_reset;
+        hal.driver_reset = onDriverReset;
+    }
+}
+
+#endif
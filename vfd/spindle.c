@@ -37,6 +37,10 @@
 
 #include "spindle.h"
 
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+#include "../modbus_rtu.h"
+#endif
+
 #if SPINDLE_ENABLE == SPINDLE_ALL && N_SPINDLE == 1
 #warning Increase N_SPINDLE in grbl/config.h to a value high enough to accomodate all spindles.
 #endif
@@ -44,42 +48,168 @@
 #ifndef VFD_ADDRESS
 #define VFD_ADDRESS 1
 #endif
+#if VFD_MODBUS_BUSES > 1 && !defined(VFD_MODBUS_BUS)
+#if N_SPINDLE > 1 || N_SYS_SPINDLE > 1
+#define VFD_MODBUS_BUS { 0, 0, 0, 0 }   // ModBus RTU bus of the VFD for each ModBus address setting
+#else
+#define VFD_MODBUS_BUS 0                // ModBus RTU bus of the VFD
+#endif
+#endif
+#ifndef VFD_POLL_FAST
+#define VFD_POLL_FAST 20                // ms, status poll interval while accelerating towards the at speed window
+#endif
+#ifndef VFD_POLL_CRUISE
+#define VFD_POLL_CRUISE VFD_RETRY_DELAY // ms, status poll interval at speed
+#endif
+#ifndef VFD_POLL_IDLE
+#define VFD_POLL_IDLE 500               // ms, status poll interval when stopped
+#endif
+#ifndef VFD_POLL_BUDGET
+#define VFD_POLL_BUDGET 40              // max status poll frames per second and ModBus bus, shared by the VFDs on the bus
+#endif
+#ifndef VFD_POLL_BURST
+#define VFD_POLL_BURST 4                // max status poll frames sent back to back
+#endif
+#ifndef VFD_BACKOFF
+#define VFD_BACKOFF 20                  // ms, retry delay after a failed transaction, doubled on each consecutive failure and jittered by +/-25%
+#endif
+#ifndef VFD_BACKOFF_MAX
+#define VFD_BACKOFF_MAX 1000            // ms, also the probe interval while the circuit breaker is open
+#endif
+#ifndef VFD_BREAKER_TRIP
+#define VFD_BREAKER_TRIP 5              // consecutive failures that open the circuit breaker
+#endif
+#ifndef VFD_TRANSACTION_TIMEOUT
+#define VFD_TRANSACTION_TIMEOUT 5000    // ms, a pending state change transaction not completed within this time is failed
+#endif
+#ifndef VFD_LOAD_DEADBAND
+#define VFD_LOAD_DEADBAND 0.5f          // %, smaller spindle load changes are not reported
+#endif
+#ifndef VFD_LOAD_INTERVAL
+#define VFD_LOAD_INTERVAL 250           // ms, min interval between spindle load reports
+#endif
+#ifndef VFD_DISCOVERY_ENTRIES
+#define VFD_DISCOVERY_ENTRIES 8         // number of VFD parameter reads that can be cached
+#endif
+#ifndef VFD_DISCOVERY_NVS
+#define VFD_DISCOVERY_NVS 1             // set to 0 to not save the cached VFD parameters to NVS
+#endif
+#ifndef VFD_DISCOVERY_SAVE_DELAY
+#define VFD_DISCOVERY_SAVE_DELAY 500    // ms, delay before saving changed parameters to NVS, changes are batched
+#endif
+
+#define VFD_DISCOVERY_DATA 6            // max reply payload bytes cached
 
 typedef struct {
     spindle_id_t id;
     const vfd_spindle_ptrs_t *vfd;
 } vfd_spindle_t;
 
+typedef struct {
+    uint8_t address;
+    uint8_t failures;               // consecutive
+    vfd_breaker_state_t state;
+    uint32_t probe_at;              // ms
+} vfd_breaker_t;
+
+typedef enum {
+    VFD_DiscoveryFree = 0,
+    VFD_DiscoveryIdle,
+    VFD_DiscoveryPending
+} vfd_discovery_status_t;
+
+// Parameter read, keyed by the drive type and the ModBus address, function code and register of the request.
+// Holds the reply payload when n_data > 0.
+typedef struct {
+    volatile vfd_discovery_status_t status;
+    bool verify;                            // read checks that the cache is current
+    uint8_t ref_id;
+    uint8_t n_data;
+    uint8_t data[VFD_DISCOVERY_DATA];       // reply without address, function code and CRC
+    void *context;
+    const modbus_callbacks_t *callbacks;    // NULL if loaded from NVS and not yet requested
+    modbus_message_t msg;                   // request
+} vfd_discovery_t;
+
+#if VFD_DISCOVERY_NVS
+
+typedef struct {
+    uint8_t ref_id;
+    uint8_t key[4];                         // request address, function code and register
+    uint8_t n_data;
+    uint8_t data[VFD_DISCOVERY_DATA];
+} vfd_param_t;
+
+typedef struct {
+    vfd_param_t param[VFD_DISCOVERY_ENTRIES];
+} vfd_params_t;
+
+#endif
+
 static uint8_t n_spindle = 0;
 static bool spindle_changed = false;
 static spindle_id_t vfd_active = -1;
+static volatile uint32_t load_seq = 0;
 static vfd_ptrs_t vfd_spindle = {0};
 static vfd_spindle_t vfd_spindles[N_SPINDLE];
 static nvs_address_t nvs_address = 0;
+static vfd_breaker_t breakers[VFD_N_ADRESSES] = {0};
+static vfd_discovery_t discovery[VFD_DISCOVERY_ENTRIES] = {0};
+static bool discovery_verify = false;
+#if VFD_DISCOVERY_NVS
+static bool discovery_dirty = false;
+static nvs_address_t params_address = 0;
+
+static void discovery_save (void *data);
+static void discovery_load (void);
+#endif
+static void discovery_flushed (uint8_t address);
+static void vfd_flush_slave (uint8_t address);
+static const modbus_callbacks_t *retry_callbacks = NULL;
+static uint8_t retry_code;
 
 static on_spindle_selected_ptr on_spindle_selected;
 static on_realtime_report_ptr on_realtime_report = NULL;
 
 vfd_settings_t vfd_config;
 
+// Drivers call vfd_load_changed() when new load data has arrived, the load is only fetched and formatted then.
+// Changes less than VFD_LOAD_DEADBAND are not reported and reports are rate limited to one per VFD_LOAD_INTERVAL ms.
 static void vfd_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
 {
     static float load = -1.0f;
+    static uint32_t reported_seq = 0, reported_at = 0;
 
     if(on_realtime_report)
         on_realtime_report(stream_write, report);
 
     if(vfd_spindle.get_load) {
-        float new_load = vfd_spindle.get_load();
-        if(load != new_load || spindle_changed || report.all) {
-            load = new_load;
-            spindle_changed = false;
-            stream_write("|Sl:");
-            stream_write(ftoa(load, 1));
+
+        uint32_t seq = load_seq, ms = hal.get_elapsed_ticks();
+
+        if(spindle_changed || report.all || (seq != reported_seq && ms - reported_at >= VFD_LOAD_INTERVAL)) {
+
+            float new_load = vfd_spindle.get_load();
+
+            reported_seq = seq;
+
+            if(spindle_changed || report.all || fabsf(new_load - load) >= VFD_LOAD_DEADBAND) {
+                load = new_load;
+                reported_at = ms;
+                spindle_changed = false;
+                stream_write("|Sl:");
+                stream_write(ftoa(load, 1));
+            }
         }
     }
 }
 
+// To be called by drivers providing get_load() when the data the load is derived from has been updated.
+void vfd_load_changed (void)
+{
+    load_seq++;
+}
+
 #ifdef GRBL_ESP32
 static void esp32_spindle_off (spindle_ptrs_t *spindle)
 {
@@ -294,21 +424,64 @@ static const setting_descr_t vfd_settings_descr[] = {
 };
 #endif
 
+#if VFD_MODBUS_BUSES > 1
+
+// Binds the VFD ModBus addresses to their bus, addresses bound earlier are unbound first.
+static void vfd_bind_buses (void)
+{
+#if N_SPINDLE > 1 || N_SYS_SPINDLE > 1
+    static uint8_t bound[VFD_N_ADRESSES] = {0};
+
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < VFD_N_ADRESSES; idx++) {
+        if(bound[idx])
+            modbus_rtu_bind_address(bound[idx], 0);
+    }
+
+    for(idx = 0; idx < VFD_N_ADRESSES; idx++)
+        bound[idx] = vfd_config.modbus_bus[idx] && modbus_rtu_bind_address(vfd_config.modbus_address[idx], vfd_config.modbus_bus[idx]) ? vfd_config.modbus_address[idx] : 0;
+#else
+    static uint8_t bound = 0;
+
+    if(bound)
+        modbus_rtu_bind_address(bound, 0);
+
+    bound = vfd_config.modbus_bus && modbus_rtu_bind_address(vfd_config.modbus_address, vfd_config.modbus_bus) ? vfd_config.modbus_address : 0;
+#endif
+}
+
+#else
+#define vfd_bind_buses()
+#endif
+
 static void vfd_settings_save (void)
 {
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&vfd_config, sizeof(vfd_settings_t), true);
+
+    vfd_bind_buses();
 }
 
 static void vfd_settings_restore (void)
 {
 #if N_SPINDLE > 1 || N_SYS_SPINDLE > 1
+#if VFD_MODBUS_BUSES > 1
+    static const uint8_t modbus_bus[VFD_N_ADRESSES] = VFD_MODBUS_BUS;
+#endif
+
     uint_fast8_t idx = VFD_N_ADRESSES;
     do {
         idx--;
         vfd_config.modbus_address[idx] = VFD_ADDRESS + idx;
+#if VFD_MODBUS_BUSES > 1
+        vfd_config.modbus_bus[idx] = modbus_bus[idx];
+#endif
     } while(idx);
 #else
     vfd_config.modbus_address = VFD_ADDRESS;
+#if VFD_MODBUS_BUSES > 1
+    vfd_config.modbus_bus = VFD_MODBUS_BUS;
+#endif
 #endif
 //MODVFD settings below are defaulted to values for GS20 VFD
     vfd_config.vfd_rpm_hz = 60;
@@ -330,6 +503,11 @@ static void vfd_settings_restore (void)
 #endif
 
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&vfd_config, sizeof(vfd_settings_t), true);
+
+#if VFD_DISCOVERY_NVS
+    memset(discovery, 0, sizeof(discovery));
+    discovery_save(NULL);
+#endif
 }
 
 static void vfd_settings_load (void)
@@ -337,6 +515,11 @@ static void vfd_settings_load (void)
     if(nvs_address != 0) {
         if((hal.nvs.memcpy_from_nvs((uint8_t *)&vfd_config, nvs_address, sizeof(vfd_settings_t), true) != NVS_TransferResult_OK))
             vfd_settings_restore();
+#if VFD_DISCOVERY_NVS
+        else
+            discovery_load();
+#endif
+        vfd_bind_buses();
     }
 }
 
@@ -357,20 +540,31 @@ static setting_details_t vfd_setting_details = {
 static void vfd_spindle_selected (spindle_ptrs_t *spindle)
 {
     uint_fast8_t idx = n_spindle;
+    bool hot_swap = spindle_select_hot_swap();
+#if N_SYS_SPINDLE == 1
+    uint32_t address = vfd_active != -1 ? vfd_get_modbus_address(vfd_active) : 0;
+#endif
 
     vfd_active = -1;
     spindle_changed = true;
+    discovery_verify = !hot_swap; // cached parameters are current when swapped in from hot standby
 
     memset(&vfd_spindle, 0, sizeof(vfd_ptrs_t));
     if(n_spindle) do {
         if(vfd_spindles[--idx].id == spindle->id) {
-            modbus_flush_queue();
             vfd_active = spindle->id;
             memcpy(&vfd_spindle, &vfd_spindles[idx].vfd->vfd, sizeof(vfd_ptrs_t));
             break;
         }
     } while(idx);
 
+#if N_SYS_SPINDLE == 1
+    // Drop the messages for the deselected VFD, traffic for other slaves is kept.
+    // With more than one spindle enabled the other VFDs stay in use.
+    if(!hot_swap && address && (vfd_active == -1 || address != vfd_get_modbus_address(vfd_active)))
+        vfd_flush_slave(address);
+#endif
+
     if(on_spindle_selected)
         on_spindle_selected(spindle);
 }
@@ -384,6 +578,8 @@ bool vfd_failed (bool disable)
 {
     bool ok = true;
 
+    spindle_trace(SpindleTrace_VFDFailed, 0, disable, 0.0f);
+
     if(sys.cold_start)
         protocol_enqueue_foreground_task(raise_alarm, NULL);
     else
@@ -395,6 +591,712 @@ bool vfd_failed (bool disable)
     return ok;
 }
 
+// Retry policy, shared by all VFDs. Each slave address has a circuit breaker: after VFD_BREAKER_TRIP consecutive
+// failures it opens and requests to the slave are refused, leaving the bus to healthy slaves. Once every VFD_BACKOFF_MAX ms
+// a single probe request is let through (half-open), a reply closes the breaker again.
+
+static vfd_breaker_t *breaker_get (uint8_t address)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < VFD_N_ADRESSES - 1; idx++) {
+        if(breakers[idx].address == address || breakers[idx].address == 0)
+            break;
+    }
+
+    if(breakers[idx].address != address) {
+        breakers[idx].address = address;
+        breakers[idx].failures = 0;
+        breakers[idx].state = VFD_BreakerClosed;
+    }
+
+    return &breakers[idx];
+}
+
+// Exponential backoff with +/-25% jitter to keep VFDs failing at the same time from retrying in lockstep.
+static uint32_t backoff_delay (uint_fast8_t failures)
+{
+    static uint32_t seed = 0;
+
+    uint32_t delay = failures > 8 ? VFD_BACKOFF_MAX : min((uint32_t)VFD_BACKOFF << (failures - 1), VFD_BACKOFF_MAX);
+
+    if(seed == 0)
+        seed = hal.get_elapsed_ticks() | 1;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return delay - delay / 4 + seed % (delay / 2 + 1);
+}
+
+vfd_breaker_state_t vfd_slave_state (uint8_t address)
+{
+    return breaker_get(address)->state;
+}
+
+// Returns true if a request to the slave may be sent.
+bool vfd_slave_available (uint8_t address)
+{
+    uint32_t ms;
+    vfd_breaker_t *breaker = breaker_get(address);
+
+    if(breaker->state == VFD_BreakerClosed)
+        return true;
+
+    if((int32_t)((ms = hal.get_elapsed_ticks()) - breaker->probe_at) < 0)
+        return false;
+
+    breaker->state = VFD_BreakerHalfOpen;
+    breaker->probe_at = ms + backoff_delay(breaker->failures);
+
+    return true;
+}
+
+void vfd_slave_ok (uint8_t address)
+{
+    vfd_breaker_t *breaker = breaker_get(address);
+
+    breaker->failures = 0;
+    breaker->state = VFD_BreakerClosed;
+}
+
+// Records a failed transaction. Returns true if the circuit breaker is open, the caller should then give up and call vfd_failed().
+// Otherwise the delay before retrying, in ms, is returned in delay if not NULL.
+bool vfd_slave_failed (uint8_t address, uint32_t *delay)
+{
+    vfd_breaker_t *breaker = breaker_get(address);
+
+    if(breaker->failures < 255)
+        breaker->failures++;
+
+    if(delay)
+        *delay = backoff_delay(breaker->failures);
+
+    if(breaker->state == VFD_BreakerHalfOpen || breaker->failures >= VFD_BREAKER_TRIP) {
+        breaker->state = VFD_BreakerOpen;
+        breaker->probe_at = hal.get_elapsed_ticks() + backoff_delay(breaker->failures);
+    }
+
+    return breaker->state == VFD_BreakerOpen;
+}
+
+// Returns true if the exception code is for a message dropped unsent while the slave backs off after a timeout,
+// the timeout has already been counted as a failure. The delay before retrying, in ms, is returned in delay if not NULL.
+bool vfd_slave_dropped (uint8_t code, uint8_t address, uint32_t *delay)
+{
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+    if(code == MODBUS_RTU_DROPPED) {
+        if(delay)
+            *delay = backoff_delay(max(breaker_get(address)->failures, 1));
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+static void retry_rx_packet (modbus_message_t *msg)
+{
+    vfd_slave_ok(msg->adu[0]);
+
+    if(retry_callbacks->on_rx_packet)
+        retry_callbacks->on_rx_packet(msg);
+}
+
+static void retry_rx_exception (uint8_t code, void *context)
+{
+    retry_code = code;
+}
+
+// Blocking send with the retry policy, the realtime loop is kept running between attempts.
+// The exception handler of the caller is only called when giving up.
+static bool modbus_send_retry (modbus_message_t *msg, const modbus_callbacks_t *callbacks)
+{
+    static const modbus_callbacks_t retry = {
+        .on_rx_packet = retry_rx_packet,
+        .on_rx_exception = retry_rx_exception
+    };
+
+    bool ok = false;
+    uint32_t delay;
+    uint8_t address = msg->adu[0];
+    const modbus_callbacks_t *prev = retry_callbacks; // in case a send is issued from the realtime loop while waiting
+
+    retry_callbacks = callbacks;
+    retry_code = 0;
+
+    while(vfd_slave_available(address)) {
+
+        if((ok = modbus_send(msg, &retry, true)) || vfd_slave_failed(address, &delay))
+            break;
+
+        delay += hal.get_elapsed_ticks();
+        while((int32_t)(hal.get_elapsed_ticks() - delay) < 0)
+            grbl.on_execute_realtime(state_get());
+    }
+
+    retry_callbacks = prev;
+
+    if(!ok && callbacks->on_rx_exception)
+        callbacks->on_rx_exception(retry_code, msg->context);
+
+    return ok;
+}
+
+// Returns the message to build the ADU in: a zeroed local message for blocking transactions or if
+// the RTU queue is not available, otherwise a slot in the RTU queue. NULL if the queue is full.
+modbus_message_t *vfd_modbus_reserve (modbus_message_t *msg, uint8_t address, bool block)
+{
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+    if(!block)
+        return modbus_rtu_reserve(address);
+#endif
+
+    memset(msg, 0, sizeof(modbus_message_t));
+
+    return msg;
+}
+
+// Sends a message obtained from vfd_modbus_reserve().
+// Commands are queued ahead of telemetry, each VFD is scheduled separately by its ModBus address.
+// Blocking sends are retried by the retry policy, requests to a slave with an open circuit breaker are refused.
+bool vfd_modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block)
+{
+    if(block)
+        return modbus_send_retry(msg, callbacks);
+
+    if(!vfd_slave_available(msg->adu[0])) {
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+        modbus_rtu_cancel(msg);
+#endif
+        return false;
+    }
+
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+    {
+
+        modbus_msg_flags_t flags = {0};
+
+        switch((vfd_response_t)msg->context) {
+
+            case VFD_SetRPM:
+                flags.coalesce = On; // only the latest setpoint should go on the wire
+                flags.notify = On;   // a lost setpoint is resent by the driver exception handler
+                // no break
+            case VFD_SetStatus:
+                flags.priority = ModBus_PriorityHigh;
+                break;
+
+            default:
+                break;
+        }
+
+        return modbus_rtu_commit(msg, callbacks, flags);
+    }
+#else
+    return modbus_send(msg, callbacks, false);
+#endif
+}
+
+// Adaptive status poll rate: returns true if a status poll sending the given number of frames to the VFD at address is due.
+// Polls fast while accelerating towards the at speed window, slower when at speed or stopped,
+// and limits the frames for all VFDs on the same ModBus bus to VFD_POLL_BUDGET per second.
+bool vfd_poll_due (vfd_poll_t *poll, uint8_t address, spindle_state_t state, spindle_data_t *data, uint_fast8_t frames)
+{
+    static struct {
+        uint32_t ms;
+        uint32_t tokens;
+    } budget[VFD_MODBUS_BUSES] = {0};
+
+#if VFD_MODBUS_BUSES > 1
+    uint8_t bus = modbus_rtu_get_bus(address);
+#else
+    uint8_t bus = 0;
+#endif
+    uint32_t ms = hal.get_elapsed_ticks(), interval;
+
+    if(budget[bus].ms == 0)
+        budget[bus].tokens = VFD_POLL_BURST * 1000;
+    else
+        budget[bus].tokens = min(budget[bus].tokens + min(ms - budget[bus].ms, VFD_POLL_BURST * 1000) * VFD_POLL_BUDGET, VFD_POLL_BURST * 1000);
+    budget[bus].ms = ms;
+
+    if(!state.on || data->rpm_programmed <= 0.0f)
+        interval = VFD_POLL_IDLE;
+    else if(data->at_speed_enabled && !data->state_programmed.at_speed)
+        interval = VFD_POLL_FAST;
+    else
+        interval = VFD_POLL_CRUISE;
+
+    if(ms - poll->last_ms < interval || budget[bus].tokens < frames * 1000)
+        return false;
+
+    budget[bus].tokens -= frames * 1000;
+    poll->last_ms = ms;
+
+    return true;
+}
+
+// Reads a telemetry block with a single async request, the response is passed to
+// the on_rx_packet callback with context VFD_GetRPM.
+bool vfd_telemetry_request (const vfd_telemetry_t *block, uint8_t address, const modbus_callbacks_t *callbacks)
+{
+    modbus_message_t telemetry_cmd, *cmd;
+
+    if(block->n_regs == 0 || 5 + block->n_regs * 2 > MODBUS_MAX_ADU_SIZE)
+        return false;
+
+    if((cmd = vfd_modbus_reserve(&telemetry_cmd, address, false))) {
+        cmd->context = (void *)VFD_GetRPM;
+        cmd->adu[0] = address;
+        cmd->adu[1] = block->function;
+        cmd->adu[2] = block->reg >> 8;
+        cmd->adu[3] = block->reg & 0xFF;
+        cmd->adu[4] = 0x00;
+        cmd->adu[5] = block->n_regs;
+        cmd->tx_length = 8;
+        cmd->rx_length = 5 + block->n_regs * 2;
+
+        return vfd_modbus_send(cmd, callbacks, false);
+    }
+
+    return false;
+}
+
+// Extracts register idx (relative to the first register) of a telemetry block response,
+// returns false if the response does not match the block.
+bool vfd_telemetry_get (const vfd_telemetry_t *block, modbus_message_t *msg, uint_fast8_t idx, uint16_t *value)
+{
+    if(idx >= block->n_regs || msg->adu[2] != block->n_regs * 2)
+        return false;
+
+    *value = ((uint8_t)msg->adu[3 + idx * 2] << 8) | (uint8_t)msg->adu[4 + idx * 2];
+
+    return true;
+}
+
+// Returns the fixed point factor for multiplier / divider, to be computed when settings or VFD parameters change.
+// 0 is returned if the divider is 0 or the factor is out of range.
+vfd_scale_t vfd_scale (float multiplier, float divider)
+{
+    float scale = divider > 0.0f ? multiplier * (float)(1UL << VFD_SCALE_SHIFT) / divider : 0.0f;
+
+    return scale >= 0.0f && scale < 4294967295.0f ? (vfd_scale_t)(scale + 0.5f) : 0;
+}
+
+// Returns value * scale, rounded. Integer only for use in the RPM update and status decode paths.
+uint32_t vfd_scaled (uint32_t value, vfd_scale_t scale)
+{
+    uint64_t scaled = ((uint64_t)value * scale + (1UL << (VFD_SCALE_SHIFT - 1))) >> VFD_SCALE_SHIFT;
+
+    return scaled > UINT32_MAX ? UINT32_MAX : (uint32_t)scaled;
+}
+
+// Returns true if a spindle state change may be sent asynchronously.
+// Stopping the spindle and changes made before the controller is up are always blocking,
+// as are changes when the core does not synchronize on the at speed state.
+bool vfd_state_async (spindle_state_t state, spindle_data_t *data)
+{
+    return state.on && data->at_speed_enabled && !sys.cold_start;
+}
+
+static void transaction_timeout (void *data);
+
+// Only the first completion of a transaction is reported, e.g. a late reply after the timeout is ignored.
+static void transaction_complete (vfd_transaction_t *transaction, vfd_transaction_status_t status)
+{
+    if(transaction->status != VFD_TransactionPending)
+        return;
+
+    task_delete(transaction_timeout, transaction);
+
+    transaction->status = status;
+
+    if(transaction->on_done)
+        transaction->on_done(transaction);
+    else if(status == VFD_TransactionFailed)
+        vfd_failed(false);
+}
+
+static bool transaction_queue (vfd_transaction_t *transaction);
+
+// Fails a transaction not completed within VFD_TRANSACTION_TIMEOUT ms, e.g. since its message was dropped from the queue by a flush.
+static void transaction_timeout (void *data)
+{
+    vfd_transaction_t *transaction = (vfd_transaction_t *)data;
+
+    if(transaction->status == VFD_TransactionPending && hal.get_elapsed_ticks() - transaction->started >= VFD_TRANSACTION_TIMEOUT)
+        transaction_complete(transaction, VFD_TransactionFailed);
+}
+
+static void transaction_retry (void *data)
+{
+    vfd_transaction_t *transaction = (vfd_transaction_t *)data;
+
+    if(transaction->status == VFD_TransactionPending && !transaction_queue(transaction)) {
+        if(++transaction->retries <= VFD_RETRIES)
+            protocol_enqueue_foreground_task(transaction_retry, transaction);
+        else
+            transaction_complete(transaction, VFD_TransactionFailed);
+    }
+}
+
+static void transaction_rx_packet (modbus_message_t *msg)
+{
+    vfd_transaction_t *transaction = (vfd_transaction_t *)msg->context;
+
+    msg->context = transaction->context;
+    vfd_slave_ok(msg->adu[0]);
+
+    if(transaction->callbacks && transaction->callbacks->on_rx_packet)
+        transaction->callbacks->on_rx_packet(msg);
+
+    transaction_complete(transaction, VFD_TransactionDone);
+}
+
+// Failed attempts are retried by the retry policy before the transaction fails,
+// the driver exception handler is not called. An attempt dropped unsent while the slave backs off is retried after the backoff.
+static void transaction_rx_exception (uint8_t code, void *context)
+{
+    uint32_t delay;
+    vfd_transaction_t *transaction = (vfd_transaction_t *)context;
+
+    if(vfd_slave_dropped(code, transaction->msg.adu[0], &delay))
+        task_add_delayed(transaction_retry, transaction, delay);
+    else if(vfd_slave_failed(transaction->msg.adu[0], &delay))
+        transaction_complete(transaction, VFD_TransactionFailed);
+    else
+        task_add_delayed(transaction_retry, transaction, delay);
+}
+
+static const modbus_callbacks_t transaction_callbacks = {
+    .on_rx_packet = transaction_rx_packet,
+    .on_rx_exception = transaction_rx_exception
+};
+
+static bool transaction_queue (vfd_transaction_t *transaction)
+{
+    modbus_message_t msg;
+
+    memcpy(&msg, &transaction->msg, sizeof(modbus_message_t));
+
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+    modbus_msg_flags_t flags = {0};
+
+    flags.priority = ModBus_PriorityHigh;
+    flags.notify = On;
+
+    return modbus_rtu_send_async(&msg, &transaction_callbacks, flags);
+#else
+    return modbus_send(&msg, &transaction_callbacks, false);
+#endif
+}
+
+// Queues a copy of the message, returns immediately. The status can be queried by vfd_transaction_get_status().
+// Returns false if the message could not be queued or a previous transaction is still pending,
+// the caller should then fall back to a blocking send.
+bool vfd_transaction_send (vfd_transaction_t *transaction, modbus_message_t *msg, const modbus_callbacks_t *callbacks)
+{
+    if(vfd_transaction_get_status(transaction) == VFD_TransactionPending || !vfd_slave_available(msg->adu[0]))
+        return false;
+
+    memcpy(&transaction->msg, msg, sizeof(modbus_message_t));
+    transaction->msg.context = transaction;
+    transaction->context = msg->context;
+    transaction->callbacks = callbacks;
+    transaction->retries = 0;
+    transaction->started = hal.get_elapsed_ticks();
+    transaction->status = VFD_TransactionPending;
+
+    if(!transaction_queue(transaction)) {
+        transaction->status = VFD_TransactionIdle;
+        return false;
+    }
+
+    task_delete(transaction_timeout, transaction);
+    task_add_delayed(transaction_timeout, transaction, VFD_TRANSACTION_TIMEOUT);
+
+    return true;
+}
+
+// The timeout is normally handled by the timer armed by vfd_transaction_send(), checking it here too
+// covers the case where no delayed task could be added.
+vfd_transaction_status_t vfd_transaction_get_status (vfd_transaction_t *transaction)
+{
+    transaction_timeout(transaction);
+
+    return transaction->status;
+}
+
+static bool discovery_queue (vfd_discovery_t *entry);
+
+#if VFD_DISCOVERY_NVS
+
+static void discovery_save (void *data)
+{
+    uint_fast8_t idx;
+    vfd_params_t params = {0};
+
+    discovery_dirty = false;
+
+    for(idx = 0; idx < VFD_DISCOVERY_ENTRIES; idx++) {
+        if(discovery[idx].n_data) {
+            params.param[idx].ref_id = discovery[idx].ref_id;
+            memcpy(params.param[idx].key, discovery[idx].msg.adu, sizeof(params.param[idx].key));
+            params.param[idx].n_data = discovery[idx].n_data;
+            memcpy(params.param[idx].data, discovery[idx].data, discovery[idx].n_data);
+        }
+    }
+
+    if(params_address)
+        hal.nvs.memcpy_to_nvs(params_address, (uint8_t *)&params, sizeof(vfd_params_t), true);
+}
+
+static void discovery_load (void)
+{
+    uint_fast8_t idx;
+    vfd_params_t params;
+
+    if(params_address == 0 || hal.nvs.memcpy_from_nvs((uint8_t *)&params, params_address, sizeof(vfd_params_t), true) != NVS_TransferResult_OK) {
+        discovery_save(NULL);
+        return;
+    }
+
+    for(idx = 0; idx < VFD_DISCOVERY_ENTRIES; idx++) {
+        if(params.param[idx].n_data && params.param[idx].n_data <= VFD_DISCOVERY_DATA && discovery[idx].status == VFD_DiscoveryFree) {
+            memset(&discovery[idx], 0, sizeof(vfd_discovery_t));
+            discovery[idx].status = VFD_DiscoveryIdle;
+            discovery[idx].ref_id = params.param[idx].ref_id;
+            memcpy(discovery[idx].msg.adu, params.param[idx].key, sizeof(params.param[idx].key));
+            discovery[idx].n_data = params.param[idx].n_data;
+            memcpy(discovery[idx].data, params.param[idx].data, params.param[idx].n_data);
+        }
+    }
+}
+
+#endif // VFD_DISCOVERY_NVS
+
+// Discards the messages queued for a VFD.
+static void vfd_flush_slave (uint8_t address)
+{
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+    modbus_rtu_flush_slave(address);
+#else
+    modbus_flush_queue();
+#endif
+    discovery_flushed(address);
+}
+
+// Called when the messages for a ModBus address have been flushed, pending reads are requeued on the next request.
+static void discovery_flushed (uint8_t address)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < VFD_DISCOVERY_ENTRIES; idx++) {
+        if(discovery[idx].status == VFD_DiscoveryPending && discovery[idx].msg.adu[0] == address) {
+            discovery[idx].verify = false;
+            discovery[idx].status = discovery[idx].n_data ? VFD_DiscoveryIdle : VFD_DiscoveryFree;
+        }
+    }
+}
+
+// Delivers the cached reply to the driver.
+static void discovery_replay (vfd_discovery_t *entry)
+{
+    modbus_message_t reply;
+
+    memcpy(&reply, &entry->msg, sizeof(modbus_message_t));
+    memcpy(&reply.adu[2], entry->data, entry->n_data);
+    reply.context = entry->context;
+    reply.rx_length = entry->n_data + 4;
+
+    if(entry->callbacks->on_rx_packet)
+        entry->callbacks->on_rx_packet(&reply);
+}
+
+static void discovery_retry (void *data)
+{
+    vfd_discovery_t *entry = (vfd_discovery_t *)data;
+
+    if(entry->status == VFD_DiscoveryPending && !discovery_queue(entry))
+        entry->status = entry->n_data ? VFD_DiscoveryIdle : VFD_DiscoveryFree;
+}
+
+// A changed parameter may mean the VFD has been reconfigured, all parameters read from it are read again.
+static void discovery_refresh (vfd_discovery_t *changed)
+{
+    uint_fast8_t idx;
+    vfd_discovery_t *entry;
+
+    for(idx = 0; idx < VFD_DISCOVERY_ENTRIES; idx++) {
+
+        entry = &discovery[idx];
+
+        if(entry != changed && entry->n_data && entry->status != VFD_DiscoveryPending &&
+            entry->ref_id == changed->ref_id && entry->msg.adu[0] == changed->msg.adu[0]) {
+
+            if(entry->callbacks) {
+                entry->status = VFD_DiscoveryPending;
+                if(!discovery_queue(entry))
+                    entry->status = VFD_DiscoveryIdle;
+            } else {
+                entry->n_data = 0; // loaded from NVS and not yet requested, read on the next request
+                entry->status = VFD_DiscoveryFree;
+            }
+        }
+    }
+}
+
+static void discovery_rx_packet (modbus_message_t *msg)
+{
+    bool changed;
+    vfd_discovery_t *entry = (vfd_discovery_t *)msg->context;
+    uint_fast8_t n_data = msg->rx_length > 4 ? msg->rx_length - 4 : 0; // reply without address, function code and CRC
+
+    if(entry->status != VFD_DiscoveryPending)
+        return; // superseded
+
+    changed = n_data != entry->n_data || memcmp(entry->data, &msg->adu[2], n_data);
+
+    if(n_data <= VFD_DISCOVERY_DATA) {
+        if(changed) {
+            memcpy(entry->data, &msg->adu[2], n_data);
+            entry->n_data = n_data;
+        }
+    } else
+        entry->n_data = 0; // too large to cache
+
+    entry->status = entry->n_data ? VFD_DiscoveryIdle : VFD_DiscoveryFree;
+
+    msg->context = entry->context;
+    vfd_slave_ok(msg->adu[0]);
+
+    if(changed) {
+
+        if(entry->verify)
+            discovery_refresh(entry);
+
+        if(entry->callbacks->on_rx_packet)
+            entry->callbacks->on_rx_packet(msg);
+
+#if VFD_DISCOVERY_NVS
+        if(!discovery_dirty && entry->n_data)
+            discovery_dirty = task_add_delayed(discovery_save, NULL, VFD_DISCOVERY_SAVE_DELAY);
+#endif
+    }
+
+    entry->verify = false;
+}
+
+// Failed reads are retried by the retry policy, the driver exception handler is called when the circuit breaker opens.
+static void discovery_rx_exception (uint8_t code, void *context)
+{
+    uint32_t delay;
+    vfd_discovery_t *entry = (vfd_discovery_t *)context;
+
+    if(entry->status != VFD_DiscoveryPending)
+        return;
+
+    if(vfd_slave_dropped(code, entry->msg.adu[0], &delay))
+        task_add_delayed(discovery_retry, entry, delay);
+    else if(vfd_slave_failed(entry->msg.adu[0], &delay)) {
+        entry->verify = false;
+        entry->status = entry->n_data ? VFD_DiscoveryIdle : VFD_DiscoveryFree;
+        if(entry->callbacks->on_rx_exception)
+            entry->callbacks->on_rx_exception(code, entry->context);
+    } else
+        task_add_delayed(discovery_retry, entry, delay);
+}
+
+static const modbus_callbacks_t discovery_callbacks = {
+    .on_rx_packet = discovery_rx_packet,
+    .on_rx_exception = discovery_rx_exception
+};
+
+static bool discovery_queue (vfd_discovery_t *entry)
+{
+    modbus_message_t msg;
+
+    memcpy(&msg, &entry->msg, sizeof(modbus_message_t));
+
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+    modbus_msg_flags_t flags = {0};
+
+    flags.notify = On;
+
+    return modbus_rtu_send_async(&msg, &discovery_callbacks, flags);
+#else
+    return modbus_send(&msg, &discovery_callbacks, false);
+#endif
+}
+
+static vfd_discovery_t *discovery_get (uint8_t ref_id, modbus_message_t *msg)
+{
+    uint_fast8_t idx;
+    vfd_discovery_t *entry, *free = NULL;
+
+    for(idx = 0; idx < VFD_DISCOVERY_ENTRIES; idx++) {
+
+        entry = &discovery[idx];
+
+        if(entry->status == VFD_DiscoveryFree) {
+            if(free == NULL)
+                free = entry;
+        } else if(entry->ref_id == ref_id && !memcmp(entry->msg.adu, msg->adu, 4))
+            return entry;
+    }
+
+    return free;
+}
+
+// Reads a VFD parameter such as the RPM limits without blocking, the reply is delivered to the driver
+// callbacks as for a blocking read. Reads for all VFDs are queued at once and are sent in parallel with other traffic.
+// Replies are cached keyed by the drive type (ref_id), address, function code and register, and saved to NVS.
+// A cached reply is delivered immediately. If cached is false, as on spindle selection, the first cached read
+// after the selection is sent to the VFD to check that the cache is current. If the reply differs all parameters
+// cached for the VFD are read again and delivered as they arrive. If cached is true, as on a warm reset, there is no check.
+// Returns false if the read could not be queued and no reply is cached, the caller may then fall back to a blocking read.
+bool vfd_discovery_read (uint8_t ref_id, modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool cached)
+{
+    vfd_discovery_t *entry;
+
+    if((entry = discovery_get(ref_id, msg)) == NULL)
+        return false;
+
+    memcpy(&entry->msg, msg, sizeof(modbus_message_t));
+    entry->msg.context = entry;
+    entry->context = msg->context;
+    entry->callbacks = callbacks;
+    entry->ref_id = ref_id;
+
+    if(entry->n_data) {
+
+        discovery_replay(entry);
+
+        if(cached || !discovery_verify)
+            return true;
+
+        discovery_verify = false;
+        entry->verify = true;
+    }
+
+    if(!vfd_slave_available(msg->adu[0])) {
+        entry->verify = false;
+        return entry->n_data != 0;
+    }
+
+    entry->status = VFD_DiscoveryPending;
+
+    if(!discovery_queue(entry)) {
+        entry->verify = false;
+        entry->status = entry->n_data ? VFD_DiscoveryIdle : VFD_DiscoveryFree;
+        return entry->n_data != 0;
+    }
+
+    return true;
+}
+
 const vfd_ptrs_t *vfd_get_active (void)
 {
     return &vfd_spindle;
@@ -404,8 +1306,18 @@ void vfd_init (void)
 {
     if(modbus_enabled() && (nvs_address = nvs_alloc(sizeof(vfd_settings_t)))) {
 
+#if VFD_DISCOVERY_NVS
+        params_address = nvs_alloc(sizeof(vfd_params_t));
+#endif
+
         settings_register(&vfd_setting_details);
 
+        spindle_trace_init();
+
+#if SPINDLE_ENABLE & VFD_PROFILE_SPINDLES
+        extern void vfd_profile_init (uint8_t ref_id);
+#endif
+
 #if SPINDLE_ENABLE & (1<<SPINDLE_HUANYANG1)
         extern void vfd_huanyang_init (void);
         vfd_huanyang_init();
@@ -417,13 +1329,11 @@ void vfd_init (void)
 #endif
 
 #if SPINDLE_ENABLE & (1<<SPINDLE_GS20)
-        extern void vfd_gs20_init (void);
-        vfd_gs20_init();
+        vfd_profile_init(SPINDLE_GS20);
 #endif
 
 #if SPINDLE_ENABLE & (1<<SPINDLE_YL620A)
-        extern void vfd_yl620_init (void);
-        vfd_yl620_init();
+        vfd_profile_init(SPINDLE_YL620A);
 #endif
 
 #if SPINDLE_ENABLE & (1<<SPINDLE_MODVFD)
@@ -432,13 +1342,11 @@ void vfd_init (void)
 #endif
 
 #if SPINDLE_ENABLE & (1<<SPINDLE_H100)
-        extern void vfd_h100_init (void);
-        vfd_h100_init();
+        vfd_profile_init(SPINDLE_H100);
 #endif
 
 #if SPINDLE_ENABLE & (1<<SPINDLE_NOWFOREVER)
-        extern void vfd_nowforever_init (void);
-        vfd_nowforever_init();
+        vfd_profile_init(SPINDLE_NOWFOREVER);
 #endif
 
         on_spindle_selected = grbl.on_spindle_selected;
@@ -41,6 +41,13 @@
 
 #include "../shared.h"
 
+#if MODBUS_ENABLE & MODBUS_RTU_ENABLED
+#include "../modbus_rtu.h"
+#define VFD_MODBUS_BUSES MODBUS_RTU_BUSES
+#else
+#define VFD_MODBUS_BUSES 1
+#endif
+
 #define VFD_RETRIES     25
 #define VFD_RETRY_DELAY 100
 #define VFD_N_ADRESSES 4
@@ -76,17 +83,97 @@ typedef struct {
     float in_divider;
     float out_multiplier;
     float out_divider;
+#if VFD_MODBUS_BUSES > 1
+#if N_SPINDLE > 1 || N_SYS_SPINDLE > 1
+    uint8_t modbus_bus[VFD_N_ADRESSES]; // ModBus RTU bus the VFD at the corresponding address is on
+#else
+    uint8_t modbus_bus;
+#endif
+#endif
 } vfd_settings_t;
 
-typedef float (*vfd_get_load_ptr)(void);
+// Contiguous register range read with a single request for status polling.
+typedef struct {
+    modbus_function_t function; // ModBus_ReadHoldingRegisters or ModBus_ReadInputRegisters
+    uint16_t reg;               // first register
+    uint8_t n_regs;             // number of registers, the response (5 + 2 * n_regs bytes) must fit in MODBUS_MAX_ADU_SIZE
+} vfd_telemetry_t;
+
+typedef struct {
+    uint32_t last_ms;
+} vfd_poll_t;
+
+#define VFD_SCALE_SHIFT 16
+
+// Unsigned fixed point scale factor with VFD_SCALE_SHIFT fractional bits, for RPM <-> frequency conversions.
+typedef uint32_t vfd_scale_t;
+
+// Single register write for a command or a setpoint.
+typedef struct {
+    modbus_function_t function; // ModBus_WriteRegister, ModBus_WriteRegisters or ModBus_WriteCoil
+    uint16_t reg;               // register, for ModBus_WriteCoil the value written is added to form the coil address and the coil is set
+} vfd_write_t;
+
+// Min and max frequency read from the VFD at spindle selection, clamps the frequency setpoint and sets the RPM range.
+typedef struct {
+    vfd_telemetry_t block;      // n_regs is 0 if not used
+    int8_t min_idx;             // index of the min frequency register in the block, -1 if not in the block
+    int8_t max_idx;             // index of the max frequency register in the block, -1 if not in the block
+} vfd_limits_t;
+
+// Register map of a VFD for the generic engine in profile.c.
+typedef struct {
+    uint8_t ref_id;                             // SPINDLE_xxx spindle number
+    const char *name;                           // spindle name
+    const char *plugin;                         // plugin name and version for the $I report
+    const char *version;
+    const modbus_silence_timeout_t *silence;    // NULL for the default silence periods
+    vfd_write_t state;
+    uint16_t state_cmd[4];                      // command words for stop CW, stop CCW, run CW and run CCW
+    vfd_write_t rpm;
+    float freq_per_rpm;                         // frequency register units per RPM, for setpoint and output frequency
+    bool per_rpm_hz;                            // freq_per_rpm is divided by the RPM per Hz setting ($461)
+    vfd_telemetry_t telemetry;                  // output frequency is the first register
+    vfd_limits_t limits[2];
+} vfd_profile_t;
+
+typedef enum {
+    VFD_BreakerClosed = 0,  // slave is responding
+    VFD_BreakerOpen,        // slave failed repeatedly, requests are refused
+    VFD_BreakerHalfOpen     // a probe request is let through to check if the slave has recovered
+} vfd_breaker_state_t;
+
+typedef enum {
+    VFD_TransactionIdle = 0,
+    VFD_TransactionPending,
+    VFD_TransactionDone,
+    VFD_TransactionFailed
+} vfd_transaction_status_t;
+
+struct vfd_transaction;
+
+typedef void (*vfd_transaction_done_ptr)(struct vfd_transaction *transaction);
+
+// Asynchronous command with retries, used for spindle state changes.
+typedef struct vfd_transaction {
+    volatile vfd_transaction_status_t status;
+    uint8_t retries;
+    uint32_t started;
+    void *context;                          // context of the message, passed to the driver callbacks
+    const modbus_callbacks_t *callbacks;    // driver callbacks, on_rx_packet is called on success
+    vfd_transaction_done_ptr on_done;       // optional, called from the ModBus callback context on completion or failure
+    modbus_message_t msg;                   // copy of the message for retries
+} vfd_transaction_t;
+
+typedef float (*vfd_get_load_ptr)(void); // load in %, vfd_load_changed() must be called when new data is available
 
 typedef struct {
     vfd_get_load_ptr get_load;
 } vfd_ptrs_t;
 
 typedef struct {
-    const spindle_ptrs_t spindle;
-    const vfd_ptrs_t vfd;
+    spindle_ptrs_t spindle;
+    vfd_ptrs_t vfd;
 } vfd_spindle_ptrs_t;
 
 extern vfd_settings_t vfd_config;
@@ -94,6 +181,23 @@ extern vfd_settings_t vfd_config;
 spindle_id_t vfd_register (const vfd_spindle_ptrs_t *vfd, const char *name);
 const vfd_ptrs_t *vfd_get_active (void);
 bool vfd_failed (bool disable);
+void vfd_load_changed (void);
 uint32_t vfd_get_modbus_address (spindle_id_t spindle_id);
+modbus_message_t *vfd_modbus_reserve (modbus_message_t *msg, uint8_t address, bool block);
+bool vfd_modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+bool vfd_poll_due (vfd_poll_t *poll, uint8_t address, spindle_state_t state, spindle_data_t *data, uint_fast8_t frames);
+bool vfd_telemetry_request (const vfd_telemetry_t *block, uint8_t address, const modbus_callbacks_t *callbacks);
+bool vfd_telemetry_get (const vfd_telemetry_t *block, modbus_message_t *msg, uint_fast8_t idx, uint16_t *value);
+vfd_scale_t vfd_scale (float multiplier, float divider);
+uint32_t vfd_scaled (uint32_t value, vfd_scale_t scale);
+bool vfd_slave_available (uint8_t address);
+void vfd_slave_ok (uint8_t address);
+bool vfd_slave_failed (uint8_t address, uint32_t *delay);
+bool vfd_slave_dropped (uint8_t code, uint8_t address, uint32_t *delay);
+vfd_breaker_state_t vfd_slave_state (uint8_t address);
+bool vfd_state_async (spindle_state_t state, spindle_data_t *data);
+bool vfd_transaction_send (vfd_transaction_t *transaction, modbus_message_t *msg, const modbus_callbacks_t *callbacks);
+vfd_transaction_status_t vfd_transaction_get_status (vfd_transaction_t *transaction);
+bool vfd_discovery_read (uint8_t ref_id, modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool cached);
 
 #endif